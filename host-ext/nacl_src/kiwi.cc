@@ -10,6 +10,10 @@
  *
  */
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <sstream>
 #include <unordered_map>
 
@@ -211,6 +215,7 @@ private:
         }
 
         cursor_cache_.clear();
+        MailboxReset();
 
         SocketReceive();
 
@@ -229,6 +234,7 @@ private:
         ControlMessage("disconnected", "Socket closed");
         connected_ = false;
         screen_flying_ = false;
+        MailboxReset();
         Paint(true);
     }
 
@@ -256,8 +262,8 @@ private:
         server_version_ = data;
 
         if (server_version_ != VERSION) {
-            /* TODO: Remove VF1 compatiblity */
-            if (server_version_ == "VF1") {
+            /* TODO: Remove VF1/VF3 compatiblity */
+            if (server_version_ == "VF1" || server_version_ == "VF3") {
                 WarningMessage() << "Outdated server version ("
                                  << server_version_ << "), expecting " << VERSION
                                  << ". Please update your chroot.";
@@ -272,6 +278,8 @@ private:
         connected_ = true;
         SocketSend(pp::Var("VOK"), false);
         ControlMessage("connected", "Version received");
+        if (!LegacyInput())
+            MailboxRegister();
         ChangeResolution(size_.width(), size_.height());
         /* Start requesting frames */
         OnFlush();
@@ -280,12 +288,18 @@ private:
 
     /* Receives and handles a screen_reply request */
     bool SocketParseScreen(const char* data, int datalen) {
-        if (!CheckSize(datalen, sizeof(struct screen_reply), "screen_reply"))
+        /* TODO: Remove VF1/VF3 compatibility (no timings) */
+        bool timings = server_version_ != "VF1" && server_version_ != "VF3";
+        if (!CheckSize(datalen, timings ? sizeof(struct screen_reply) :
+                                    offsetof(struct screen_reply, damage_us),
+                       "screen_reply"))
             return false;
 
         struct screen_reply* reply = (struct screen_reply*)data;
         if (reply->updated) {
             if (!reply->shmfailed) {
+                if (timings)
+                    LatencyReceive(reply);
                 Paint(false);
             } else {
                 /* Blank the frame if shm failed */
@@ -432,6 +446,9 @@ private:
             case 'R':  /* Resolution request reply */
                 if (SocketParseResolution(data, datalen)) return;
                 break;
+            case 'B':  /* Mailbox registration reply */
+                if (SocketParseMailbox(data, datalen)) return;
+                break;
             default:
                 ErrorMessage() << "Invalid request. First char: "
                                << (int)data[0];
@@ -467,11 +484,107 @@ private:
             mm->x = mouse_pos_.x();
             mm->y = mouse_pos_.y();
             array_buffer.Unmap();
-            websocket_->SendMessage(array_buffer);
+            if (!MailboxSend(array_buffer))
+                websocket_->SendMessage(array_buffer);
             pending_mouse_move_ = false;
         }
 
-        websocket_->SendMessage(var);
+        if (!MailboxSend(var))
+            websocket_->SendMessage(var);
+    }
+
+    /* Allocates the input mailbox, and asks the server to find it (VF4) */
+    void MailboxRegister() {
+        MailboxReset();
+
+        PP_ImageDataFormat format = pp::ImageData::GetNativeImageDataFormat();
+        mailbox_data_ = pp::ImageData(this, format, kMailboxSize, true);
+        if (mailbox_data_.is_null())
+            return;
+
+        uint32_t length = mailbox_data_.stride() * kMailboxSize.height();
+        struct mailbox_ring* ring =
+            static_cast<struct mailbox_ring*>(mailbox_data_.data());
+        ring->sig = ((uint64_t)rand() << 32) ^ rand();
+        ring->size = (length - sizeof(*ring)) / MAILBOX_ENTRY_SIZE;
+        ring->waiting = 0;
+        ring->head = ring->tail = 0;
+
+        struct mailbox* m;
+        pp::VarArrayBuffer array_buffer(sizeof(*m));
+        m = static_cast<struct mailbox*>(array_buffer.Map());
+        m->type = 'B';
+        m->ok = 0;
+        m->length = length;
+        m->paddr = (uint64_t)ring;
+        m->sig = ring->sig;
+        array_buffer.Unmap();
+        SocketSend(array_buffer, false);
+    }
+
+    /* Receives and handles a mailbox registration reply */
+    bool SocketParseMailbox(const char* data, int datalen) {
+        if (!CheckSize(datalen, sizeof(struct mailbox), "mailbox"))
+            return false;
+
+        struct mailbox* m = (struct mailbox*)data;
+        if (mailbox_data_.is_null() ||
+            m->paddr != (uint64_t)mailbox_data_.data()) {
+            /* Reply to an older registration: ignore. */
+            return true;
+        }
+
+        LogMessage(0) << "Input mailbox " << (m->ok ? "in use" : "not found");
+        if (m->ok)
+            mailbox_ = static_cast<struct mailbox_ring*>(mailbox_data_.data());
+        else
+            MailboxReset();
+        return true;
+    }
+
+    /* Stops using the input mailbox */
+    void MailboxReset() {
+        mailbox_ = NULL;
+        mailbox_data_ = pp::ImageData();
+    }
+
+    /* Writes a small input packet to the mailbox, if it is in use, and
+     * nudges the server if it is asleep. Returns false if the packet must
+     * be sent over the WebSocket instead. */
+    bool MailboxSend(const pp::Var& var) {
+        if (!mailbox_ || !var.is_array_buffer())
+            return false;
+
+        pp::VarArrayBuffer array_buffer(var);
+        uint32_t length = array_buffer.ByteLength();
+        if (length < 1 || length >= MAILBOX_ENTRY_SIZE)
+            return false;
+
+        const char* data = static_cast<char*>(array_buffer.Map());
+        if (!strchr("KCMWT", data[0])) {
+            array_buffer.Unmap();
+            return false;
+        }
+
+        /* Ring full: the server drains the mailbox before handling any
+         * WebSocket packet, so ordering is preserved. */
+        uint32_t head = mailbox_->head;
+        uint32_t tail = __atomic_load_n(&mailbox_->tail, __ATOMIC_SEQ_CST);
+        if (head - tail >= mailbox_->size) {
+            array_buffer.Unmap();
+            return false;
+        }
+
+        uint8_t* entry = mailbox_->entries[head % mailbox_->size];
+        entry[0] = length;
+        memcpy(entry+1, data, length);
+        array_buffer.Unmap();
+        __atomic_store_n(&mailbox_->head, head+1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&mailbox_->waiting, 0, __ATOMIC_SEQ_CST))
+            websocket_->SendMessage(pp::Var("N"));
+
+        return true;
     }
 
     /** UI functions **/
@@ -595,6 +708,30 @@ public:
         } else if (event.GetType() == PP_INPUTEVENT_TYPE_WHEEL) {
             pp::WheelInputEvent wheel_event(event);
 
+            if (!LegacyInput()) {
+                /* Let the server handle partial clicks (16 pixels of delta
+                 * is a full click) */
+                wheel_hires_x_ += wheel_event.GetDelta().x()*WHEEL_CLICK/16;
+                wheel_hires_y_ += wheel_event.GetDelta().y()*WHEEL_CLICK/16;
+                /* dx/dy are int16_t: a fast fling must not wrap around
+                 * (and flip the direction), drop the excess instead. */
+                wheel_hires_x_ = std::max<float>(INT16_MIN,
+                        std::min<float>(INT16_MAX, wheel_hires_x_));
+                wheel_hires_y_ = std::max<float>(INT16_MIN,
+                        std::min<float>(INT16_MAX, wheel_hires_y_));
+                int dx = wheel_hires_x_;
+                int dy = wheel_hires_y_;
+                LogMessage(2) << "MWd " << wheel_event.GetDelta().x() << "x"
+                                        << wheel_event.GetDelta().y()
+                              << " hires " << dx << "x" << dy;
+                if (dx != 0 || dy != 0) {
+                    SendWheel(dx, dy);
+                    wheel_hires_x_ -= dx;
+                    wheel_hires_y_ -= dy;
+                }
+                return PP_TRUE;
+            }
+
             mouse_wheel_x += wheel_event.GetDelta().x();
             mouse_wheel_y += wheel_event.GetDelta().y();
 
@@ -625,14 +762,34 @@ public:
         } else if (event.GetType() == PP_INPUTEVENT_TYPE_TOUCHSTART ||
                    event.GetType() == PP_INPUTEVENT_TYPE_TOUCHMOVE ||
                    event.GetType() == PP_INPUTEVENT_TYPE_TOUCHEND) {
-            /* FIXME: This is a very primitive implementation:
-             * we only handle single touch */
-
             pp::TouchInputEvent touch_event(event);
 
             int count = touch_event.GetTouchCount(
                 PP_TOUCHLIST_TYPE_CHANGEDTOUCHES);
 
+            if (!LegacyInput()) {
+                /* Forward all touch points, the server takes care of
+                 * emulating the mouse if needed. */
+                int state = TOUCH_MOVE;
+                if (event.GetType() == PP_INPUTEVENT_TYPE_TOUCHSTART)
+                    state = TOUCH_START;
+                else if (event.GetType() == PP_INPUTEVENT_TYPE_TOUCHEND)
+                    state = TOUCH_END;
+                for (int i = 0; i < count; i++) {
+                    pp::TouchPoint tp = touch_event.GetTouchByIndex(
+                        PP_TOUCHLIST_TYPE_CHANGEDTOUCHES, i);
+                    LogMessage(2) << "TOUCH " << state << " " << tp.id()
+                                  << "//" << tp.position().x() << "/"
+                                  << tp.position().y();
+                    SendTouch(tp.id(), state, tp.position().x() * scale_,
+                              tp.position().y() * scale_);
+                }
+                return PP_TRUE;
+            }
+
+            /* VF1/VF3: This is a very primitive implementation:
+             * we only handle single touch */
+
             Message m = LogMessage(2);
             m << "TOUCH " << count << " ";
 
@@ -867,6 +1024,42 @@ private:
         SetTargetFPS(kFullFPS);
     }
 
+    /* Sends a mouse wheel motion (WHEEL_CLICK units per click) */
+    void SendWheel(int dx, int dy) {
+        struct mousewheel* mw;
+        pp::VarArrayBuffer array_buffer(sizeof(*mw));
+        mw = static_cast<struct mousewheel*>(array_buffer.Map());
+        mw->type = 'W';
+        mw->dx = dx;
+        mw->dy = dy;
+        array_buffer.Unmap();
+        SocketSend(array_buffer, true);
+    }
+
+    /* Sends a touch point update */
+    void SendTouch(uint32_t id, int state, int x, int y) {
+        struct touch* t;
+        pp::VarArrayBuffer array_buffer(sizeof(*t));
+        t = static_cast<struct touch*>(array_buffer.Map());
+        t->type = 'T';
+        t->state = state;
+        t->id = id;
+        t->x = x;
+        t->y = y;
+        array_buffer.Unmap();
+        SocketSend(array_buffer, false);
+
+        /* That means we have focus */
+        SetTargetFPS(kFullFPS);
+    }
+
+    /* Returns true if the server does not support wheel/touch events (VF4),
+     * and expects emulated clicks instead.
+     * TODO: Drop support for VF1/VF3 */
+    bool LegacyInput() {
+        return server_version_ == "VF1" || server_version_ == "VF3";
+    }
+
     void SendSearchKey(int down) {
         /* TODO: Drop support for VF1 */
         if (server_version_ == "VF1")
@@ -946,12 +1139,85 @@ private:
 
         array_buffer.Unmap();
         SocketSend(array_buffer, true);
+        request_time_ = pp::Module::Get()->core()->GetTimeTicks();
+    }
+
+    /* Records the server-side timings of a frame, as well as the time spent
+     * on the socket, then starts timing the client side (paint, flush). */
+    void LatencyReceive(const struct screen_reply* reply) {
+        receive_time_ = pp::Module::Get()->core()->GetTimeTicks();
+        double rtt = receive_time_ - request_time_;
+
+        /* Each stage runs from the previous stamp that is set: stamps of
+         * skipped stages are 0. */
+        const uint32_t stamps[] = {
+            reply->damage_us, reply->grab_us, reply->copy_us
+        };
+        const int stages[] = { kStageDamage, kStageGrab, kStageCopy };
+        double last = 0;
+        for (int i = 0; i < 3; i++) {
+            if (stamps[i] == 0)
+                continue;
+            latency_[stages[i]].Add((stamps[i] - last) / 1e6);
+            last = stamps[i];
+        }
+        latency_[kStageSocket].Add(rtt - reply->send_us / 1e6);
+
+        LogMessage(3) << "Frame timings (ms): rtt " << rtt*1000
+                      << " damage " << reply->damage_us / 1000.0
+                      << " grab " << reply->grab_us / 1000.0
+                      << " copy " << reply->copy_us / 1000.0
+                      << " send " << reply->send_us / 1000.0;
+
+        frame_timed_ = true;
+    }
+
+    /* Records client-side timings of the frame, at flush completion, and
+     * reports the latency histograms periodically (debug mode only). */
+    void LatencyFlush() {
+        if (!frame_timed_)
+            return;
+        frame_timed_ = false;
+
+        PP_TimeTicks now = pp::Module::Get()->core()->GetTimeTicks();
+        latency_[kStagePaint].Add(paint_time_ - receive_time_);
+        latency_[kStageFlush].Add(now - paint_time_);
+        latency_[kStageTotal].Add(now - request_time_);
+
+        LogMessage(3) << "Frame timings (ms): paint "
+                      << (paint_time_ - receive_time_)*1000
+                      << " flush " << (now - paint_time_)*1000
+                      << " total " << (now - request_time_)*1000;
+
+        if (now - latency_report_time_ < kLatencyReportPeriod)
+            return;
+
+        if (debug_ >= 1) {
+            const char* names[kStageCount] = {
+                "damage", "grab", "copy", "socket", "paint", "flush", "total"
+            };
+            Message m = LogMessage(1);
+            m << "Latency (ms) over " << latency_[kStageTotal].count
+              << " frames: p50/p90/p99/max";
+            for (int i = 0; i < kStageCount; i++) {
+                const Histogram& h = latency_[i];
+                m << "\n    " << names[i] << ": "
+                  << h.Percentile(0.5) << "/" << h.Percentile(0.9) << "/"
+                  << h.Percentile(0.99) << "/" << h.max*1000;
+            }
+        }
+
+        for (int i = 0; i < kStageCount; i++)
+            latency_[i].Reset();
+        latency_report_time_ = now;
     }
 
     /* Called when the last frame was displayed (Vsync-ed): allocates next
      * buffer and requests next frame.
      * Parameter is ignored: used for callbacks */
     void OnFlush(int32_t /*result*/ = 0) {
+        LatencyFlush();
+
         PP_Time time_ = pp::Module::Get()->core()->GetTime();
         PP_Time deltat = time_-lasttime_;
 
@@ -1022,6 +1288,7 @@ private:
          * the callback is called, even if context_ changes before the flush
          * completes. */
         flush_context_ = context_;
+        paint_time_ = pp::Module::Get()->core()->GetTimeTicks();
         context_.Flush(
             callback_factory_.NewCallback(&KiwiInstance::OnFlush));
     }
@@ -1034,6 +1301,12 @@ private:
 
     const int kMaxRetry = 3;  /* Maximum number of connection attempts */
 
+    /* Report latency histograms every 10 seconds (debug mode) */
+    const double kLatencyReportPeriod = 10.0;
+
+    /* Input mailbox buffer size (4 bytes per pixel) */
+    const pp::Size kMailboxSize{64, 16};
+
     /* Class members */
     pp::CompletionCallbackFactory<KiwiInstance> callback_factory_{this};
     pp::Graphics2D context_;
@@ -1051,6 +1324,9 @@ private:
     int retry_ = 0;
     bool connected_ = false;
     std::string server_version_ = "";
+    /* Input mailbox (VF4), NULL if not in use */
+    pp::ImageData mailbox_data_;
+    struct mailbox_ring* mailbox_ = NULL;
     bool screen_flying_ = false;
     pp::Var receive_var_;
     int target_fps_ = kFullFPS;
@@ -1062,6 +1338,9 @@ private:
     /* Mouse wheel accumulators */
     int mouse_wheel_x = 0;
     int mouse_wheel_y = 0;
+    /* Partial high-resolution wheel motion, not sent yet (VF4) */
+    float wheel_hires_x_ = 0;
+    float wheel_hires_y_ = 0;
 
     /* Search key state:
      * - active/inactive: Key is pushed on Chromium OS side
@@ -1081,6 +1360,64 @@ private:
     PP_Time lasttime_;
     double avgfps_ = 0.0;
 
+    /* Latency histogram: bucket i counts samples between 2^(i-1) and 2^i
+     * microseconds. */
+    class Histogram {
+public:
+        static const int kBuckets = 24;
+
+        void Add(double seconds) {
+            if (seconds < 0)
+                seconds = 0;
+            int i = 0;
+            while (i < kBuckets-1 && seconds*1e6 >= (1 << i))
+                i++;
+            buckets[i]++;
+            count++;
+            if (seconds > max)
+                max = seconds;
+        }
+
+        void Reset() {
+            *this = Histogram();
+        }
+
+        /* Returns the upper bound of the bucket containing the given
+         * percentile (capped to the maximum), in milliseconds. */
+        double Percentile(double p) const {
+            int target = p*count + 0.5;
+            int sum = 0;
+            for (int i = 0; i < kBuckets; i++) {
+                sum += buckets[i];
+                if (sum >= target && sum > 0)
+                    return std::min((1 << i) / 1000.0, max*1000);
+            }
+            return 0.0;
+        }
+
+        int buckets[kBuckets] = { 0 };
+        int count = 0;
+        double max = 0.0;
+    };
+
+    /* Frame latency stages */
+    enum {
+        kStageDamage,  /* Server: damage and cursor events drained */
+        kStageGrab,    /* Server: XShmGetImage */
+        kStageCopy,    /* Server: copy to shm buffer */
+        kStageSocket,  /* Round trip, minus time spent on the server */
+        kStagePaint,   /* Reply received to ReplaceContents */
+        kStageFlush,   /* Flush call to completion */
+        kStageTotal,   /* Request sent to flush completion */
+        kStageCount
+    };
+    Histogram latency_[kStageCount];
+    PP_TimeTicks latency_report_time_ = 0;
+    PP_TimeTicks request_time_ = 0;  /* Last screen request sent */
+    PP_TimeTicks receive_time_ = 0;  /* Last updated frame received */
+    PP_TimeTicks paint_time_ = 0;  /* Last frame painted */
+    bool frame_timed_ = false;  /* Current frame timings are being recorded */
+
     /* Cursor cache */
     class Cursor {
 public:
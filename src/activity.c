@@ -0,0 +1,173 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Forwards user activity on the X11 server specified in DISPLAY to Chromium
+ * OS's powerd (croutonpowerd --daemon), so that the system does not dim or
+ * suspend while the chroot is being used.
+ *
+ * Raw input events are monitored permanently with XInput 2. powerd is told
+ * about activity at most once every interval (HandleUserActivity), over a
+ * single D-Bus connection: activity that happens in between is reported at
+ * the end of the interval. Nothing happens while the user is idle.
+ *
+ * If the screensaver is disabled (timeout 0, e.g. by xdg-screensaver
+ * suspend), powerd is pinged every interval, like with croutonpowerd -i.
+ */
+
+#include "xi2.h"
+#include "dbus.h"
+#include <signal.h>
+#include <time.h>
+
+#define DEFAULT_INTERVAL 10  /* s */
+
+#define POWERD_DEST "org.chromium.PowerManager"
+#define POWERD_PATH "/org/chromium/PowerManager"
+#define POWERD_ACTIVITY "HandleUserActivity"
+
+static int verbose = 0;
+static struct dbus_connection bus = { -1, 0 };
+
+/* Returns the monotonic time, in ms. */
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Tell powerd about user activity, connecting to the system bus if
+ * needed. Returns 0 on success. */
+static int ping_powerd() {
+    int retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        if (bus.fd < 0 && dbus_connect(&bus) < 0) {
+            perror("Cannot connect to the system bus");
+            return -1;
+        }
+        /* The call is not waited for: replies are drained when they
+         * arrive. */
+        if (dbus_send_call(&bus, POWERD_DEST, POWERD_PATH, POWERD_DEST,
+                           POWERD_ACTIVITY, DBUS_NO_REPLY_EXPECTED)) {
+            if (verbose)
+                fprintf(stderr, "Activity reported.\n");
+            return 0;
+        }
+        /* The bus may have dropped the connection: reconnect once. */
+        dbus_close(&bus);
+    }
+
+    perror("Cannot send " POWERD_ACTIVITY);
+    return -1;
+}
+
+/* Returns non-zero if the screensaver is disabled. */
+static int screensaver_disabled(Display* display) {
+    int timeout, interval, blanking, exposures;
+    XGetScreenSaver(display, &timeout, &interval, &blanking, &exposures);
+    return timeout == 0;
+}
+
+static void usage(char* argv0) {
+    fprintf(stderr, "%s [-v] [-i interval]\n", argv0);
+    fprintf(stderr, "   Forwards user activity to Chromium OS's powerd.\n");
+    fprintf(stderr, "   -i: report activity at most once every interval "
+                    "seconds (default: %d).\n", DEFAULT_INTERVAL);
+    fprintf(stderr, "   -v: print a message for each report.\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    long long interval = DEFAULT_INTERVAL * 1000LL;
+    long long last = 0;  /* Last report (0: none yet) */
+    int active = 0;  /* Activity since the last report */
+    struct pollfd fds[2];
+    int xi_opcode, c;
+
+    while ((c = getopt(argc, argv, "i:v")) != -1) {
+        switch (c) {
+        case 'i':
+            interval = atoi(optarg) * 1000LL;
+            if (interval <= 0)
+                usage(argv[0]);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    Display* display = XOpenDisplay(NULL);
+
+    if (display == NULL) {
+        fprintf(stderr, "Unable to connect to X server\n");
+        return 1;
+    }
+
+    xi_opcode = xi2_select(display, XIAllMasterDevices, NULL, 0);
+    if (xi_opcode < 0)
+        return 1;
+
+    /* Connect early, but do not fail if powerd is not there yet. */
+    if (dbus_connect(&bus) < 0)
+        perror("Cannot connect to the system bus");
+
+    fds[0].fd = ConnectionNumber(display);
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        long long now = now_ms();
+        int timeout = -1;
+
+        /* Report at most once every interval. */
+        if (active && (!last || now - last >= interval)) {
+            ping_powerd();
+            last = now;
+            active = 0;
+        }
+
+        if (active) {
+            timeout = last + interval - now;
+        } else if (screensaver_disabled(display)) {
+            /* Checked again at the end of the interval */
+            active = 1;
+            timeout = last + interval - now;
+            if (timeout < 0)
+                timeout = 0;
+        }
+
+        XFlush(display);
+        fds[1].fd = bus.fd;
+        fds[0].revents = fds[1].revents = 0;
+        if (XPending(display) == 0 && poll(fds, 2, timeout) < 0 &&
+                errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[1].revents && dbus_drain(&bus) < 0)
+            dbus_close(&bus);
+
+        while (XPending(display)) {
+            XEvent event;
+            XGenericEventCookie *cookie = &event.xcookie;
+
+            XNextEvent(display, &event);
+            if (XGetEventData(display, cookie)) {
+                if (xi2_is_raw(cookie, xi_opcode))
+                    active = 1;
+                XFreeEventData(display, cookie);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,933 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Synchronizes the clipboard between X11 displays and Chromium OS, without
+ * forking any process (croutonclip uses it when it is available).
+ *
+ * Clipboard ownership is watched on each display with XFixes. When the
+ * current display changes (SIGUSR1 from croutoncycle, or VT change), the
+ * content of the display that was left is read into memory if it changed,
+ * then handed over to the new display, unless that display already holds the
+ * same content (content hash). This daemon owns the clipboard on the
+ * displays it copied to, and serves the content from memory.
+ *
+ * Chromium OS is reached through croutonwebsocket's request socket.
+ */
+
+#include "request.h"
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xfixes.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define MAX_DISPLAYS 16
+#define MAX_CLIP (16*1048576)  /* Same as croutonwebsocket MAXFRAMESIZE */
+#define READ_TIMEOUT 1000  /* ms, for each step of a selection transfer */
+
+/* Pseudo display numbers */
+#define CROS -1  /* Chromium OS */
+#define NONE -2  /* Unknown */
+
+#define HOST_XAUTHORITY "/var/host/Xauthority"  /* See host-x11 */
+#define TTY_ACTIVE "/sys/class/tty/tty0/active"
+#define KIWI_DISPLAY "/tmp/crouton-ext/kiwi-display"  /* See croutoncycle */
+
+/* 0 - Quiet
+ * 1 - General messages (displays, errors)
+ * 2 - 1 + Information on each copy
+ * 3 - 2 + Extra information */
+static int verbose = 0;
+
+#define log(level, str, ...) do { \
+    if (verbose >= (level)) printf("%s: " str "\n", __func__, ##__VA_ARGS__); \
+} while (0)
+
+#define error(str, ...) printf("%s: " str "\n", __func__, ##__VA_ARGS__)
+
+enum {
+    ATOM_CLIPBOARD, ATOM_TARGETS, ATOM_UTF8_STRING, ATOM_TEXT, ATOM_INCR,
+    ATOM_CROUTON_CLIPBOARD, ATOM_XFREE86_VT, ATOM_CROUTON_XMETHOD, NATOMS
+};
+
+static char* atom_names[NATOMS] = {
+    "CLIPBOARD", "TARGETS", "UTF8_STRING", "TEXT", "INCR",
+    "CROUTON_CLIPBOARD", "XFree86_VT", "CROUTON_XMETHOD"
+};
+
+struct display {
+    int num;  /* Display number, -1 if the slot is free */
+    Display* dpy;
+    Window win;  /* Our window, used to own and read the selection */
+    Atom atoms[NATOMS];
+    int fixes_event;
+    size_t chunk;  /* Largest property we write at once */
+    int owned;  /* We own the clipboard */
+    int changed;  /* Another client took the clipboard since the last read */
+    uint64_t hash;  /* Hash of the content we gave the display */
+    /* Incremental transfer in progress (if incr_win is not None) */
+    Window incr_win;
+    Atom incr_prop;
+    Atom incr_type;
+    size_t incr_pos;
+};
+
+static struct display displays[MAX_DISPLAYS];
+
+/* Clipboard content, as last read from a display or Chromium OS. */
+static char* clip = NULL;
+static size_t clip_len = 0;
+static uint64_t clip_hash = 0;
+
+/* Hash of the content Chromium OS holds, 0 if unknown. */
+static uint64_t cros_hash = 0;
+
+/* Display the clipboard content was last copied from (or to). */
+static int current = CROS;
+
+/* Set when a display connection is lost (see io_error_handler). */
+static sigjmp_buf io_error_jmp;
+static Display* io_error_dpy = NULL;
+
+static void display_handle_event(struct display* d, XEvent* ev);
+
+/* 64-bit FNV-1a hash, never 0 (0 means unknown). */
+static uint64_t hash(const char* data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+/* Returns the number of milliseconds until deadline (CLOCK_MONOTONIC, in
+ * ms), or 0 if it has passed. */
+static int time_left(uint64_t deadline) {
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+    return now < deadline ? deadline - now : 0;
+}
+
+/* Set the clipboard content, taking ownership of data (which may be NULL if
+ * len is 0). */
+static void clip_set(char* data, size_t len) {
+    uint64_t h = hash(data, len);
+    int i;
+
+    if (h == clip_hash) {
+        log(3, "Same content (%zu bytes).", len);
+        free(data);
+        return;
+    }
+
+    log(2, "New content (%zu bytes).", len);
+
+    /* Incremental transfers of the old content cannot be completed. */
+    for (i = 0; i < MAX_DISPLAYS; i++) {
+        struct display* d = &displays[i];
+        if (d->num >= 0 && d->incr_win != None) {
+            XSelectInput(d->dpy, d->incr_win, NoEventMask);
+            d->incr_win = None;
+        }
+    }
+
+    free(clip);
+    clip = data;
+    clip_len = len;
+    clip_hash = h;
+}
+
+/**/
+/* X11 displays */
+/**/
+
+static int xerror_handler(Display* dpy, XErrorEvent* e) {
+    if (verbose < 1)
+        return 0;
+    char msg[64] = {0};
+    char op[32] = {0};
+    sprintf(msg, "%d", e->request_code);
+    XGetErrorDatabaseText(dpy, "XRequest", msg, "", op, sizeof(op));
+    XGetErrorText(dpy, e->error_code, msg, sizeof(msg));
+    error("%s (%s)", msg, op);
+    return 0;
+}
+
+/* Xlib exits if this handler returns: jump back to the main loop instead,
+ * which forgets about the display. */
+static int io_error_handler(Display* dpy) {
+    io_error_dpy = dpy;
+    siglongjmp(io_error_jmp, 1);
+}
+
+static struct display* display_find(int num) {
+    int i;
+
+    for (i = 0; i < MAX_DISPLAYS; i++) {
+        if (displays[i].num == num && num >= 0)
+            return &displays[i];
+    }
+    return NULL;
+}
+
+/* Forget about a display whose connection was lost. The Display structure
+ * is leaked, as XCloseDisplay would hit the same error. */
+static void display_lost(Display* dpy) {
+    int i;
+
+    for (i = 0; i < MAX_DISPLAYS; i++) {
+        struct display* d = &displays[i];
+        if (d->num >= 0 && d->dpy == dpy) {
+            log(1, "Lost display :%d.", d->num);
+            close(ConnectionNumber(dpy));
+            d->num = -1;
+            d->dpy = NULL;
+        }
+    }
+}
+
+/* Connect to display :num, and watch its clipboard. */
+static struct display* display_open(int num) {
+    struct display* d = NULL;
+    char name[16];
+    char* xauth = NULL;
+    int error_base;
+    int i;
+
+    for (i = 0; i < MAX_DISPLAYS && !d; i++) {
+        if (displays[i].num < 0)
+            d = &displays[i];
+    }
+    if (!d) {
+        error("Too many displays.");
+        return NULL;
+    }
+
+    snprintf(name, sizeof(name), ":%d", num);
+
+    /* :0 is the Chromium OS X11 server, with its own authority file. */
+    if (num == 0) {
+        if (getenv("XAUTHORITY"))
+            xauth = strdup(getenv("XAUTHORITY"));
+        setenv("XAUTHORITY", HOST_XAUTHORITY, 1);
+    }
+    d->dpy = XOpenDisplay(name);
+    if (num == 0) {
+        if (xauth)
+            setenv("XAUTHORITY", xauth, 1);
+        else
+            unsetenv("XAUTHORITY");
+        free(xauth);
+    }
+
+    if (!d->dpy) {
+        log(2, "Cannot open display %s.", name);
+        return NULL;
+    }
+
+    if (!XFixesQueryExtension(d->dpy, &d->fixes_event, &error_base)) {
+        error("%s is missing the XFixes extension.", name);
+        XCloseDisplay(d->dpy);
+        d->dpy = NULL;
+        return NULL;
+    }
+
+    log(1, "Watching display %s.", name);
+
+    fcntl(ConnectionNumber(d->dpy), F_SETFD, FD_CLOEXEC);
+    XInternAtoms(d->dpy, atom_names, NATOMS, False, d->atoms);
+
+    Window root = DefaultRootWindow(d->dpy);
+    d->win = XCreateSimpleWindow(d->dpy, root, -1, -1, 1, 1, 0, 0, 0);
+    XSelectInput(d->dpy, d->win, PropertyChangeMask);
+    XFixesSelectSelectionInput(d->dpy, root, d->atoms[ATOM_CLIPBOARD],
+                               XFixesSetSelectionOwnerNotifyMask |
+                               XFixesSelectionWindowDestroyNotifyMask |
+                               XFixesSelectionClientCloseNotifyMask);
+    XFlush(d->dpy);
+
+    /* XMaxRequestSize is in 4-byte units; leave room for the header. */
+    d->chunk = XMaxRequestSize(d->dpy)*4 - 256;
+    d->num = num;
+    d->owned = 0;
+    d->changed = 1;  /* Unknown content */
+    d->hash = 0;
+    d->incr_win = None;
+    return d;
+}
+
+/* Connect to the X11 servers that are not known yet (/tmp/.X*-lock). */
+static void display_scan() {
+    DIR* dir = opendir("/tmp");
+    struct dirent* ent;
+    int num;
+    char c;
+
+    if (!dir)
+        return;
+
+    while ((ent = readdir(dir))) {
+        if (sscanf(ent->d_name, ".X%d-lock%c", &num, &c) == 1 &&
+                num >= 0 && !display_find(num))
+            display_open(num);
+    }
+
+    closedir(dir);
+}
+
+/* Returns an INTEGER property of the root window, or -1. */
+static long display_root_int(struct display* d, Atom prop) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data = NULL;
+    long value = -1;
+
+    if (XGetWindowProperty(d->dpy, DefaultRootWindow(d->dpy), prop, 0, 1,
+                           False, XA_INTEGER, &type, &format, &nitems,
+                           &after, &data) == Success &&
+            type == XA_INTEGER && format == 32 && nitems == 1)
+        value = *(long*)data;
+
+    if (data)
+        XFree(data);
+    return value;
+}
+
+/* Returns 1 if the display is a crouton-in-a-tab one. */
+static int display_is_xiwi(struct display* d) {
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data = NULL;
+    int xiwi = 0;
+
+    if (XGetWindowProperty(d->dpy, DefaultRootWindow(d->dpy),
+                           d->atoms[ATOM_CROUTON_XMETHOD], 0, 16, False,
+                           XA_STRING, &type, &format, &nitems, &after,
+                           &data) == Success &&
+            type == XA_STRING && format == 8)
+        xiwi = nitems == 4 && !memcmp(data, "xiwi", 4);
+
+    if (data)
+        XFree(data);
+    return xiwi;
+}
+
+/* Wait for an event of the given type on our window, handling other events
+ * meanwhile. Returns 0 on success, -1 on timeout. */
+static int display_wait(struct display* d, int type, XEvent* ev) {
+    struct pollfd pfd = { ConnectionNumber(d->dpy), POLLIN, 0 };
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t deadline = (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000 +
+                        READ_TIMEOUT;
+
+    while (1) {
+        while (XPending(d->dpy)) {
+            XNextEvent(d->dpy, ev);
+            if (ev->type == type && ev->xany.window == d->win)
+                return 0;
+            display_handle_event(d, ev);
+        }
+        if (poll(&pfd, 1, time_left(deadline)) <= 0)
+            return -1;
+    }
+}
+
+/* Read our property, following the INCR protocol if needed. Returns the
+ * content in a newly allocated buffer, and its length in len, or NULL on
+ * error. */
+static char* display_read_property(struct display* d, size_t* len) {
+    Atom prop = d->atoms[ATOM_CROUTON_CLIPBOARD];
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data;
+    char* buf = NULL;
+    int incr = 0;
+    XEvent ev;
+
+    *len = 0;
+
+    while (1) {
+        if (XGetWindowProperty(d->dpy, d->win, prop, 0, MAX_CLIP/4, True,
+                               AnyPropertyType, &type, &format, &nitems,
+                               &after, &data) != Success) {
+            error("Cannot read property.");
+            goto error;
+        }
+
+        if (type == d->atoms[ATOM_INCR]) {
+            /* Deleting the property starts the transfer. */
+            log(3, "Incremental transfer.");
+            incr = 1;
+        } else if (format != 8 || after > 0 || *len + nitems > MAX_CLIP) {
+            error("Unexpected content (format %d, %lu bytes).",
+                  format, nitems + after);
+            XFree(data);
+            goto error;
+        } else if (nitems > 0 || !buf) {
+            char* newbuf = realloc(buf, *len + nitems + 1);
+            if (!newbuf) {
+                XFree(data);
+                goto error;
+            }
+            buf = newbuf;
+            memcpy(buf + *len, data, nitems);
+            *len += nitems;
+        }
+        XFree(data);
+
+        /* Done, unless more chunks follow (a zero-length one ends it). */
+        if (!incr || (nitems == 0 && type != d->atoms[ATOM_INCR]))
+            return buf;
+
+        do {
+            if (display_wait(d, PropertyNotify, &ev) < 0) {
+                error("Timeout during incremental transfer.");
+                goto error;
+            }
+        } while (ev.xproperty.atom != prop ||
+                 ev.xproperty.state != PropertyNewValue);
+    }
+
+error:
+    free(buf);
+    return NULL;
+}
+
+/* Read the clipboard content of d into clip. Returns 0 on success, -1 on
+ * error. */
+static int display_read(struct display* d) {
+    Atom targets[] = { d->atoms[ATOM_UTF8_STRING], XA_STRING };
+    Atom prop = d->atoms[ATOM_CROUTON_CLIPBOARD];
+    XEvent ev;
+    int i;
+
+    if (XGetSelectionOwner(d->dpy, d->atoms[ATOM_CLIPBOARD]) == None) {
+        log(2, "Clipboard of :%d is empty.", d->num);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(targets)/sizeof(targets[0]); i++) {
+        XDeleteProperty(d->dpy, d->win, prop);
+        XConvertSelection(d->dpy, d->atoms[ATOM_CLIPBOARD], targets[i],
+                          prop, d->win, CurrentTime);
+
+        do {
+            if (display_wait(d, SelectionNotify, &ev) < 0) {
+                error("Timeout reading the clipboard of :%d.", d->num);
+                return -1;
+            }
+        } while (ev.xselection.target != targets[i]);
+
+        if (ev.xselection.property == None)
+            continue;
+
+        size_t len;
+        char* data = display_read_property(d, &len);
+        if (!data)
+            return -1;
+
+        clip_set(data, len);
+        d->hash = clip_hash;
+        return 0;
+    }
+
+    log(2, "No text in the clipboard of :%d.", d->num);
+    return -1;
+}
+
+/* Take ownership of the clipboard of d, to serve clip. */
+static void display_own(struct display* d) {
+    Atom selection = d->atoms[ATOM_CLIPBOARD];
+
+    XSetSelectionOwner(d->dpy, selection, d->win, CurrentTime);
+    if (XGetSelectionOwner(d->dpy, selection) != d->win) {
+        error("Cannot own the clipboard of :%d.", d->num);
+        return;
+    }
+
+    d->owned = 1;
+    d->changed = 0;
+    d->hash = clip_hash;
+}
+
+/* Reply to a request for the clipboard content. */
+static void display_request(struct display* d, XSelectionRequestEvent* req) {
+    Atom prop = req->property != None ? req->property : req->target;
+    Atom utf8 = d->atoms[ATOM_UTF8_STRING];
+    XEvent ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.xselection.type = SelectionNotify;
+    ev.xselection.requestor = req->requestor;
+    ev.xselection.selection = req->selection;
+    ev.xselection.target = req->target;
+    ev.xselection.time = req->time;
+    ev.xselection.property = None;
+
+    if (!d->owned || req->selection != d->atoms[ATOM_CLIPBOARD]) {
+        /* Refuse */
+    } else if (req->target == d->atoms[ATOM_TARGETS]) {
+        Atom targets[] = {
+            d->atoms[ATOM_TARGETS], utf8, XA_STRING, d->atoms[ATOM_TEXT]
+        };
+        XChangeProperty(d->dpy, req->requestor, prop, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char*)targets,
+                        sizeof(targets)/sizeof(targets[0]));
+        ev.xselection.property = prop;
+    } else if (req->target == utf8 || req->target == XA_STRING ||
+               req->target == d->atoms[ATOM_TEXT]) {
+        Atom type = req->target == XA_STRING ? XA_STRING : utf8;
+
+        if (clip_len <= d->chunk) {
+            XChangeProperty(d->dpy, req->requestor, prop, type, 8,
+                            PropModeReplace, (unsigned char*)clip, clip_len);
+            ev.xselection.property = prop;
+        } else if (d->incr_win == None) {
+            /* Too large for a single property: the requestor deletes the
+             * property each time it has read a chunk. */
+            long size = clip_len;
+            log(2, "Incremental transfer to 0x%lx.", req->requestor);
+            XSelectInput(d->dpy, req->requestor,
+                         PropertyChangeMask | StructureNotifyMask);
+            XChangeProperty(d->dpy, req->requestor, prop,
+                            d->atoms[ATOM_INCR], 32, PropModeReplace,
+                            (unsigned char*)&size, 1);
+            d->incr_win = req->requestor;
+            d->incr_prop = prop;
+            d->incr_type = type;
+            d->incr_pos = 0;
+            ev.xselection.property = prop;
+        } else {
+            log(1, "Incremental transfer already in progress.");
+        }
+    }
+
+    XSendEvent(d->dpy, req->requestor, False, NoEventMask, &ev);
+}
+
+/* Send the next chunk of an incremental transfer. */
+static void display_incr_next(struct display* d) {
+    size_t n = clip_len - d->incr_pos;
+
+    if (n > d->chunk)
+        n = d->chunk;
+
+    XChangeProperty(d->dpy, d->incr_win, d->incr_prop, d->incr_type, 8,
+                    PropModeReplace, (unsigned char*)clip + d->incr_pos, n);
+    d->incr_pos += n;
+
+    /* The zero-length chunk ends the transfer. */
+    if (n == 0) {
+        XSelectInput(d->dpy, d->incr_win, NoEventMask);
+        d->incr_win = None;
+    }
+}
+
+static void display_handle_event(struct display* d, XEvent* ev) {
+    if (ev->type == d->fixes_event + XFixesSelectionNotify) {
+        XFixesSelectionNotifyEvent* sev = (XFixesSelectionNotifyEvent*)ev;
+        if (sev->selection == d->atoms[ATOM_CLIPBOARD] &&
+                sev->owner != d->win) {
+            log(3, "Clipboard of :%d changed.", d->num);
+            d->owned = 0;
+            d->changed = 1;
+        }
+        return;
+    }
+
+    switch (ev->type) {
+    case SelectionRequest:
+        display_request(d, &ev->xselectionrequest);
+        break;
+    case SelectionClear:
+        d->owned = 0;
+        break;
+    case PropertyNotify:
+        if (ev->xproperty.window == d->incr_win &&
+                ev->xproperty.atom == d->incr_prop &&
+                ev->xproperty.state == PropertyDelete)
+            display_incr_next(d);
+        break;
+    case DestroyNotify:
+        if (ev->xdestroywindow.window == d->incr_win)
+            d->incr_win = None;
+        break;
+    }
+}
+
+/* Handle the events that are queued on d. */
+static void display_handle_events(struct display* d) {
+    XEvent ev;
+
+    while (XPending(d->dpy)) {
+        XNextEvent(d->dpy, &ev);
+        display_handle_event(d, &ev);
+    }
+}
+
+/**/
+/* Chromium OS */
+/**/
+
+/* Send a request (cmd followed by data) through croutonwebsocket. Returns
+ * the reply in a newly allocated buffer, and its length in replylen, or NULL
+ * on error. */
+static char* cros_request(char cmd, const char* data, size_t len,
+                          size_t* replylen) {
+    struct timeval tv = { REQUEST_TIMEOUT/1000, 0 };
+    struct request_header header;
+    char buffer[REQUEST_MAXDATA];
+    char* reply = NULL;
+    size_t size = 0;
+    size_t pos;
+    int fd, n;
+
+    *replylen = 0;
+
+    fd = request_connect();
+    if (fd < 0) {
+        log(1, "Cannot connect to %s.", REQUEST_SOCKET);
+        return NULL;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* The first packet carries cmd and the start of data, so that the
+     * WebSocket frame is large enough to be compressed. */
+    pos = len < REQUEST_MAXDATA-1 ? len : REQUEST_MAXDATA-1;
+    buffer[0] = cmd;
+    if (pos > 0)
+        memcpy(buffer+1, data, pos);
+    if (request_send(fd, 0, pos < len ? REQUEST_MORE : 0,
+                     buffer, pos+1, REQUEST_TIMEOUT) < 0)
+        goto error;
+
+    while (pos < len) {
+        n = len-pos < REQUEST_MAXDATA ? len-pos : REQUEST_MAXDATA;
+        if (request_send(fd, 0, pos+n < len ? REQUEST_MORE : 0,
+                         data+pos, n, REQUEST_TIMEOUT) < 0)
+            goto error;
+        pos += n;
+    }
+
+    do {
+        n = request_recv(fd, &header, buffer);
+        if (n < 0)
+            goto error;
+        /* Command character, then at most MAX_CLIP bytes */
+        if (*replylen + n > MAX_CLIP+1) {
+            error("Reply too large.");
+            goto exit;
+        }
+        if (*replylen + n > size) {
+            size = size ? 2*size : REQUEST_MAXDATA;
+            char* newreply = realloc(reply, size);
+            if (!newreply)
+                goto exit;
+            reply = newreply;
+        }
+        memcpy(reply + *replylen, buffer, n);
+        *replylen += n;
+    } while (header.flags & REQUEST_MORE);
+
+    close(fd);
+    return reply;
+
+error:
+    log(1, "Request error (%s).", strerror(errno));
+exit:
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+/* Read the Chromium OS clipboard into clip. Returns 0 on success. */
+static int cros_read() {
+    size_t len;
+    char* reply = cros_request('R', NULL, 0, &len);
+
+    if (!reply)
+        return -1;
+
+    if (len < 1 || reply[0] != 'R') {
+        error("Read error (%.*s).", (int)(len < 64 ? len : 64), reply);
+        free(reply);
+        return -1;
+    }
+
+    memmove(reply, reply+1, len-1);
+    clip_set(reply, len-1);
+    cros_hash = clip_hash;
+    return 0;
+}
+
+/* Write clip to the Chromium OS clipboard. Returns 0 on success. */
+static int cros_write() {
+    size_t len;
+    char* reply = cros_request('W', clip, clip_len, &len);
+    int ok = reply && len == 3 && !memcmp(reply, "WOK", 3);
+
+    if (reply && !ok)
+        error("Write error (%.*s).", (int)(len < 64 ? len : 64), reply);
+    free(reply);
+
+    if (!ok)
+        return -1;
+    cros_hash = clip_hash;
+    return 0;
+}
+
+/**/
+/* Main loop */
+/**/
+
+/* Returns the display shown in the crouton-in-a-tab window, if any is
+ * focused, CROS otherwise. */
+static int kiwi_display() {
+    char buffer[16];
+    int i, num, fd, n;
+    int xiwi = 0;
+
+    for (i = 0; i < MAX_DISPLAYS && !xiwi; i++) {
+        if (displays[i].num > 0)
+            xiwi = display_is_xiwi(&displays[i]);
+    }
+    if (!xiwi)
+        return CROS;
+
+    fd = open(KIWI_DISPLAY, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return CROS;
+    n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    buffer[n > 0 ? n : 0] = '\0';
+
+    return sscanf(buffer, ":%d", &num) == 1 ? num : CROS;
+}
+
+/* Returns the display the user is looking at: a display number, CROS, or
+ * NONE. Follows the logic of croutoncycle display. */
+static int current_display(int ttyfd) {
+    char buffer[16];
+    int i, vt, n;
+
+    /* No Chromium OS X11 server */
+    if (ttyfd < 0)
+        return kiwi_display();
+
+    n = pread(ttyfd, buffer, sizeof(buffer)-1, 0);
+    buffer[n > 0 ? n : 0] = '\0';
+    if (sscanf(buffer, "tty%d", &vt) != 1)
+        return NONE;
+
+    /* A chroot X11 server on its own VT */
+    if (vt != 1) {
+        for (i = 0; i < MAX_DISPLAYS; i++) {
+            struct display* d = &displays[i];
+            if (d->num > 0 &&
+                    display_root_int(d, d->atoms[ATOM_XFREE86_VT]) == vt)
+                return d->num;
+        }
+        return NONE;
+    }
+
+    /* Chromium OS X11 server: look at the topmost window. */
+    struct display* host = display_find(0);
+    Window root, parent, *children;
+    unsigned int nchildren;
+    XWindowAttributes attr;
+    int ret = NONE;
+
+    if (!host || !XQueryTree(host->dpy, DefaultRootWindow(host->dpy),
+                             &root, &parent, &children, &nchildren))
+        return NONE;
+
+    while (nchildren-- > 0 && ret == NONE) {
+        char* name = NULL;
+        char* sep;
+
+        if (!XGetWindowAttributes(host->dpy, children[nchildren], &attr) ||
+                attr.map_state != IsViewable)
+            continue;
+
+        XFetchName(host->dpy, children[nchildren], &name);
+        if (name && !strcmp(name, "aura_root_0")) {
+            ret = kiwi_display();
+        } else if (name && !strncmp(name, "Xephyr", 6) &&
+                   (sep = strchr(name, ':')) && sscanf(sep, ":%d", &n) == 1) {
+            ret = n;
+        } else {
+            ret = 0;
+        }
+        if (name)
+            XFree(name);
+    }
+
+    XFree(children);
+    return ret;
+}
+
+/* Copy the clipboard from the current display to next. */
+static void sync_to(int next) {
+    struct display* d;
+    int ok = 1;
+
+    if (next == NONE || next == current) {
+        log(3, "Nothing to do (%d -> %d).", current, next);
+        return;
+    }
+
+    log(2, "Display change (%d -> %d).", current, next);
+
+    /* Fetch the content of the display that was left, if it changed. There
+     * is no way to tell for Chromium OS. */
+    if (current == CROS) {
+        ok = cros_read() == 0;
+    } else if ((d = display_find(current)) && d->changed) {
+        ok = display_read(d) == 0;
+        d->changed = 0;
+    }
+
+    /* The content is lost in this case. */
+    if (!ok || !clip_hash) {
+        current = next;
+        return;
+    }
+
+    if (next == CROS) {
+        if (cros_hash != clip_hash && cros_write() < 0)
+            return;  /* Skip Chromium OS (do not update current) */
+    } else if ((d = display_find(next))) {
+        if (!d->owned || d->hash != clip_hash)
+            display_own(d);
+    }
+
+    current = next;
+}
+
+int main(int argc, char** argv) {
+    /* Poll array:
+     * 0 - signalfd
+     * 1 - tty (VT changes)
+     * 2... - displays (slot i at 2+i)
+     */
+    struct pollfd fds[2+MAX_DISPLAYS];
+    struct signalfd_siginfo si;
+    sigset_t sigmask;
+    int c, i, n;
+    int terminate = 0;
+    /* Set when the current display may have changed (volatile, as it is
+     * used after siglongjmp). */
+    volatile int force = 1;
+
+    while ((c = getopt(argc, argv, "v:")) != -1) {
+        switch (c) {
+        case 'v':
+            verbose = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "%s [-v 0-3]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    /* croutoncycle sends SIGUSR1 on display change. */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGUSR1);
+    sigaddset(&sigmask, SIGHUP);
+    sigaddset(&sigmask, SIGINT);
+    sigaddset(&sigmask, SIGTERM);
+    sigaddset(&sigmask, SIGPIPE);
+    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+        perror("sigprocmask error");
+        return 2;
+    }
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = signalfd(-1, &sigmask, SFD_CLOEXEC);
+    fds[0].events = POLLIN;
+    if (fds[0].fd < 0) {
+        perror("signalfd error");
+        return 2;
+    }
+
+    /* VT changes are signaled with POLLPRI (see croutonvtmonitor). */
+    fds[1].fd = open(TTY_ACTIVE, O_RDONLY | O_CLOEXEC);
+    fds[1].events = POLLPRI;
+
+    for (i = 0; i < MAX_DISPLAYS; i++)
+        displays[i].num = -1;
+
+    XSetErrorHandler(xerror_handler);
+    XSetIOErrorHandler(io_error_handler);
+
+    /* Start as if we came from Chromium OS (like croutonclip). */
+    while (!terminate) {
+        if (sigsetjmp(io_error_jmp, 1)) {
+            display_lost(io_error_dpy);
+            continue;
+        }
+
+        if (force) {
+            display_scan();
+            sync_to(current_display(fds[1].fd));
+            force = 0;
+        }
+
+        for (i = 0; i < MAX_DISPLAYS; i++) {
+            struct display* d = &displays[i];
+            fds[2+i].fd = d->num >= 0 ? ConnectionNumber(d->dpy) : -1;
+            fds[2+i].events = POLLIN;
+            fds[2+i].revents = 0;
+            if (d->num >= 0)
+                display_handle_events(d);
+        }
+
+        n = poll(fds, 2+MAX_DISPLAYS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll error");
+            return 1;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if (read(fds[0].fd, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo == SIGUSR1)
+                    force = 1;
+                else if (si.ssi_signo != SIGPIPE)
+                    terminate = 1;
+            }
+        }
+
+        if (fds[1].revents & POLLPRI)
+            force = 1;
+
+        for (i = 0; i < MAX_DISPLAYS; i++) {
+            if (fds[2+i].revents && displays[i].num >= 0)
+                display_handle_events(&displays[i]);
+        }
+    }
+
+    log(1, "Terminating...");
+    return 0;
+}
@@ -20,12 +20,78 @@ static int error_handler(Display *d, XErrorEvent *e) {
     return 0;
 }
 
-/* Apply the cursor to the Chromium OS X11 server.
+/* Cursors created on the Chromium OS X11 server, keyed by chroot cursor
+ * serial, and by image hash in case the same image comes back with a new
+ * serial. The least recently used entry is evicted when full. */
+#define CACHE_SIZE 32
+
+static struct cache_entry {
+    unsigned long serial;
+    unsigned int hash;
+    int width, height, xhot, yhot;
+    Cursor cursor;  /* 0 if the entry is free */
+    unsigned long used;  /* Last use, for eviction */
+} cache[CACHE_SIZE];
+
+static unsigned long cache_clock = 0;
+
+/* FNV-1a hash of the (32-bit) pixels of the image */
+static unsigned int hash_image(XFixesCursorImage *image) {
+    const unsigned char *p = (const unsigned char *) image->pixels;
+    int len = image->width * image->height * 4;
+    unsigned int hash = 2166136261u;
+    int i;
+    for (i = 0; i < len; ++i) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the cache entry for the given serial, or NULL. */
+static struct cache_entry *cache_find_serial(unsigned long serial) {
+    int i;
+    for (i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i].cursor && cache[i].serial == serial)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+/* Returns the cache entry with the same image, or NULL. */
+static struct cache_entry *cache_find_image(XFixesCursorImage *image,
+                                            unsigned int hash) {
+    int i;
+    for (i = 0; i < CACHE_SIZE; ++i) {
+        if (cache[i].cursor && cache[i].hash == hash &&
+                cache[i].width == image->width &&
+                cache[i].height == image->height &&
+                cache[i].xhot == image->xhot &&
+                cache[i].yhot == image->yhot)
+            return &cache[i];
+    }
+    return NULL;
+}
+
+/* Returns a free cache entry, evicting the least recently used one. */
+static struct cache_entry *cache_evict(Display* d) {
+    struct cache_entry *entry = &cache[0];
+    int i;
+    for (i = 0; i < CACHE_SIZE && entry->cursor; ++i) {
+        if (!cache[i].cursor || cache[i].used < entry->used)
+            entry = &cache[i];
+    }
+    if (entry->cursor)
+        XFreeCursor(d, entry->cursor);
+    entry->cursor = 0;
+    return entry;
+}
+
+/* Create the cursor on the Chromium OS X11 server.
  * Adapted from the XcursorImageLoadCursor implementation in libXcursor,
  * copyright 2002 Keith Packard.
  */
-static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
-    static Cursor cur_cursor = 0;
+static Cursor create_cursor(Display* d, Window w, XFixesCursorImage *image) {
     XImage ximage;
     Pixmap pixmap;
     Picture picture;
@@ -33,25 +99,6 @@ static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
     XRenderPictFormat *format;
     Cursor cursor;
 
-    /* Unset the current cursor if no image is passed. */
-    if (!image) {
-        if (cur_cursor) {
-            XUndefineCursor(d, w);
-            XFreeCursor(d, cur_cursor);
-            cur_cursor = 0;
-        }
-        return;
-    }
-
-    /* Collapse 64-bit pixels down to 32-bit pixels if needed */
-    if (sizeof(image->pixels[0]) == 8) {
-        int i;
-        int *pixels = (int *) image->pixels;
-        for (i = 0; i < image->width * image->height; ++i) {
-            pixels[i] = pixels[i*2];
-        }
-    }
-
     ximage.width = image->width;
     ximage.height = image->height;
     ximage.xoffset = 0;
@@ -70,7 +117,7 @@ static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
     ximage.obdata = 0;
     if (!XInitImage(&ximage)) {
         puts("failed to init image");
-        return;
+        return 0;
     }
     pixmap = XCreatePixmap(d, w, image->width, image->height, 32);
     gc = XCreateGC(d, pixmap, 0, 0);
@@ -81,11 +128,67 @@ static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
     XFreePixmap(d, pixmap);
     cursor = XRenderCreateCursor(d, picture, image->xhot, image->yhot);
     XRenderFreePicture(d, picture);
-    XDefineCursor(d, w, cursor);
+    return cursor;
+}
+
+/* Apply the cached cursor for serial to the Chromium OS X11 server.
+ * Returns 0 on a cache miss. */
+static int apply_cached_cursor(Display* d, Window w, unsigned long serial) {
+    struct cache_entry *entry = cache_find_serial(serial);
+    if (!entry)
+        return 0;
+    entry->used = ++cache_clock;
+    XDefineCursor(d, w, entry->cursor);
     XFlush(d);
-    if (cur_cursor)
-        XFreeCursor(d, cur_cursor);
-    cur_cursor = cursor;
+    return 1;
+}
+
+/* Apply the cursor to the Chromium OS X11 server, creating it if it is not
+ * in the cache yet. */
+static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
+    struct cache_entry *entry;
+    unsigned int hash;
+    int i;
+
+    /* Unset the current cursor if no image is passed. */
+    if (!image) {
+        XUndefineCursor(d, w);
+        for (i = 0; i < CACHE_SIZE; ++i) {
+            if (cache[i].cursor)
+                XFreeCursor(d, cache[i].cursor);
+            cache[i].cursor = 0;
+        }
+        return;
+    }
+
+    if (apply_cached_cursor(d, w, image->cursor_serial))
+        return;
+
+    /* Collapse 64-bit pixels down to 32-bit pixels if needed */
+    if (sizeof(image->pixels[0]) == 8) {
+        int *pixels = (int *) image->pixels;
+        for (i = 0; i < image->width * image->height; ++i) {
+            pixels[i] = pixels[i*2];
+        }
+    }
+
+    /* Same image under a new serial: adopt the serial. */
+    hash = hash_image(image);
+    entry = cache_find_image(image, hash);
+    if (!entry) {
+        Cursor cursor = create_cursor(d, w, image);
+        if (!cursor)
+            return;
+        entry = cache_evict(d);
+        entry->hash = hash;
+        entry->width = image->width;
+        entry->height = image->height;
+        entry->xhot = image->xhot;
+        entry->yhot = image->yhot;
+        entry->cursor = cursor;
+    }
+    entry->serial = image->cursor_serial;
+    apply_cached_cursor(d, w, entry->serial);
 }
 
 int main(int argc, char** argv) {
@@ -128,6 +231,10 @@ int main(int argc, char** argv) {
         XNextEvent(chroot_d, &e);
         if (error) break;
         if (e.type != xfixes_event + XFixesCursorNotify) continue;
+        /* Known cursor: no need to fetch the image */
+        if (apply_cached_cursor(cros_d, cros_w,
+                ((XFixesCursorNotifyEvent *) &e)->cursor_serial))
+            continue;
         /* Grab the new cursor and apply it to the Chromium OS X11 server */
         XFixesCursorImage *img = XFixesGetCursorImage(chroot_d);
         apply_cursor(cros_d, cros_w, img);
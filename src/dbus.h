@@ -0,0 +1,373 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Minimal D-Bus client: connects to the system bus and sends method calls
+ * without arguments, such as the calls to Chromium OS's power manager that
+ * used to go through host-dbus dbus-send. This avoids a dependency on
+ * libdbus, and lets long-running processes keep a single connection.
+ *
+ * Only little-endian messages, and the EXTERNAL authentication mechanism,
+ * are supported.
+ */
+
+#ifndef DBUS_H_
+#define DBUS_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Same default as host-dbus */
+#define DBUS_SYSTEM_BUS "/var/host/dbus/system_bus_socket"
+#define DBUS_TIMEOUT 1000  /* ms */
+#define DBUS_MAXMESSAGE 1024
+
+/* Message types and flags */
+#define DBUS_METHOD_CALL 1
+#define DBUS_METHOD_RETURN 2
+#define DBUS_ERROR 3
+#define DBUS_NO_REPLY_EXPECTED 0x1
+
+/* Header fields */
+#define DBUS_FIELD_PATH 1
+#define DBUS_FIELD_INTERFACE 2
+#define DBUS_FIELD_MEMBER 3
+#define DBUS_FIELD_REPLY_SERIAL 5
+#define DBUS_FIELD_DESTINATION 6
+
+struct dbus_connection {
+    int fd;  /* -1 if not connected */
+    uint32_t serial;  /* Serial of the last message sent */
+};
+
+/* Returns the current monotonic time in ms. */
+static uint64_t dbus_time_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Wait for events on fd until deadline (see dbus_time_ms). Signals do not
+ * cut the wait short. Returns 0 if fd is ready, -1 on error or timeout
+ * (errno is then ETIMEDOUT). */
+static int dbus_poll(int fd, short events, uint64_t deadline) {
+    struct pollfd pfd = { fd, events, 0 };
+    uint64_t now;
+    int n;
+
+    while ((now = dbus_time_ms()) < deadline) {
+        n = poll(&pfd, 1, deadline - now);
+        if (n > 0)
+            return 0;
+        if (n < 0 && errno != EINTR)
+            return -1;
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/* Write all of buffer, waiting at most DBUS_TIMEOUT ms in total for room.
+ * Returns 0 on success, -1 on error. */
+static int dbus_write(int fd, const char* buffer, int len) {
+    uint64_t deadline = dbus_time_ms() + DBUS_TIMEOUT;
+
+    while (len > 0) {
+        int n = send(fd, buffer, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || dbus_poll(fd, POLLOUT, deadline) < 0)
+                return -1;
+            continue;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read exactly len bytes, waiting at most DBUS_TIMEOUT ms in total.
+ * Returns 0 on success, -1 on error. */
+static int dbus_read(int fd, char* buffer, int len) {
+    uint64_t deadline = dbus_time_ms() + DBUS_TIMEOUT;
+
+    while (len > 0) {
+        int n = recv(fd, buffer, len, 0);
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN || dbus_poll(fd, POLLIN, deadline) < 0)
+                return -1;
+            continue;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Align the message length to the given boundary (zero padding). */
+static int dbus_align(char* msg, int len, int align) {
+    while (len % align)
+        msg[len++] = '\0';
+    return len;
+}
+
+/* Append a string-typed header field (type is 's', 'o' or 'g'). */
+static int dbus_field(char* msg, int len, int code, char type,
+                      const char* value) {
+    uint32_t n = strlen(value);
+
+    len = dbus_align(msg, len, 8);
+    if (len + 12 + (int)n > DBUS_MAXMESSAGE)
+        return -1;
+    msg[len++] = code;
+    msg[len++] = 1;  /* Variant signature */
+    msg[len++] = type;
+    msg[len++] = '\0';
+    if (type == 'g') {
+        msg[len++] = n;
+    } else {
+        memcpy(msg + len, &n, 4);
+        len += 4;
+    }
+    memcpy(msg + len, value, n+1);
+    return len + n+1;
+}
+
+/* Send a method call without arguments. flags may include
+ * DBUS_NO_REPLY_EXPECTED. Returns the serial of the call, or 0 on error. */
+static uint32_t dbus_send_call(struct dbus_connection* conn,
+                               const char* destination, const char* path,
+                               const char* interface, const char* member,
+                               int flags) {
+    char msg[DBUS_MAXMESSAGE];
+    uint32_t zero = 0, fields;
+    int len = 0;
+
+    if (conn->fd < 0) {
+        errno = ENOTCONN;
+        return 0;
+    }
+
+    conn->serial++;
+    if (conn->serial == 0)
+        conn->serial++;
+
+    msg[len++] = 'l';  /* Little-endian */
+    msg[len++] = DBUS_METHOD_CALL;
+    msg[len++] = flags;
+    msg[len++] = 1;  /* Protocol version */
+    memcpy(msg + len, &zero, 4);  /* Body length */
+    len += 4;
+    memcpy(msg + len, &conn->serial, 4);
+    len += 4;
+    len += 4;  /* Header fields length, filled below */
+
+    len = dbus_field(msg, len, DBUS_FIELD_PATH, 'o', path);
+    if (len > 0 && interface)
+        len = dbus_field(msg, len, DBUS_FIELD_INTERFACE, 's', interface);
+    if (len > 0)
+        len = dbus_field(msg, len, DBUS_FIELD_MEMBER, 's', member);
+    if (len > 0 && destination)
+        len = dbus_field(msg, len, DBUS_FIELD_DESTINATION, 's', destination);
+    if (len < 0) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+
+    fields = len - 16;
+    memcpy(msg + 12, &fields, 4);
+    len = dbus_align(msg, len, 8);
+
+    if (dbus_write(conn->fd, msg, len) < 0)
+        return 0;
+    return conn->serial;
+}
+
+/* Read the next incoming message. Returns the message type, and sets
+ * reply_serial to the serial it replies to (0 if none). Returns -1 on
+ * error. */
+static int dbus_recv(struct dbus_connection* conn, uint32_t* reply_serial) {
+    char header[16];
+    char msg[DBUS_MAXMESSAGE];
+    uint32_t body, fields;
+    int len, pos;
+
+    *reply_serial = 0;
+    if (dbus_read(conn->fd, header, sizeof(header)) < 0)
+        return -1;
+    if (header[0] != 'l') {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&body, header + 4, 4);
+    memcpy(&fields, header + 12, 4);
+    /* Header fields are padded to 8 bytes. */
+    len = ((fields + 7) & ~7) + body;
+
+    pos = 0;
+    while (pos < len) {
+        int n = len - pos > DBUS_MAXMESSAGE ? DBUS_MAXMESSAGE : len - pos;
+        if (dbus_read(conn->fd, msg, n) < 0)
+            return -1;
+        /* Look for the reply serial in the header fields. */
+        if (pos == 0) {
+            int i = 0;
+            while (i + 8 <= (int)fields && i + 8 <= n) {
+                int code = msg[i], siglen = msg[i+1];
+                char type = msg[i+2];
+                uint32_t value;
+                if (code == DBUS_FIELD_REPLY_SERIAL && siglen == 1 &&
+                        type == 'u') {
+                    memcpy(&value, msg + i + 4, 4);
+                    *reply_serial = value;
+                }
+                /* Skip the field value, then align for the next one. */
+                i += 3 + siglen;
+                if (type == 'g') {
+                    i += 1 + (unsigned char)msg[i] + 1;
+                } else if (type == 's' || type == 'o') {
+                    i = (i + 3) & ~3;
+                    if (i + 4 > n)
+                        break;
+                    memcpy(&value, msg + i, 4);
+                    i += 4 + value + 1;
+                } else {
+                    i = ((i + 3) & ~3) + 4;
+                }
+                i = (i + 7) & ~7;
+            }
+        }
+        pos += n;
+    }
+
+    return (unsigned char)header[1];
+}
+
+/* Discard the pending incoming messages (signals, replies), so that the
+ * bus does not drop the connection for not reading them. Returns 0, or -1
+ * if the connection is lost. */
+static int dbus_drain(struct dbus_connection* conn) {
+    struct pollfd pfd = { conn->fd, POLLIN, 0 };
+    uint32_t reply_serial;
+
+    while (conn->fd >= 0 && poll(&pfd, 1, 0) > 0) {
+        if (dbus_recv(conn, &reply_serial) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Wait for the reply to the call with the given serial. Returns 0 on
+ * success, -1 on error (errno is EREMOTEIO for an error reply). */
+static int dbus_wait_reply(struct dbus_connection* conn, uint32_t serial) {
+    uint32_t reply_serial;
+    int type;
+
+    do {
+        type = dbus_recv(conn, &reply_serial);
+        if (type < 0)
+            return -1;
+    } while (reply_serial != serial);
+
+    if (type == DBUS_ERROR) {
+        errno = EREMOTEIO;
+        return -1;
+    }
+    return 0;
+}
+
+static void dbus_close(struct dbus_connection* conn) {
+    if (conn->fd >= 0)
+        close(conn->fd);
+    conn->fd = -1;
+}
+
+/* Connect and authenticate to the system bus (DBUS_SYSTEM_BUS_ADDRESS if
+ * it is a unix:path= address, DBUS_SYSTEM_BUS otherwise). Returns 0 on
+ * success, -1 on error. */
+static int dbus_connect(struct dbus_connection* conn) {
+    const char* address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    const char* path = DBUS_SYSTEM_BUS;
+    struct sockaddr_un addr;
+    char auth[64];
+    char line[256];
+    int len = 0, i;
+    uint32_t serial;
+
+    conn->fd = -1;
+    conn->serial = 0;
+
+    if (address && !strncmp(address, "unix:path=", 10))
+        path = address + 10;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    addr.sun_path[strcspn(addr.sun_path, ",")] = '\0';
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0)
+        return -1;
+    if (connect(conn->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        dbus_close(conn);
+        return -1;
+    }
+    fcntl(conn->fd, F_SETFL, O_NONBLOCK);
+
+    /* The credentials byte, then EXTERNAL with the uid in hex-encoded
+     * decimal. The bus checks it against SO_PEERCRED, which reports the
+     * effective uid (root in Xorg, started by the setuid X wrapper). */
+    snprintf(line, sizeof(line), "%u", (unsigned int)geteuid());
+    len = snprintf(auth, sizeof(auth), "%cAUTH EXTERNAL ", '\0');
+    for (i = 0; line[i]; i++)
+        len += snprintf(auth + len, sizeof(auth) - len, "%02x", line[i]);
+    len += snprintf(auth + len, sizeof(auth) - len, "\r\n");
+
+    if (dbus_write(conn->fd, auth, len) < 0)
+        goto error;
+
+    /* Read the reply line, one byte at a time: the binary protocol starts
+     * right after. */
+    len = 0;
+    do {
+        if (dbus_read(conn->fd, line + len, 1) < 0)
+            goto error;
+    } while (line[len++] != '\n' && len < (int)sizeof(line)-1);
+    if (strncmp(line, "OK ", 3)) {
+        errno = EACCES;
+        goto error;
+    }
+
+    if (dbus_write(conn->fd, "BEGIN\r\n", 7) < 0)
+        goto error;
+
+    serial = dbus_send_call(conn, "org.freedesktop.DBus",
+                            "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                            "Hello", 0);
+    if (!serial || dbus_wait_reply(conn, serial) < 0)
+        goto error;
+
+    return 0;
+
+error:
+    dbus_close(conn);
+    return -1;
+}
+
+#endif /* DBUS_H_ */
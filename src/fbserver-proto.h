@@ -12,7 +12,7 @@
 #include <stdint.h>
 
 /* WebSocket constants */
-#define VERSION "VF3"
+#define VERSION "VF4"
 #define PORT_BASE 30010
 
 /* Request for a frame */
@@ -36,6 +36,12 @@ struct  __attribute__((__packed__)) screen_reply {
     uint16_t width;
     uint16_t height;
     uint32_t cursor_serial;  /* Cursor to display */
+    /* Server-side timings (VF4), in microseconds since the request was
+     * received, or 0 if the stage was skipped. */
+    uint32_t damage_us;  /* Damage and cursor events drained */
+    uint32_t grab_us;  /* XShmGetImage done */
+    uint32_t copy_us;  /* Frame copied to the client buffer */
+    uint32_t send_us;  /* Reply about to be sent */
 };
 
 /* Request for cursor image (if cursor_serial is unknown) */
@@ -81,6 +87,54 @@ struct  __attribute__((__packed__)) mousemove {
     uint16_t y;
 };
 
+/* Move the mouse wheel (VF4) */
+#define WHEEL_CLICK 120  /* Units per wheel click */
+struct  __attribute__((__packed__)) mousewheel {
+    char type;  /* 'W' */
+    int16_t dx;  /* Horizontal motion, positive is right */
+    int16_t dy;  /* Vertical motion, positive is up */
+};
+
+/* Touch point update (VF4) */
+#define TOUCH_MOVE 0
+#define TOUCH_START 1
+#define TOUCH_END 2
+struct  __attribute__((__packed__)) touch {
+    char type;  /* 'T' */
+    uint8_t state;  /* TOUCH_MOVE, TOUCH_START or TOUCH_END */
+    uint32_t id;  /* Touch point identifier, unique while pressed */
+    uint16_t x;
+    uint16_t y;
+};
+
+/* Register an input mailbox (query + reply, VF4) */
+struct  __attribute__((__packed__)) mailbox {
+    char type;  /* 'B' */
+    uint8_t ok:1;  /* reply: mailbox was found, and is in use */
+    uint32_t length;  /* Buffer length */
+    uint64_t paddr;  /* shm: client buffer address */
+    uint64_t sig;  /* shm: signature at the beginning of buffer */
+};
+
+/* Nudge: the client wrote to the mailbox while the server was waiting */
+struct  __attribute__((__packed__)) nudge {
+    char type;  /* 'N' */
+};
+
+/* Input mailbox, in a shm buffer found the same way as frame buffers: a
+ * single-producer (client), single-consumer (server) ring of input packets
+ * ('K', 'C', 'M', 'W' or 'T'). head and tail are free-running counters.
+ * The client sends a nudge if waiting is set after writing an entry. */
+#define MAILBOX_ENTRY_SIZE 16  /* 1 byte length, followed by the packet */
+struct mailbox_ring {
+    uint64_t sig;  /* Signature (see struct mailbox) */
+    uint32_t size;  /* Number of entries */
+    uint32_t waiting;  /* Server is asleep, and needs a nudge */
+    uint32_t head __attribute__((aligned(64)));  /* Written by the client */
+    uint32_t tail __attribute__((aligned(64)));  /* Written by the server */
+    uint8_t entries[0][MAILBOX_ENTRY_SIZE] __attribute__((aligned(64)));
+};
+
 /* Send initialization info */
 struct  __attribute__((__packed__)) initinfo {
     char type; /* I */
@@ -6,14 +6,24 @@
  * with the extension in Chromium OS. It sends framebuffer and cursor data,
  * and receives keyboard/mouse events.
  *
+ * Several displays can be served by the same process (e.g.
+ * croutonfbserver :1 :2), from a single event loop: each display gets its
+ * own port (PORT_BASE + display number). When one of the X servers goes
+ * away, only its display and viewers are dropped; the process exits once
+ * no display is left.
  */
 
 #include "websocket.h"
 #include "fbserver-proto.h"
 #include <fcntl.h>
+#include <setjmp.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <netinet/tcp.h>
+#include <linux/uinput.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/extensions/XTest.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
@@ -23,10 +33,95 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xfixes.h>
 
-/* X11-related variables */
-static Display *dpy;
-static int damageEvent;
-static int fixesEvent;
+/* Remember which keys/buttons are currently pressed */
+typedef enum { MOUSE=1, KEYBOARD=2 } keybuttontype;
+struct keybutton {
+    keybuttontype type;
+    uint32_t code;  /* KeyCode or mouse button */
+};
+
+/* Maximum number of simultaneous touch points */
+#define MAX_TOUCH 10
+
+/* Maximum number of displays served by one process, and of clients per
+ * display. */
+#define MAX_DISPLAYS 8
+#define MAX_VIEWERS 8
+
+/* Maximum number of frame sizes grabbed from one display (viewers may have
+ * different sizes, see struct grab). */
+#define MAX_GRABS 4
+/* Frames of a size that was not requested for that long are freed (e.g.
+ * after a resize), in us. */
+#define GRAB_EXPIRE 10000000
+
+/* Frame grabbed from a display at a given size, shared by all the viewers
+ * of that size: each viewer gets a copy in its own shm buffer, but the grab
+ * is only done once. */
+struct grab {
+    XImage* img;  /* NULL if the slot is free */
+    XShmSegmentInfo shminfo;
+    int dirty;  /* Display damaged since img was grabbed */
+    uint32_t frame_seq;  /* Sequence number of the last grab */
+    uint64_t last_used;  /* Last request for this size (gettime_us) */
+};
+
+/* Per-display state. A single process can serve several displays (see
+ * main), each on its own port, from the same event loop. */
+struct xdisplay {
+    char* name;  /* e.g. ":1", also used to name the uinput devices */
+    struct ws_server* server;
+    int connected;  /* Value of the CROUTON_CONNECTED property */
+
+    /* X11-related variables */
+    Display *dpy;
+    int damageEvent;
+    int fixesEvent;
+
+    /* Last known screen size, used to scale absolute uinput coordinates */
+    int screen_width;
+    int screen_height;
+
+    /* Store currently pressed keys/buttons in an array.
+     * No valid entry on or after pressed_len. */
+    struct keybutton pressed[256];
+    int pressed_len;
+
+    /* uinput devices (-1 if not in use) */
+    int uinput_keyboard_fd;
+    int uinput_pointer_fd;
+    int uinput_touch_fd;
+
+    /* Wheel motion not yet converted to full clicks (in WHEEL_CLICK
+     * units) */
+    int wheel_acc_x;
+    int wheel_acc_y;
+
+    /* Touch points currently pressed, indexed by slot number */
+    struct {
+        int active;
+        uint32_t id;  /* Identifier from the client */
+    } touch_slots[MAX_TOUCH];
+    int touch_active;  /* Number of active slots */
+    int touch_tracking_id;
+    /* Slot that also drives the pointer (single-touch emulation), or -1 */
+    int touch_emulated_slot;
+
+    /* Frames grabbed from the display, one per size requested */
+    struct grab grabs[MAX_GRABS];
+    uint32_t frame_seq;  /* Incremented on every grab, of any size */
+
+    /* Last cursor change, reported to each client once */
+    uint32_t cursor_seq;
+    uint32_t cursor_serial;
+};
+
+static struct xdisplay displays[MAX_DISPLAYS];
+static int ndisplays = 0;
+
+/* Set when a display connection is lost (see io_error_handler). */
+static sigjmp_buf io_error_jmp;
+static Display* io_error_dpy = NULL;
 
 /* shm entry cache */
 struct cache_entry {
@@ -36,65 +131,501 @@ struct cache_entry {
     size_t length; /* mmap length */
 };
 
-static struct cache_entry cache[2];
-static int next_entry;
+/* Per-client state (ws_client data) */
+struct viewer {
+    struct cache_entry cache[2];  /* shm entry cache */
+    int next_entry;
+    int refresh_pending;  /* Refresh requested while the client lagged */
+    uint32_t frame_seq;  /* Last frame copied to the client (0: none) */
+    uint32_t cursor_seq;  /* Last cursor change reported to the client */
+    /* Input mailbox: ring of input packets in shm, written by the client. */
+    struct cache_entry mailbox_entry;
+    struct mailbox_ring* mailbox_ring;
+    uint32_t mailbox_size;  /* Number of entries in the ring */
+};
 
-/* Remember which keys/buttons are currently pressed */
-typedef enum { MOUSE=1, KEYBOARD=2 } keybuttontype;
-struct keybutton {
-    keybuttontype type;
-    uint32_t code;  /* KeyCode or mouse button */
+/* Counters (see metrics_init) */
+static struct metric metric_frames_requested = { "frames_requested" };
+static struct metric metric_frames_updated = { "frames_updated" };
+static struct metric metric_frames_skipped = { "frames_skipped" };
+static struct metric metric_frames_lagging = { "frames_lagging" };
+static struct metric metric_frames_shared = { "frames_shared" };
+static struct metric metric_frames_shmfailed = { "frames_shmfailed" };
+static struct metric metric_bytes_copied = { "bytes_copied" };
+static struct metric metric_damage_events = { "damage_events" };
+static struct metric metric_cursor_events = { "cursor_events" };
+static struct metric metric_shm_hits = { "shm_hits" };
+static struct metric metric_shm_misses = { "shm_misses" };
+static struct metric metric_resolution_changes = { "resolution_changes" };
+static struct metric metric_input_key = { "input_key" };
+static struct metric metric_input_click = { "input_click" };
+static struct metric metric_input_motion = { "input_motion" };
+static struct metric metric_input_wheel = { "input_wheel" };
+static struct metric metric_input_touch = { "input_touch" };
+static struct metric metric_input_mailbox = { "input_mailbox" };
+
+static struct metric* metrics[] = {
+    &metric_frames_requested, &metric_frames_updated, &metric_frames_skipped,
+    &metric_frames_lagging, &metric_frames_shared, &metric_frames_shmfailed,
+    &metric_bytes_copied,
+    &metric_damage_events, &metric_cursor_events,
+    &metric_shm_hits, &metric_shm_misses, &metric_resolution_changes,
+    &metric_input_key, &metric_input_click, &metric_input_motion,
+    &metric_input_wheel, &metric_input_touch, &metric_input_mailbox,
+    NULL
 };
 
-/* Store currently pressed keys/buttons in an array.
- * No valid entry on or after curmax. */
-static struct keybutton pressed[256];
-static int pressed_len = 0;
+/* Returns a monotonic time, in milliseconds */
+static uint64_t gettime_ms() {
+    return gettime_us()/1000;
+}
 
 /* Adds a key/button to array of pressed keys */
-void kb_add(keybuttontype type, uint32_t code) {
-    trueorabort(pressed_len < sizeof(pressed)/sizeof(struct keybutton),
+void kb_add(struct xdisplay* d, keybuttontype type, uint32_t code) {
+    trueorabort(d->pressed_len < sizeof(d->pressed)/sizeof(struct keybutton),
                 "Too many keys pressed");
 
     int i;
-    for (i = 0; i < pressed_len; i++) {
-        if (pressed[i].type == type && pressed[i].code == code)
+    for (i = 0; i < d->pressed_len; i++) {
+        if (d->pressed[i].type == type && d->pressed[i].code == code)
             return;
     }
 
-    pressed[pressed_len].type = type;
-    pressed[pressed_len].code = code;
-    pressed_len++;
+    d->pressed[d->pressed_len].type = type;
+    d->pressed[d->pressed_len].code = code;
+    d->pressed_len++;
 }
 
 /* Removes a key/button from array of pressed keys */
-void kb_remove(keybuttontype type, uint32_t code) {
+void kb_remove(struct xdisplay* d, keybuttontype type, uint32_t code) {
     int i;
-    for (i = 0; i < pressed_len; i++) {
-        if (pressed[i].type == type && pressed[i].code == code) {
-            if (i < pressed_len-1)
-                pressed[i] = pressed[pressed_len-1];
+    for (i = 0; i < d->pressed_len; i++) {
+        if (d->pressed[i].type == type && d->pressed[i].code == code) {
+            if (i < d->pressed_len-1)
+                d->pressed[i] = d->pressed[d->pressed_len-1];
 
-            pressed_len--;
+            d->pressed_len--;
             return;
         }
     }
 }
 
+/* Input injection backends:
+ *  - XTest: events are sent as X11 requests, on the same connection that is
+ *    used to grab frames.
+ *  - uinput: virtual keyboard, pointer and touchscreen devices are created in
+ *    the kernel, and picked up by the X server through udev (see
+ *    xorg-dummy.conf). This provides high-resolution wheel axes and real
+ *    multitouch, without going through the X11 connection.
+ * The default (auto) is to use uinput if the devices can be created and show
+ * up in the X server, and fall back on XTest otherwise. */
+typedef enum { INPUT_AUTO, INPUT_XTEST, INPUT_UINPUT } inputbackend;
+static inputbackend input_backend = INPUT_AUTO;
+
+/* Pending uinput events, written in one go by uinput_flush() */
+static struct input_event uinput_events[16];
+static int uinput_nevents = 0;
+
+/* Range of uinput absolute axes: the X server scales them to the screen. */
+const int UINPUT_ABS_MAX = 32767;
+
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES 0x0b
+#define REL_HWHEEL_HI_RES 0x0c
+#endif
+
+/* Queues a uinput event, see uinput_flush(). */
+static void uinput_event(int type, int code, int value) {
+    /* Keep one entry for SYN_REPORT */
+    const int maxevents = sizeof(uinput_events)/sizeof(uinput_events[0]);
+    trueorabort(uinput_nevents < maxevents-1, "Too many uinput events");
+    struct input_event* ev = &uinput_events[uinput_nevents++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+
+/* Terminates the pending events with a SYN_REPORT, and writes them to the
+ * device. */
+static void uinput_flush(int fd) {
+    uinput_event(EV_SYN, SYN_REPORT, 0);
+    int len = uinput_nevents*sizeof(struct input_event);
+    if (block_write(fd, (char*)uinput_events, len) != len)
+        syserror("Cannot write uinput events.");
+    uinput_nevents = 0;
+}
+
+/* Scales a screen coordinate to the uinput absolute axis range. */
+static int uinput_scale(int value, int size) {
+    if (size <= 1)
+        return 0;
+    return (int64_t)value*UINPUT_ABS_MAX/(size-1);
+}
+
+/* Opens /dev/uinput, and sets the given event types. */
+static int uinput_open(int evbits) {
+    int fd = open("/dev/uinput", O_WRONLY|O_NONBLOCK);
+    if (fd < 0) {
+        log(1, "Cannot open /dev/uinput (%s).", strerror(errno));
+        return -1;
+    }
+
+    int type;
+    for (type = 0; type < EV_CNT; type++) {
+        if ((evbits & (1 << type)) && ioctl(fd, UI_SET_EVBIT, type) < 0) {
+            syserror("Cannot set uinput event bit %d.", type);
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Sets a uinput capability bit (UI_SET_*BIT), closes fd on error. */
+static int uinput_setbit(int fd, unsigned long request, int bit) {
+    if (fd >= 0 && ioctl(fd, request, bit) < 0) {
+        syserror("Cannot set uinput bit %d.", bit);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Creates the device: name is suffixed to "crouton xiwi <display> ", absmax
+ * gives the maximum value of each absolute axis (NULL if there is none).
+ * Returns fd, or -1 on error (fd is then closed). */
+static int uinput_create(struct xdisplay* d, int fd,
+                         const char* name, const int* absmax) {
+    struct uinput_user_dev dev;
+
+    if (fd < 0)
+        return -1;
+
+    memset(&dev, 0, sizeof(dev));
+    snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "crouton xiwi %s %s",
+             d->name, name);
+    dev.id.bustype = BUS_VIRTUAL;
+    if (absmax)
+        memcpy(dev.absmax, absmax, sizeof(dev.absmax));
+
+    if (block_write(fd, (char*)&dev, sizeof(dev)) != sizeof(dev) ||
+            ioctl(fd, UI_DEV_CREATE) < 0) {
+        syserror("Cannot create uinput device %s.", dev.name);
+        close(fd);
+        return -1;
+    }
+
+    log(1, "Created uinput device %s.", dev.name);
+    return fd;
+}
+
+/* Destroys all uinput devices. */
+static void uinput_close(struct xdisplay* d) {
+    int* fds[] = { &d->uinput_keyboard_fd, &d->uinput_pointer_fd,
+                   &d->uinput_touch_fd };
+    int i;
+    for (i = 0; i < sizeof(fds)/sizeof(fds[0]); i++) {
+        if (*fds[i] < 0)
+            continue;
+        ioctl(*fds[i], UI_DEV_DESTROY);
+        close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+/* Waits for the X server to add our uinput devices, and enables them.
+ * xorg-dummy.conf disables hotplugged devices by default, so that each X
+ * server only enables the devices that belong to it.
+ * Returns 0 on success, -1 if the devices did not show up in time. */
+static int uinput_enable_xdevices(struct xdisplay* d) {
+    int major = 2, minor = 0;
+    if (XIQueryVersion(d->dpy, &major, &minor) != Success) {
+        log(1, "XInput 2 not available.");
+        return -1;
+    }
+
+    Atom enabled_atom = XInternAtom(d->dpy, "Device Enabled", False);
+    char prefix[64];
+    int prefixlen = snprintf(prefix, sizeof(prefix), "crouton xiwi %s ",
+                             d->name);
+
+    int try;
+    for (try = 0; try < 20; try++) {
+        int i, ndevices, nenabled = 0;
+        XIDeviceInfo* info = XIQueryDevice(d->dpy, XIAllDevices, &ndevices);
+        for (i = 0; i < ndevices; i++) {
+            if (strncmp(info[i].name, prefix, prefixlen))
+                continue;
+            if (info[i].enabled) {
+                nenabled++;
+            } else {
+                unsigned char one = 1;
+                log(2, "Enabling %s", info[i].name);
+                XIChangeProperty(d->dpy, info[i].deviceid, enabled_atom,
+                                 XA_INTEGER, 8, PropModeReplace, &one, 1);
+            }
+        }
+        XIFreeDeviceInfo(info);
+
+        if (nenabled == 3)
+            return 0;
+
+        XSync(d->dpy, False);
+        usleep(50000);
+    }
+
+    return -1;
+}
+
+/* Creates the uinput devices. Returns 0 on success, -1 on error (in which
+ * case no device is left behind). */
+static int uinput_init(struct xdisplay* d) {
+    int fd, i;
+    const int btns[] = { BTN_LEFT, BTN_MIDDLE, BTN_RIGHT, BTN_SIDE, BTN_EXTRA };
+    const int rels[] = { REL_WHEEL, REL_HWHEEL,
+                         REL_WHEEL_HI_RES, REL_HWHEEL_HI_RES };
+    int absmax[ABS_CNT];
+
+    /* Keyboard: X11 KeyCodes are evdev codes + 8 */
+    fd = uinput_open(1 << EV_KEY | 1 << EV_SYN);
+    for (i = 1; i < 256-8; i++)
+        fd = uinput_setbit(fd, UI_SET_KEYBIT, i);
+    d->uinput_keyboard_fd = uinput_create(d, fd, "keyboard", NULL);
+
+    /* Pointer: absolute position, buttons and wheels */
+    memset(absmax, 0, sizeof(absmax));
+    absmax[ABS_X] = absmax[ABS_Y] = UINPUT_ABS_MAX;
+    fd = uinput_open(1 << EV_KEY | 1 << EV_REL | 1 << EV_ABS | 1 << EV_SYN);
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++)
+        fd = uinput_setbit(fd, UI_SET_KEYBIT, btns[i]);
+    for (i = 0; i < sizeof(rels)/sizeof(rels[0]); i++)
+        fd = uinput_setbit(fd, UI_SET_RELBIT, rels[i]);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_X);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_Y);
+    fd = uinput_setbit(fd, UI_SET_PROPBIT, INPUT_PROP_POINTER);
+    d->uinput_pointer_fd = uinput_create(d, fd, "pointer", absmax);
+
+    /* Touchscreen: multitouch (type B protocol), plus single-touch
+     * emulation */
+    absmax[ABS_MT_SLOT] = MAX_TOUCH-1;
+    absmax[ABS_MT_TRACKING_ID] = 0xffff;
+    absmax[ABS_MT_POSITION_X] = absmax[ABS_MT_POSITION_Y] = UINPUT_ABS_MAX;
+    fd = uinput_open(1 << EV_KEY | 1 << EV_ABS | 1 << EV_SYN);
+    fd = uinput_setbit(fd, UI_SET_KEYBIT, BTN_TOUCH);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_X);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_Y);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_MT_SLOT);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_MT_TRACKING_ID);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_MT_POSITION_X);
+    fd = uinput_setbit(fd, UI_SET_ABSBIT, ABS_MT_POSITION_Y);
+    fd = uinput_setbit(fd, UI_SET_PROPBIT, INPUT_PROP_DIRECT);
+    d->uinput_touch_fd = uinput_create(d, fd, "touchscreen", absmax);
+
+    if (d->uinput_keyboard_fd < 0 || d->uinput_pointer_fd < 0 ||
+            d->uinput_touch_fd < 0 || uinput_enable_xdevices(d) < 0) {
+        uinput_close(d);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Presses/releases a key (X11 KeyCode). */
+static void input_key(struct xdisplay* d, uint32_t keycode, int down) {
+    if (d->uinput_keyboard_fd >= 0 && keycode > 8) {
+        uinput_event(EV_KEY, keycode-8, down);
+        uinput_flush(d->uinput_keyboard_fd);
+    } else {
+        XTestFakeKeyEvent(d->dpy, keycode, down, CurrentTime);
+    }
+}
+
+/* Moves the wheels, in WHEEL_CLICK units (positive is up/right). */
+static void input_wheel(struct xdisplay* d, int dx, int dy) {
+    d->wheel_acc_x += dx;
+    d->wheel_acc_y += dy;
+
+    if (d->uinput_pointer_fd >= 0) {
+        /* High-resolution axes get every motion, legacy axes only report
+         * full clicks. */
+        if (dx)
+            uinput_event(EV_REL, REL_HWHEEL_HI_RES, dx);
+        if (dy)
+            uinput_event(EV_REL, REL_WHEEL_HI_RES, dy);
+        if (d->wheel_acc_x/WHEEL_CLICK) {
+            uinput_event(EV_REL, REL_HWHEEL, d->wheel_acc_x/WHEEL_CLICK);
+            d->wheel_acc_x %= WHEEL_CLICK;
+        }
+        if (d->wheel_acc_y/WHEEL_CLICK) {
+            uinput_event(EV_REL, REL_WHEEL, d->wheel_acc_y/WHEEL_CLICK);
+            d->wheel_acc_y %= WHEEL_CLICK;
+        }
+        uinput_flush(d->uinput_pointer_fd);
+        return;
+    }
+
+    /* XTest: X11 buttons 4-7 are up, down, left and right clicks. */
+    for (; d->wheel_acc_y >= WHEEL_CLICK; d->wheel_acc_y -= WHEEL_CLICK) {
+        XTestFakeButtonEvent(d->dpy, 4, 1, CurrentTime);
+        XTestFakeButtonEvent(d->dpy, 4, 0, CurrentTime);
+    }
+    for (; d->wheel_acc_y <= -WHEEL_CLICK; d->wheel_acc_y += WHEEL_CLICK) {
+        XTestFakeButtonEvent(d->dpy, 5, 1, CurrentTime);
+        XTestFakeButtonEvent(d->dpy, 5, 0, CurrentTime);
+    }
+    for (; d->wheel_acc_x <= -WHEEL_CLICK; d->wheel_acc_x += WHEEL_CLICK) {
+        XTestFakeButtonEvent(d->dpy, 6, 1, CurrentTime);
+        XTestFakeButtonEvent(d->dpy, 6, 0, CurrentTime);
+    }
+    for (; d->wheel_acc_x >= WHEEL_CLICK; d->wheel_acc_x -= WHEEL_CLICK) {
+        XTestFakeButtonEvent(d->dpy, 7, 1, CurrentTime);
+        XTestFakeButtonEvent(d->dpy, 7, 0, CurrentTime);
+    }
+}
+
+/* Presses/releases a mouse button (X11 button number, e.g. 1 is left). */
+static void input_button(struct xdisplay* d, uint32_t button, int down) {
+    int code;
+
+    if (d->uinput_pointer_fd < 0) {
+        XTestFakeButtonEvent(d->dpy, button, down, CurrentTime);
+        return;
+    }
+
+    switch (button) {
+    case 1: code = BTN_LEFT; break;
+    case 2: code = BTN_MIDDLE; break;
+    case 3: code = BTN_RIGHT; break;
+    case 4: case 5: case 6: case 7:
+        /* Wheel "buttons": one full click on press */
+        if (down)
+            input_wheel(d, button == 6 ? -WHEEL_CLICK :
+                            button == 7 ? WHEEL_CLICK : 0,
+                        button == 4 ? WHEEL_CLICK :
+                            button == 5 ? -WHEEL_CLICK : 0);
+        return;
+    case 8: code = BTN_SIDE; break;
+    case 9: code = BTN_EXTRA; break;
+    default:
+        log(1, "Unsupported button %d", button);
+        return;
+    }
+
+    uinput_event(EV_KEY, code, down);
+    uinput_flush(d->uinput_pointer_fd);
+}
+
+/* Moves the mouse to an absolute position. */
+static void input_motion(struct xdisplay* d, int x, int y) {
+    if (d->uinput_pointer_fd >= 0) {
+        uinput_event(EV_ABS, ABS_X, uinput_scale(x, d->screen_width));
+        uinput_event(EV_ABS, ABS_Y, uinput_scale(y, d->screen_height));
+        uinput_flush(d->uinput_pointer_fd);
+    } else {
+        XTestFakeMotionEvent(d->dpy, 0, x, y, CurrentTime);
+    }
+}
+
+/* Finds the slot used by touch point id. If alloc is set, a free slot is
+ * allocated if the touch point is unknown. Returns -1 if no slot is found. */
+static int touch_slot(struct xdisplay* d, uint32_t id, int alloc) {
+    int i, free = -1;
+    for (i = 0; i < MAX_TOUCH; i++) {
+        if (d->touch_slots[i].active && d->touch_slots[i].id == id)
+            return i;
+        if (!d->touch_slots[i].active && free < 0)
+            free = i;
+    }
+    if (!alloc || free < 0)
+        return -1;
+    d->touch_slots[free].active = 1;
+    d->touch_slots[free].id = id;
+    d->touch_active++;
+    return free;
+}
+
+/* Handles a touch point update. With XTest, the first touch point emulates
+ * the mouse (left button). */
+static void input_touch(struct xdisplay* d,
+                        uint32_t id, int state, int x, int y) {
+    int slot = touch_slot(d, id, state == TOUCH_START);
+    if (slot < 0) {
+        log(1, "Ignoring touch point %u (state %d)", id, state);
+        return;
+    }
+
+    if (state == TOUCH_START && d->touch_emulated_slot < 0)
+        d->touch_emulated_slot = slot;
+    int emulated = (slot == d->touch_emulated_slot);
+
+    if (state == TOUCH_END) {
+        d->touch_slots[slot].active = 0;
+        d->touch_active--;
+        if (emulated)
+            d->touch_emulated_slot = -1;
+    }
+
+    if (d->uinput_touch_fd < 0) {
+        if (emulated) {
+            if (state != TOUCH_END)
+                XTestFakeMotionEvent(d->dpy, 0, x, y, CurrentTime);
+            if (state != TOUCH_MOVE)
+                XTestFakeButtonEvent(d->dpy, 1, state == TOUCH_START,
+                                     CurrentTime);
+        }
+        return;
+    }
+
+    int ax = uinput_scale(x, d->screen_width);
+    int ay = uinput_scale(y, d->screen_height);
+    uinput_event(EV_ABS, ABS_MT_SLOT, slot);
+    if (state == TOUCH_END) {
+        uinput_event(EV_ABS, ABS_MT_TRACKING_ID, -1);
+    } else {
+        if (state == TOUCH_START) {
+            uinput_event(EV_ABS, ABS_MT_TRACKING_ID, d->touch_tracking_id);
+            d->touch_tracking_id = (d->touch_tracking_id + 1) & 0xffff;
+        }
+        uinput_event(EV_ABS, ABS_MT_POSITION_X, ax);
+        uinput_event(EV_ABS, ABS_MT_POSITION_Y, ay);
+        if (emulated) {
+            uinput_event(EV_ABS, ABS_X, ax);
+            uinput_event(EV_ABS, ABS_Y, ay);
+        }
+    }
+    if (state == TOUCH_START && d->touch_active == 1)
+        uinput_event(EV_KEY, BTN_TOUCH, 1);
+    else if (state == TOUCH_END && d->touch_active == 0)
+        uinput_event(EV_KEY, BTN_TOUCH, 0);
+    uinput_flush(d->uinput_touch_fd);
+}
+
+/* Releases all touch points */
+static void input_touch_release_all(struct xdisplay* d) {
+    int i;
+    for (i = 0; i < MAX_TOUCH; i++) {
+        if (d->touch_slots[i].active)
+            input_touch(d, d->touch_slots[i].id, TOUCH_END, 0, 0);
+    }
+}
+
 /* Releases all pressed key/buttons, and empties array */
-void kb_release_all() {
+void kb_release_all(struct xdisplay* d) {
     int i;
     log(2, "Releasing all keys...");
-    for (i = 0; i < pressed_len; i++) {
-        if (pressed[i].type == MOUSE) {
-            log(2, "Mouse %d", pressed[i].code);
-            XTestFakeButtonEvent(dpy, pressed[i].code, 0, CurrentTime);
-        } else if (pressed[i].type == KEYBOARD) {
-            log(2, "Keyboard %d", pressed[i].code);
-            XTestFakeKeyEvent(dpy, pressed[i].code, 0, CurrentTime);
+    for (i = 0; i < d->pressed_len; i++) {
+        if (d->pressed[i].type == MOUSE) {
+            log(2, "Mouse %d", d->pressed[i].code);
+            input_button(d, d->pressed[i].code, 0);
+        } else if (d->pressed[i].type == KEYBOARD) {
+            log(2, "Keyboard %d", d->pressed[i].code);
+            input_key(d, d->pressed[i].code, 0);
         }
     }
-    pressed_len = 0;
+    d->pressed_len = 0;
+    input_touch_release_all(d);
 }
 
 /* X11-related functions */
@@ -111,6 +642,13 @@ static int xerror_handler(Display *dpy, XErrorEvent *e) {
     return 0;
 }
 
+/* Xlib exits if this handler returns: jump back to the main loop instead,
+ * which drops the display (see display_lost). */
+static int io_error_handler(Display* dpy) {
+    io_error_dpy = dpy;
+    siglongjmp(io_error_jmp, 1);
+}
+
 /* Sets the CROUTON_CONNECTED property for the root window */
 static void set_connected(Display *dpy, uint8_t connected) {
     Window root = DefaultRootWindow(dpy);
@@ -134,53 +672,56 @@ static void register_damage(Display *dpy, Window win) {
 }
 
 /* Connects to the X11 display, initializes extensions, register for events */
-static int init_display(char* name) {
-    dpy = XOpenDisplay(name);
+static int init_display(struct xdisplay* d) {
+    d->dpy = XOpenDisplay(d->name);
 
-    if (!dpy) {
-        error("Cannot open display.");
+    if (!d->dpy) {
+        error("Cannot open display %s.", d->name);
         return -1;
     }
 
     /* We need XTest, XDamage and XFixes */
     int event, error, major, minor;
-    if (!XTestQueryExtension(dpy, &event, &error, &major, &minor)) {
+    if (!XTestQueryExtension(d->dpy, &event, &error, &major, &minor)) {
         error("XTest not available!");
         return -1;
     }
 
-    if (!XDamageQueryExtension(dpy, &damageEvent, &error)) {
+    if (!XDamageQueryExtension(d->dpy, &d->damageEvent, &error)) {
         error("XDamage not available!");
         return -1;
     }
 
-    if (!XFixesQueryExtension(dpy, &fixesEvent, &error)) {
+    if (!XFixesQueryExtension(d->dpy, &d->fixesEvent, &error)) {
         error("XFixes not available!");
         return -1;
     }
 
     /* Get notified when new windows are created. */
-    Window root = DefaultRootWindow(dpy);
-    XSelectInput(dpy, root, SubstructureNotifyMask);
+    Window root = DefaultRootWindow(d->dpy);
+    XSelectInput(d->dpy, root, SubstructureNotifyMask);
 
     /* Register damage events for existing windows */
     Window rootp, parent;
     Window *children;
     unsigned int i, nchildren;
-    XQueryTree(dpy, root, &rootp, &parent, &children, &nchildren);
+    XQueryTree(d->dpy, root, &rootp, &parent, &children, &nchildren);
 
     /* FIXME: We never reset the handler, is that a good thing? */
     XSetErrorHandler(xerror_handler);
 
-    register_damage(dpy, root);
+    register_damage(d->dpy, root);
     for (i = 0; i < nchildren; i++) {
-        register_damage(dpy, children[i]);
+        register_damage(d->dpy, children[i]);
     }
 
     XFree(children);
 
     /* Register for cursor events */
-    XFixesSelectCursorInput(dpy, root, XFixesDisplayCursorNotifyMask);
+    XFixesSelectCursorInput(d->dpy, root, XFixesDisplayCursorNotifyMask);
+
+    d->screen_width = DisplayWidth(d->dpy, DefaultScreen(d->dpy));
+    d->screen_height = DisplayHeight(d->dpy, DefaultScreen(d->dpy));
 
     return 0;
 }
@@ -188,24 +729,30 @@ static int init_display(char* name) {
 /* Changes resolution using external handler.
  * Reply must be a resolution in "canonical" form: <w>x<h>[_<rate>] */
 /* FIXME: Maybe errors here should not be fatal... */
-void change_resolution(const struct resolution* rin) {
+void change_resolution(struct ws_client* c, const struct resolution* rin) {
+    struct xdisplay* d = c->server->data;
+
     /* Setup parameters and run command */
     char arg1[32], arg2[32];
-    int c;
-    c = snprintf(arg1, sizeof(arg1), "%d", rin->width);
-    trueorabort(c > 0, "snprintf");
-    c = snprintf(arg2, sizeof(arg2), "%d", rin->height);
-    trueorabort(c > 0, "snprintf");
+    int n;
+    n = snprintf(arg1, sizeof(arg1), "%d", rin->width);
+    trueorabort(n > 0, "snprintf");
+    n = snprintf(arg2, sizeof(arg2), "%d", rin->height);
+    trueorabort(n > 0, "snprintf");
 
     char* cmd = "setres";
     char* args[] = {cmd, arg1, arg2, NULL};
+
+    metric_inc(metric_resolution_changes);
     char buffer[256];
-    log(2, "Running %s %s %s", cmd, arg1, arg2);
-    c = popen2(cmd, args, NULL, 0, buffer, sizeof(buffer));
-    trueorabort(c > 0, "popen2");
+    log(2, "Running %s %s %s on %s", cmd, arg1, arg2, d->name);
+    /* setres acts on $DISPLAY */
+    setenv("DISPLAY", d->name, 1);
+    n = popen2(cmd, args, NULL, 0, buffer, sizeof(buffer));
+    trueorabort(n > 0, "popen2");
 
     /* Parse output */
-    buffer[c < sizeof(buffer) ? c : (sizeof(buffer)-1)] = 0;
+    buffer[n < sizeof(buffer) ? n : (sizeof(buffer)-1)] = 0;
     log(2, "Result: %s", buffer);
     char* cut = strchr(buffer, '_');
     if (cut) *cut = 0;
@@ -222,12 +769,11 @@ void change_resolution(const struct resolution* rin) {
                 "Invalid height: '%s'", cut+1);
     log(1, "New resolution %ld x %ld", nwidth, nheight);
 
-    char reply_raw[FRAMEMAXHEADERSIZE + sizeof(struct resolution)];
-    struct resolution* r = (struct resolution*)(reply_raw + FRAMEMAXHEADERSIZE);
-    r->type = 'R';
-    r->width = nwidth;
-    r->height = nheight;
-    socket_client_write_frame(reply_raw, sizeof(*r), WS_OPCODE_BINARY, 1);
+    struct resolution r;
+    r.type = 'R';
+    r.width = nwidth;
+    r.height = nheight;
+    socket_client_write_frame(c, (char*)&r, sizeof(r), WS_OPCODE_BINARY, 1);
 }
 
 /* Closes the mmap/fd in the entry. */
@@ -241,34 +787,26 @@ void close_mmap(struct cache_entry* entry) {
     entry->map = NULL;
 }
 
-/* Finds NaCl/Chromium shm memory using external handler.
+/* Maps NaCl/Chromium shm memory in entry, using external handler if the
+ * current mapping does not match the signature.
  * Reply must be in the form PID:file */
-struct cache_entry* find_shm(uint64_t paddr, uint64_t sig, size_t length) {
-    struct cache_entry* entry = NULL;
-
-    /* Find entry in cache */
-    if (cache[0].paddr == paddr) {
-        entry = &cache[0];
-    } else if (cache[1].paddr == paddr) {
-        entry = &cache[1];
-    } else {
-        /* Not found: erase an existing entry. */
-        entry = &cache[next_entry];
-        next_entry = (next_entry + 1) % 2;
-        close_mmap(entry);
-    }
-
+struct cache_entry* map_shm(struct cache_entry* entry,
+                            uint64_t paddr, uint64_t sig, size_t length) {
     int try;
     for (try = 0; try < 2; try++) {
         /* Check signature */
         if (entry->map) {
-            if (*((uint64_t*)entry->map) == sig)
+            if (*((uint64_t*)entry->map) == sig) {
+                metric_inc(metric_shm_hits);
                 return entry;
+            }
 
             log(1, "Invalid signature, fetching new shm!");
             close_mmap(entry);
         }
 
+        metric_inc(metric_shm_misses);
+
         /* Setup parameters and run command */
         char arg1[32], arg2[32];
         int c;
@@ -298,7 +836,7 @@ struct cache_entry* find_shm(uint64_t paddr, uint64_t sig, size_t length) {
         /* Parse PID:file output */
         char* cut = strchr(buffer, ':');
         if (!cut) {
-            error("No ':' in helper reply: %s.", cut);
+            error("No ':' in helper reply: %s.", buffer);
             return NULL;
         }
         *cut = 0;
@@ -335,109 +873,235 @@ struct cache_entry* find_shm(uint64_t paddr, uint64_t sig, size_t length) {
     return NULL;
 }
 
+/* Finds NaCl/Chromium shm memory of a client, in the cache or using
+ * external handler. */
+struct cache_entry* find_shm(struct viewer* v,
+                             uint64_t paddr, uint64_t sig, size_t length) {
+    struct cache_entry* entry = NULL;
+
+    /* Find entry in cache */
+    if (v->cache[0].paddr == paddr) {
+        entry = &v->cache[0];
+    } else if (v->cache[1].paddr == paddr) {
+        entry = &v->cache[1];
+    } else {
+        /* Not found: erase an existing entry. */
+        entry = &v->cache[v->next_entry];
+        v->next_entry = (v->next_entry + 1) % 2;
+        close_mmap(entry);
+    }
+
+    return map_shm(entry, paddr, sig, length);
+}
+
 /* WebSocket functions */
 
-XImage* img = NULL;
-XShmSegmentInfo shminfo;
+/* Output queue policy (see outq_policy in websocket.h): a cursor image that
+ * is still queued is superseded by a newer one (the client asks again if the
+ * old cursor comes back). Screen replies are never dropped, as the client
+ * waits for each of them before requesting the next frame. */
+static int outq_policy_fbserver(char* queued, size_t queuedlen,
+                                const char* frame, size_t framelen) {
+    if (queued[0] == 'P' && frame[0] == 'P')
+        return OUTQ_DROP_QUEUED;
+    return OUTQ_KEEP;
+}
 
-/* Writes framebuffer image to websocket/shm */
-int write_image(const struct screen* screen) {
-    char reply_raw[FRAMEMAXHEADERSIZE + sizeof(struct screen_reply)];
-    struct screen_reply* reply =
-        (struct screen_reply*)(reply_raw + FRAMEMAXHEADERSIZE);
-    int refresh = 0;
+/* Marks all the frames grabbed from d as outdated. */
+static void grabs_damaged(struct xdisplay* d) {
+    int i;
 
-    memset(reply_raw, 0, sizeof(reply_raw));
+    for (i = 0; i < MAX_GRABS; i++)
+        d->grabs[i].dirty = 1;
+}
 
-    reply->type = 'S';
-    reply->width = screen->width;
-    reply->height = screen->height;
+/* Frees a grabbed frame. The XShm segment is only detached from the X
+ * server if the connection is still usable (detach=1). */
+static void grab_free(struct xdisplay* d, struct grab* g, int detach) {
+    if (!g->img)
+        return;
 
-    /* Allocate XShmImage */
-    if (!img || img->width != screen->width || img->height != screen->height) {
-        if (img) {
-            XDestroyImage(img);
-            shmdt(shminfo.shmaddr);
-            shmctl(shminfo.shmid, IPC_RMID, 0);
-        }
-
-        /* FIXME: Some error checking should happen here... */
-        img = XShmCreateImage(dpy, DefaultVisual(dpy, 0), 24,
-                              ZPixmap, NULL, &shminfo,
-                              screen->width, screen->height);
-        trueorabort(img, "XShmCreateImage");
-        shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line*img->height,
-                               IPC_CREAT|0777);
-        trueorabort(shminfo.shmid != -1, "shmget");
-        shminfo.shmaddr = img->data = shmat(shminfo.shmid, 0, 0);
-        trueorabort(shminfo.shmaddr != (void*)-1, "shmat");
-        shminfo.readOnly = False;
-        int ret = XShmAttach(dpy, &shminfo);
-        trueorabort(ret, "XShmAttach");
-        /* Force refresh */
-        refresh = 1;
-    }
+    if (detach)
+        XShmDetach(d->dpy, &g->shminfo);
+    XDestroyImage(g->img);
+    shmdt(g->shminfo.shmaddr);
+    shmctl(g->shminfo.shmid, IPC_RMID, 0);
+    g->img = NULL;
+}
 
-    if (screen->refresh) {
-        log(1, "Force refresh from client.");
-        /* refresh forced by the client */
-        refresh = 1;
+/* Returns the grabbed frame of the given size, allocating it if needed (in
+ * place of the one that was requested least recently). */
+static struct grab* grab_get(struct xdisplay* d, int width, int height) {
+    uint64_t now = gettime_us();
+    struct grab* found = NULL;
+    struct grab* g = NULL;
+    int i;
+
+    for (i = 0; i < MAX_GRABS; i++) {
+        struct grab* cur = &d->grabs[i];
+        if (cur->img && cur->img->width == width &&
+                cur->img->height == height) {
+            cur->last_used = now;
+            found = cur;
+        } else if (cur->img && now - cur->last_used > GRAB_EXPIRE) {
+            grab_free(d, cur, 1);
+        }
+        if (!g || (g->img && (!cur->img || cur->last_used < g->last_used)))
+            g = cur;
     }
+    if (found)
+        return found;
+
+    grab_free(d, g, 1);
+
+    /* FIXME: Some error checking should happen here... */
+    g->img = XShmCreateImage(d->dpy, DefaultVisual(d->dpy, 0), 24,
+                             ZPixmap, NULL, &g->shminfo, width, height);
+    trueorabort(g->img, "XShmCreateImage");
+    g->shminfo.shmid = shmget(IPC_PRIVATE,
+                              g->img->bytes_per_line*g->img->height,
+                              IPC_CREAT|0777);
+    trueorabort(g->shminfo.shmid != -1, "shmget");
+    g->shminfo.shmaddr = g->img->data = shmat(g->shminfo.shmid, 0, 0);
+    trueorabort(g->shminfo.shmaddr != (void*)-1, "shmat");
+    g->shminfo.readOnly = False;
+    int ret = XShmAttach(d->dpy, &g->shminfo);
+    trueorabort(ret, "XShmAttach");
+    /* Force grab */
+    g->dirty = 1;
+    g->last_used = now;
+    return g;
+}
 
+/* Drains damage and cursor events from the X queue. */
+static void handle_xevents(struct xdisplay* d) {
     XEvent ev;
+
     /* Register damage on new windows */
-    while (XCheckTypedEvent(dpy, MapNotify, &ev)) {
-        register_damage(dpy, ev.xcreatewindow.window);
-        refresh = 1;
+    while (XCheckTypedEvent(d->dpy, MapNotify, &ev)) {
+        register_damage(d->dpy, ev.xcreatewindow.window);
+        grabs_damaged(d);
     }
 
     /* Check for damage */
-    while (XCheckTypedEvent(dpy, damageEvent + XDamageNotify, &ev)) {
-        refresh = 1;
+    while (XCheckTypedEvent(d->dpy, d->damageEvent + XDamageNotify, &ev)) {
+        metric_inc(metric_damage_events);
+        grabs_damaged(d);
     }
 
     /* Check for cursor events */
-    reply->cursor_updated = 0;
-    while (XCheckTypedEvent(dpy, fixesEvent + XFixesCursorNotify, &ev)) {
+    while (XCheckTypedEvent(d->dpy, d->fixesEvent + XFixesCursorNotify, &ev)) {
         XFixesCursorNotifyEvent* curev = (XFixesCursorNotifyEvent*)&ev;
+        metric_inc(metric_cursor_events);
         if (verbose >= 2) {
-            char* name = XGetAtomName(dpy, curev->cursor_name);
+            char* name = XGetAtomName(d->dpy, curev->cursor_name);
             log(2, "cursor! %ld %s", curev->cursor_serial, name);
             XFree(name);
         }
+        d->cursor_seq++;
+        d->cursor_serial = curev->cursor_serial;
+    }
+}
+
+/* Writes framebuffer image to websocket/shm */
+int write_image(struct ws_client* c, const struct screen* screen) {
+    struct xdisplay* d = c->server->data;
+    struct viewer* v = c->data;
+    struct screen_reply reply_data;
+    struct screen_reply* reply = &reply_data;
+    int refresh = 0;
+    int grabbed = 0;
+    uint64_t start = gettime_us();
+
+    metric_inc(metric_frames_requested);
+    memset(reply, 0, sizeof(*reply));
+
+    reply->type = 'S';
+    reply->width = screen->width;
+    reply->height = screen->height;
+
+    d->screen_width = screen->width;
+    d->screen_height = screen->height;
+
+    /* The client lags behind (earlier replies are still queued): do not
+     * copy a frame that would reach it late. Damage and cursor changes are
+     * reported on the next request. */
+    if (socket_client_queued(c) > 0) {
+        trace(2, "lagging, %d bytes queued", socket_client_queued(c));
+        v->refresh_pending |= screen->refresh;
+        metric_inc(metric_frames_lagging);
+        socket_client_write_frame(c, (char*)reply, sizeof(*reply),
+                                  WS_OPCODE_BINARY, 1);
+        return 0;
+    }
+
+    /* Viewers of the same size share the grabbed frame. */
+    struct grab* g = grab_get(d, screen->width, screen->height);
+
+    if (screen->refresh || v->refresh_pending) {
+        log(1, "Force refresh from client.");
+        /* refresh forced by the client */
+        refresh = 1;
+        v->refresh_pending = 0;
+    }
+
+    handle_xevents(d);
+
+    if (v->cursor_seq != d->cursor_seq) {
         reply->cursor_updated = 1;
-        reply->cursor_serial = curev->cursor_serial;
+        reply->cursor_serial = d->cursor_serial;
+        v->cursor_seq = d->cursor_seq;
+    }
+    reply->damage_us = gettime_us() - start;
+
+    /* Get new image from framebuffer, unless another client of the same
+     * size already did since the last damage. */
+    if (g->dirty) {
+        XShmGetImage(d->dpy, DefaultRootWindow(d->dpy), g->img,
+                     0, 0, AllPlanes);
+        g->dirty = 0;
+        grabbed = 1;
+        g->frame_seq = ++d->frame_seq;
+        reply->grab_us = gettime_us() - start;
+    } else {
+        /* Grab skipped: the stage took no time. */
+        reply->grab_us = reply->damage_us;
     }
 
     /* No update */
-    if (!refresh) {
+    if (v->frame_seq == g->frame_seq && !refresh) {
         reply->shm = 0;
         reply->updated = 0;
-        socket_client_write_frame(reply_raw, sizeof(*reply),
+        metric_inc(metric_frames_skipped);
+        reply->send_us = gettime_us() - start;
+        socket_client_write_frame(c, (char*)reply, sizeof(*reply),
                                   WS_OPCODE_BINARY, 1);
         return 0;
     }
 
-    /* Get new image from framebuffer */
-    XShmGetImage(dpy, DefaultRootWindow(dpy), img, 0, 0, AllPlanes);
+    if (!grabbed)
+        metric_inc(metric_frames_shared);
 
-    int size = img->bytes_per_line * img->height;
+    int size = g->img->bytes_per_line * g->img->height;
 
     trueorabort(size == screen->width*screen->height*4,
                 "Invalid screen byte count");
 
     trueorabort(screen->shm, "Non-SHM rendering is not supported");
 
-    struct cache_entry* entry = find_shm(screen->paddr, screen->sig, size);
+    struct cache_entry* entry = find_shm(v, screen->paddr, screen->sig, size);
 
     reply->shm = 1;
     reply->updated = 1;
     reply->shmfailed = 0;
+    metric_inc(metric_frames_updated);
 
     if (entry && entry->map) {
         if (size == entry->length) {
-            memcpy(entry->map, img->data, size);
+            memcpy(entry->map, g->img->data, size);
             msync(entry->map, size, MS_SYNC);
+            metric_add(metric_bytes_copied, size);
+            v->frame_seq = g->frame_seq;
         } else {
             /* This should never happen (it means the client passed an
              * outdated buffer to us). */
@@ -451,184 +1115,550 @@ int write_image(const struct screen* screen) {
         error("Cannot find shm, moving on...");
         reply->shmfailed = 1;
     }
+    if (reply->shmfailed)
+        metric_inc(metric_frames_shmfailed);
+    reply->copy_us = gettime_us() - start;
+
+    trace(3, "Frame timings (us): damage %u, grab %u, copy %u",
+          reply->damage_us, reply->grab_us, reply->copy_us);
 
     /* Confirm write is done */
-    socket_client_write_frame(reply_raw, sizeof(*reply),
+    reply->send_us = gettime_us() - start;
+    socket_client_write_frame(c, (char*)reply, sizeof(*reply),
                               WS_OPCODE_BINARY, 1);
 
     return 0;
 }
 
 /* Writes cursor image to websocket */
-int write_cursor() {
-    XFixesCursorImage *img = XFixesGetCursorImage(dpy);
+int write_cursor(struct ws_client* c) {
+    struct xdisplay* d = c->server->data;
+    XFixesCursorImage *img = XFixesGetCursorImage(d->dpy);
     if (!img) {
         error("XFixesGetCursorImage returned NULL");
         return -1;
     }
     int size = img->width*img->height;
-    const int replylength = sizeof(struct cursor_reply) + size*sizeof(uint32_t);
-    char reply_raw[FRAMEMAXHEADERSIZE + replylength];
-    struct cursor_reply* reply =
-        (struct cursor_reply*)(reply_raw + FRAMEMAXHEADERSIZE);
-
-    memset(reply_raw, 0, sizeof(*reply_raw));
-
-    reply->type = 'P';
-    reply->width = img->width;
-    reply->height = img->height;
-    reply->xhot = img->xhot;
-    reply->yhot = img->yhot;
-    reply->cursor_serial = img->cursor_serial;
+    struct cursor_reply reply;
+    uint32_t pixels[size];
+
+    memset(&reply, 0, sizeof(reply));
+
+    reply.type = 'P';
+    reply.width = img->width;
+    reply.height = img->height;
+    reply.xhot = img->xhot;
+    reply.yhot = img->yhot;
+    reply.cursor_serial = img->cursor_serial;
     /* This casts long[] to uint32_t[] */
     int i;
     for (i = 0; i < size; i++)
-        reply->pixels[i] = img->pixels[i];
-
-    socket_client_write_frame(reply_raw, replylength, WS_OPCODE_BINARY, 1);
+        pixels[i] = img->pixels[i];
+
+    /* Header and pixels are sent in one frame, without copying them. */
+    struct iovec iov[2];
+    iov[0].iov_base = &reply;
+    iov[0].iov_len = sizeof(reply);
+    iov[1].iov_base = pixels;
+    iov[1].iov_len = sizeof(pixels);
+    socket_client_write_framev(c, iov, 2, WS_OPCODE_BINARY, 1, 0);
     XFree(img);
 
     return 0;
 }
 
-void write_init() {
-    char raw[FRAMEMAXHEADERSIZE + sizeof(struct initinfo)];
-    struct initinfo* i = (struct initinfo*)(raw + FRAMEMAXHEADERSIZE);
-    i->type = 'I';
-    i->freon = 0;
+void write_init(struct ws_client* c) {
+    struct initinfo i;
+    i.type = 'I';
+    i.freon = 0;
     if (access("/sys/class/tty/tty0/active", F_OK) == -1) {
         trueorabort(errno == ENOENT, "Could not determine if using Freon or not");
-        i->freon = 1;
+        i.freon = 1;
     }
-    socket_client_write_frame(raw, sizeof(*i), WS_OPCODE_BINARY, 1);
+    socket_client_write_frame(c, (char*)&i, sizeof(i), WS_OPCODE_BINARY, 1);
 }
 
 /* Checks if a packet size is correct */
-int check_size(int length, int target, char* error) {
+int check_size(struct ws_client* c, int length, int target, char* error) {
     if (length != target) {
         error("Invalid %s packet (%d != %d)", error, length, target);
-        socket_client_close(0);
+        socket_client_close(c, 0);
         return 0;
     }
     return 1;
 }
 
+/* Time of the last input event (ms), from any client */
+static uint64_t mailbox_last_input = 0;
+/* Keep polling the mailbox for that long after the last input event (ms),
+ * before going to sleep and asking the client for a nudge. */
+const int MAILBOX_SPIN_MS = 200;
+
+/* Handles an input packet, coming from the WebSocket or the mailbox.
+ * Returns 0 on success (including invalid packet size, in which case the
+ * connection is closed), -1 if this is not an input packet. */
+static int handle_input(struct ws_client* c, char* buffer, int length) {
+    struct xdisplay* d = c->server->data;
+
+    switch (buffer[0]) {
+    case 'K': {  /* Key */
+        if (!check_size(c, length, sizeof(struct key), "key"))
+            break;
+        struct key* k = (struct key*)buffer;
+        log(2, "Key: kc=%04x\n", k->keycode);
+        input_key(d, k->keycode, k->down);
+        metric_inc(metric_input_key);
+        if (k->down) {
+            kb_add(d, KEYBOARD, k->keycode);
+        } else {
+            kb_remove(d, KEYBOARD, k->keycode);
+        }
+        break;
+    }
+    case 'C': {  /* Click */
+        if (!check_size(c, length, sizeof(struct mouseclick), "mouseclick"))
+            break;
+        struct mouseclick* mc = (struct mouseclick*)buffer;
+        input_button(d, mc->button, mc->down);
+        metric_inc(metric_input_click);
+        if (mc->down) {
+            kb_add(d, MOUSE, mc->button);
+        } else {
+            kb_remove(d, MOUSE, mc->button);
+        }
+        break;
+    }
+    case 'M': {  /* Mouse move */
+        if (!check_size(c, length, sizeof(struct mousemove), "mousemove"))
+            break;
+        struct mousemove* mm = (struct mousemove*)buffer;
+        input_motion(d, mm->x, mm->y);
+        metric_inc(metric_input_motion);
+        break;
+    }
+    case 'W': {  /* Mouse wheel */
+        if (!check_size(c, length, sizeof(struct mousewheel), "mousewheel"))
+            break;
+        struct mousewheel* mw = (struct mousewheel*)buffer;
+        input_wheel(d, mw->dx, mw->dy);
+        metric_inc(metric_input_wheel);
+        break;
+    }
+    case 'T': {  /* Touch */
+        if (!check_size(c, length, sizeof(struct touch), "touch"))
+            break;
+        struct touch* t = (struct touch*)buffer;
+        input_touch(d, t->id, t->state, t->x, t->y);
+        metric_inc(metric_input_touch);
+        break;
+    }
+    default:
+        return -1;
+    }
+
+    mailbox_last_input = gettime_ms();
+    return 0;
+}
+
+/* Unmaps the input mailbox of a client, if any. */
+static void mailbox_close(struct viewer* v) {
+    close_mmap(&v->mailbox_entry);
+    v->mailbox_entry.paddr = 0;
+    v->mailbox_ring = NULL;
+}
+
+/* Finds the input mailbox registered by the client, and replies with the
+ * result. The client keeps using the WebSocket for input events if the
+ * mailbox cannot be found. */
+static void mailbox_register(struct ws_client* c, const struct mailbox* m) {
+    struct viewer* v = c->data;
+    struct mailbox reply;
+
+    mailbox_close(v);
+
+    reply = *m;
+    reply.ok = 0;
+
+    if (m->length >= sizeof(struct mailbox_ring) &&
+            map_shm(&v->mailbox_entry, m->paddr, m->sig, m->length)) {
+        v->mailbox_ring = v->mailbox_entry.map;
+        v->mailbox_size = v->mailbox_ring->size;
+        if (v->mailbox_size > 0 && v->mailbox_size <=
+                (m->length - sizeof(struct mailbox_ring))/MAILBOX_ENTRY_SIZE) {
+            log(1, "Input mailbox registered (%d entries).",
+                v->mailbox_size);
+            reply.ok = 1;
+        } else {
+            error("Invalid mailbox size %d.", v->mailbox_size);
+            mailbox_close(v);
+        }
+    }
+
+    socket_client_write_frame(c, (char*)&reply, sizeof(reply),
+                              WS_OPCODE_BINARY, 1);
+}
+
+/* Handles all the input packets in the mailbox of a client. */
+static void mailbox_drain(struct ws_client* c) {
+    struct xdisplay* d = c->server->data;
+    struct viewer* v = c->data;
+    struct mailbox_ring* ring = v->mailbox_ring;
+
+    if (!ring)
+        return;
+
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    uint32_t tail = ring->tail;
+    int n = 0;
+
+    if (head - tail > v->mailbox_size) {
+        error("Invalid mailbox state (%u/%u).", head, tail);
+        mailbox_close(v);
+        return;
+    }
+
+    while (tail != head) {
+        uint8_t* entry = ring->entries[tail % v->mailbox_size];
+        int length = entry[0];
+        if (length < 1 || length >= MAILBOX_ENTRY_SIZE ||
+                handle_input(c, (char*)entry+1, length) < 0) {
+            error("Invalid mailbox packet (%d/%d).", length, entry[1]);
+            mailbox_close(v);
+            return;
+        }
+        tail++;
+        n++;
+    }
+    metric_add(metric_input_mailbox, n);
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_SEQ_CST);
+
+    if (n > 0) {
+        trace(3, "Drained %d packets from mailbox.", n);
+        /* Make sure XTest events are sent right away. */
+        XFlush(d->dpy);
+    }
+}
+
+/* Drains the mailboxes of all clients, and returns the timeout to use when
+ * waiting for data on the WebSockets: mailboxes are polled every millisecond
+ * shortly after input activity, then the server goes to sleep, and lets
+ * the clients send a nudge packet when they write to their mailbox. */
+static int mailbox_wait_timeout() {
+    int timeout = -1;
+    int i;
+
+    for (i = 0; i < nclients; i++) {
+        struct viewer* v = clients[i]->data;
+        if (clients[i]->fd < 0 || !v)
+            continue;
+
+        mailbox_drain(clients[i]);
+        if (!v->mailbox_ring || clients[i]->fd < 0)
+            continue;
+
+        if (gettime_ms() - mailbox_last_input < MAILBOX_SPIN_MS) {
+            timeout = 1;
+            continue;
+        }
+
+        /* Ask for a nudge, then check again, in case an event came in
+         * before the flag was set. */
+        __atomic_store_n(&v->mailbox_ring->waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t head = __atomic_load_n(&v->mailbox_ring->head,
+                                        __ATOMIC_SEQ_CST);
+        if (head != v->mailbox_ring->tail)
+            return 0;
+    }
+
+    return timeout;
+}
+
+/* Sets up the state of a new client. */
+static void client_init(struct ws_client* c) {
+    struct xdisplay* d = c->server->data;
+    struct viewer* v = calloc(1, sizeof(*v));
+    trueorabort(v, "Cannot allocate client state");
+
+    /* Send the current frame and cursor on the first request. */
+    v->frame_seq = 0;
+    v->cursor_seq = d->cursor_serial ? d->cursor_seq - 1 : d->cursor_seq;
+    c->data = v;
+}
+
+/* Releases the state of a closed client (see client_cleanup). */
+static void client_free(struct ws_client* c) {
+    struct xdisplay* d = c->server->data;
+    struct viewer* v = c->data;
+
+    if (!v)
+        return;
+
+    /* Keys cannot be tracked per client: release them all (on the display
+     * of the client, unless it is gone). */
+    if (d->dpy)
+        kb_release_all(d);
+    close_mmap(&v->cache[0]);
+    close_mmap(&v->cache[1]);
+    mailbox_close(v);
+    free(v);
+    c->data = NULL;
+}
+
+/* Reads a request from a client, and handles it. */
+static void handle_request(struct ws_client* c) {
+    struct xdisplay* d = c->server->data;
+    unsigned char buffer[BUFFERSIZE];
+    int length;
+
+    length = socket_client_read_frame(c, (char*)buffer, sizeof(buffer));
+    if (length < 0) {
+        socket_client_close(c, 1);
+        return;
+    }
+
+    if (length < 1) {
+        error("Invalid packet from client (size <1).");
+        socket_client_close(c, 0);
+        return;
+    }
+
+    /* kiwi falls back to the WebSocket when the ring is full: whatever it
+     * wrote to the ring before this packet must be handled first (e.g. a
+     * key press, before the 'Q' that releases all keys). */
+    mailbox_drain(c);
+
+    switch (buffer[0]) {
+    case 'S':  /* Screen */
+        if (!check_size(c, length, sizeof(struct screen), "screen"))
+            break;
+        write_image(c, (struct screen*)buffer);
+        break;
+    case 'P':  /* Cursor */
+        if (!check_size(c, length, sizeof(struct cursor), "cursor"))
+            break;
+        write_cursor(c);
+        break;
+    case 'R':  /* Resolution */
+        if (!check_size(c, length, sizeof(struct resolution), "resolution"))
+            break;
+        change_resolution(c, (struct resolution*)buffer);
+        break;
+    case 'B':  /* Input mailbox */
+        if (!check_size(c, length, sizeof(struct mailbox), "mailbox"))
+            break;
+        mailbox_register(c, (struct mailbox*)buffer);
+        break;
+    case 'N':  /* Nudge: the mailbox was drained before reading */
+        break;
+    case 'Q':  /* "Quit": release all keys */
+        kb_release_all(d);
+        break;
+    default:
+        if (handle_input(c, (char*)buffer, length) < 0) {
+            error("Invalid packet from client (%d).", buffer[0]);
+            socket_client_close(c, 0);
+        }
+    }
+}
+
+/* Forgets about a display whose X server went away, and closes its viewers
+ * and server socket. The connection cannot be used anymore, not even to
+ * close it. Exits if no display is left. */
+static void display_lost(Display* dpy) {
+    int i, j, left = 0;
+
+    for (i = 0; i < ndisplays; i++) {
+        struct xdisplay* d = &displays[i];
+
+        if (d->dpy && d->dpy == dpy) {
+            error("Lost display %s.", d->name);
+            close(ConnectionNumber(dpy));
+            d->dpy = NULL;
+
+            for (j = 0; j < MAX_GRABS; j++)
+                grab_free(d, &d->grabs[j], 0);
+            uinput_close(d);
+
+            for (j = 0; j < nclients; j++) {
+                if (clients[j]->server == d->server)
+                    socket_client_close(clients[j], 1);
+            }
+            close(d->server->fd);
+            d->server->fd = -1;
+        }
+
+        if (d->dpy)
+            left++;
+    }
+
+    if (!left) {
+        error("No display left, exiting.");
+        exit(1);
+    }
+}
+
 /* Prints usage */
 void usage(char* argv0) {
-    fprintf(stderr, "%s [-v 0-3] display\n", argv0);
+    fprintf(stderr, "%s [-v 0-3] [-i auto|xtest|uinput] display...\n",
+            argv0);
     exit(1);
 }
 
 int main(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "v:")) != -1) {
+
+    popen2_helper_main();
+
+    while ((c = getopt(argc, argv, "v:i:")) != -1) {
         switch (c) {
         case 'v':
             verbose = atoi(optarg);
             break;
+        case 'i':
+            if (!strcmp(optarg, "auto"))
+                input_backend = INPUT_AUTO;
+            else if (!strcmp(optarg, "xtest"))
+                input_backend = INPUT_XTEST;
+            else if (!strcmp(optarg, "uinput"))
+                input_backend = INPUT_UINPUT;
+            else
+                usage(argv[0]);
+            break;
         default:
             usage(argv[0]);
         }
     }
 
-    if (optind != argc-1)
+    if (optind >= argc || argc-optind > MAX_DISPLAYS)
         usage(argv[0]);
 
-    char* display = argv[optind];
+    trace_init("fbserver");
+    /* Before the displays are mapped */
+    popen2_helper_start();
 
-    trueorabort(display[0] == ':', "Invalid display: '%s'", display);
+    for (; optind < argc; optind++) {
+        struct xdisplay* d = &displays[ndisplays++];
+        char* display = argv[optind];
 
-    char* endptr;
-    int displaynum = (int)strtol(display+1, &endptr, 10);
-    trueorabort(display+1 != endptr && (*endptr == '\0' || *endptr == '.'),
-                "Invalid display number: '%s'", display);
+        trueorabort(display[0] == ':', "Invalid display: '%s'", display);
 
-    init_display(display);
-    socket_server_init(PORT_BASE + displaynum);
+        char* endptr;
+        int displaynum = (int)strtol(display+1, &endptr, 10);
+        trueorabort(display+1 != endptr &&
+                        (*endptr == '\0' || *endptr == '.'),
+                    "Invalid display number: '%s'", display);
+
+        d->name = display;
+        d->uinput_keyboard_fd = -1;
+        d->uinput_pointer_fd = -1;
+        d->uinput_touch_fd = -1;
+        d->touch_emulated_slot = -1;
+
+        if (init_display(d) < 0)
+            return 1;
+
+        if (input_backend != INPUT_XTEST) {
+            if (uinput_init(d) == 0) {
+                log(1, "%s: using uinput input backend.", display);
+            } else if (input_backend == INPUT_UINPUT) {
+                error("%s: cannot use uinput input backend.", display);
+                return 1;
+            } else {
+                log(1, "%s: uinput not available, using XTest input backend.",
+                    display);
+            }
+        }
 
-    unsigned char buffer[BUFFERSIZE];
-    int length;
+        d->server = socket_server_init(PORT_BASE + displaynum, MAX_VIEWERS);
+        d->server->data = d;
+        /* Only cursor images are large enough to be compressed. The client
+         * caches them, so they rarely repeat: do not keep a compression
+         * context per viewer. */
+        d->server->deflate_takeover = 0;
+        set_connected(d->dpy, False);
+    }
+
+    metrics_init(metrics);
+    outq_policy = outq_policy_fbserver;
+    client_cleanup = client_free;
+
+    /* Poll array: server sockets (one per display, -1 once the display is
+     * lost), followed by the client sockets. */
+    struct pollfd fds[MAX_DISPLAYS+WS_MAXCLIENTS];
+
+    /* Once all the displays are set up: failing to do so is fatal. */
+    XSetIOErrorHandler(io_error_handler);
 
     while (1) {
-        set_connected(dpy, False);
-        socket_server_accept(VERSION);
-        write_init();
-        set_connected(dpy, True);
-        while (1) {
-            length = socket_client_read_frame((char*)buffer, sizeof(buffer));
-            if (length < 0) {
-                socket_client_close(1);
-                break;
-            }
+        int i, n;
 
-            if (length < 1) {
-                error("Invalid packet from client (size <1).");
-                socket_client_close(0);
-                break;
-            }
+        if (sigsetjmp(io_error_jmp, 1)) {
+            display_lost(io_error_dpy);
+            continue;
+        }
 
-            switch (buffer[0]) {
-            case 'S':  /* Screen */
-                if (!check_size(length, sizeof(struct screen), "screen"))
-                    break;
-                write_image((struct screen*)buffer);
-                break;
-            case 'P':  /* Cursor */
-                if (!check_size(length, sizeof(struct cursor), "cursor"))
-                    break;
-                write_cursor();
-                break;
-            case 'R':  /* Resolution */
-                if (!check_size(length, sizeof(struct resolution),
-                                "resolution"))
-                    break;
-                change_resolution((struct resolution*)buffer);
-                break;
-            case 'K': {  /* Key */
-                if (!check_size(length, sizeof(struct key), "key"))
-                    break;
-                struct key* k = (struct key*)buffer;
-                log(2, "Key: kc=%04x\n", k->keycode);
-                XTestFakeKeyEvent(dpy, k->keycode, k->down, CurrentTime);
-                if (k->down) {
-                    kb_add(KEYBOARD, k->keycode);
-                } else {
-                    kb_remove(KEYBOARD, k->keycode);
-                }
-                break;
+        socket_server_reap();
+        for (i = 0; i < ndisplays; i++) {
+            struct xdisplay* d = &displays[i];
+            int connected = socket_server_nclients(d->server) > 0;
+            if (d->dpy && d->connected != connected) {
+                d->connected = connected;
+                set_connected(d->dpy, connected);
             }
-            case 'C': {  /* Click */
-                if (!check_size(length, sizeof(struct mouseclick),
-                                "mouseclick"))
-                    break;
-                struct mouseclick* mc = (struct mouseclick*)buffer;
-                XTestFakeButtonEvent(dpy, mc->button, mc->down, CurrentTime);
-                if (mc->down) {
-                    kb_add(MOUSE, mc->button);
-                } else {
-                    kb_remove(MOUSE, mc->button);
-                }
-                break;
-            }
-            case 'M': {  /* Mouse move */
-                if (!check_size(length, sizeof(struct mousemove), "mousemove"))
-                    break;
-                struct mousemove* mm = (struct mousemove*)buffer;
-                XTestFakeMotionEvent(dpy, 0, mm->x, mm->y, CurrentTime);
-                break;
+        }
+
+        int timeout = mailbox_wait_timeout();
+
+        /* Replies to a batch of requests are coalesced: send them once
+         * all the requests that were read together are handled. */
+        for (i = 0; i < nclients; i++) {
+            if (socket_client_pending(clients[i]) > 0)
+                timeout = 0;
+            else
+                socket_client_cork(clients[i], 0);
+        }
+
+        for (i = 0; i < ndisplays; i++) {
+            fds[i].fd = displays[i].server->fd;
+            fds[i].events = POLLIN;
+        }
+        int nfds = ndisplays + socket_server_pollfds(fds + ndisplays);
+
+        n = poll(fds, nfds, timeout);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            syserror("poll error.");
+            return 1;
+        }
+
+        for (i = 0; i < nfds-ndisplays; i++) {
+            struct ws_client* c = clients[i];
+            short revents = fds[ndisplays+i].revents;
+
+            if (revents & POLLOUT)
+                socket_client_flush(c);
+            /* Errors and hang ups are reported by the read. */
+            if (c->fd >= 0 && ((revents & ~POLLOUT) ||
+                               socket_client_pending(c) > 0)) {
+                handle_request(c);
+                if (socket_client_pending(c) > 0)
+                    socket_client_cork(c, 1);
             }
-            case 'Q':  /* "Quit": release all keys */
-                kb_release_all();
-                break;
-            default:
-                error("Invalid packet from client (%d).", buffer[0]);
-                socket_client_close(0);
+        }
+
+        /* Accepting may free closed clients: do it last. */
+        for (i = 0; i < ndisplays; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            struct ws_client* c = socket_server_accept(displays[i].server,
+                                                       VERSION);
+            if (c) {
+                client_init(c);
+                write_init(c);
             }
         }
-        socket_client_close(0);
-        kb_release_all();
-        close_mmap(&cache[0]);
-        close_mmap(&cache[1]);
     }
 
     return 0;
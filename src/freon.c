@@ -9,6 +9,7 @@
  */
 
 #define _GNU_SOURCE
+#include "dbus.h"
 #include <dlfcn.h>
 #include <stdio.h>
 #include <sys/file.h>
@@ -24,9 +25,7 @@
 #define LOCK_FILE_DIR "/tmp/crouton-lock"
 #define DISPLAY_LOCK_FILE LOCK_FILE_DIR "/display"
 #define FREON_DBUS_METHOD_CALL(function) \
-    system("host-dbus dbus-send --system --dest=org.chromium.LibCrosService " \
-           "--type=method_call --print-reply /org/chromium/LibCrosService " \
-           "org.chromium.LibCrosServiceInterface." #function)
+    freon_dbus_method_call(#function)
 
 #define TRACE(...) /* fprintf(stderr, __VA_ARGS__) */
 #define ERROR(...) fprintf(stderr, __VA_ARGS__)
@@ -35,6 +34,8 @@ static int tty0fd = -1;
 static int tty7fd = -1;
 static int lockfd = -1;
 
+static struct dbus_connection dbus = { -1, 0 };
+
 static int (*orig_ioctl)(int d, int request, void* data);
 static int (*orig_open)(const char *pathname, int flags, mode_t mode);
 static int (*orig_close)(int fd);
@@ -45,6 +46,39 @@ static void preload_init() {
     orig_close = dlsym(RTLD_NEXT, "close");
 }
 
+/* Calls a LibCrosService method, and waits for the reply, over a connection
+ * to the system bus that is kept open (Xorg is blocked in the meantime).
+ * Reconnects once if the connection was lost.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+static int freon_dbus_method_call(const char* function) {
+    int retry;
+
+    for (retry = 0; retry < 2; retry++) {
+        if (dbus.fd < 0 && dbus_connect(&dbus) < 0) {
+            ERROR("Unable to connect to the system bus.\n");
+            return -1;
+        }
+        /* Discard anything received since the last call. */
+        if (dbus_drain(&dbus) == 0) {
+            uint32_t serial = dbus_send_call(&dbus,
+                    "org.chromium.LibCrosService",
+                    "/org/chromium/LibCrosService",
+                    "org.chromium.LibCrosServiceInterface", function, 0);
+            if (serial && dbus_wait_reply(&dbus, serial) == 0)
+                return 0;
+            if (errno == EREMOTEIO) {
+                ERROR("%s failed.\n", function);
+                return -1;
+            }
+        }
+        dbus_close(&dbus);
+    }
+    ERROR("Unable to call %s.\n", function);
+    return -1;
+}
+
 /* Grabs the system-wide lockfile that arbitrates which chroot is using the GPU.
  *
  * pid should be either the pid of the process that owns the GPU (eg. getpid()),
@@ -0,0 +1,199 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Monitors keyboard events for the crouton switch command (croutontriggerd):
+ * Ctrl+Alt+Shift+F1 (previous) and Ctrl+Alt+Shift+F2 (next) run croutoncycle
+ * once all the keys are released.
+ *
+ * All the /dev/input/event* devices are opened and polled. /dev/input is
+ * watched with inotify, so that new devices are picked up immediately.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/inotify.h>
+
+#define INPUTDIR "/dev/input"
+#define CROUTONCYCLE "/usr/local/bin/croutoncycle"
+#define MAXDEVICES 64
+
+/* Event devices: fds[0] is the inotify fd, then one entry per device. */
+static struct pollfd fds[1+MAXDEVICES];
+static int devices[MAXDEVICES];  /* eventN number, -1 if the slot is free */
+
+/* Key states (0: up, 1: down, 2: autorepeat) */
+static int lc, ls, la, rc, rs, ra, p, n;
+static char cmd = '\0';
+
+/* Run croutoncycle in the background. */
+static void cycle(char arg) {
+    char param[2] = { arg, '\0' };
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+    } else if (pid == 0) {
+        execl(CROUTONCYCLE, CROUTONCYCLE, param, (char*)NULL);
+        perror("Cannot run " CROUTONCYCLE);
+        _exit(127);
+    }
+}
+
+/* Same state machine as the original awk script: the command is armed when
+ * all modifiers and F1/F2 are down, and runs when everything is released. */
+static void update() {
+    int c = lc || rc, s = ls || rs, a = la || ra;
+
+    if (!cmd && c && s && a && p) {
+        cmd = 'p';
+    } else if (!cmd && c && s && a && n) {
+        cmd = 'n';
+    } else if (cmd && !c && !s && !a && !p && !n) {
+        cycle(cmd);
+        cmd = '\0';
+    }
+}
+
+static void handle_event(struct input_event* ev) {
+    if (ev->type != EV_KEY)
+        return;
+
+    switch (ev->code) {
+    case KEY_LEFTCTRL: lc = ev->value; break;
+    case KEY_LEFTSHIFT: ls = ev->value; break;
+    case KEY_LEFTALT: la = ev->value; break;
+    case KEY_RIGHTCTRL: rc = ev->value; break;
+    case KEY_RIGHTSHIFT: rs = ev->value; break;
+    case KEY_RIGHTALT: ra = ev->value; break;
+    case KEY_F1: p = ev->value; break;
+    case KEY_F2: n = ev->value; break;
+    default: return;
+    }
+    update();
+}
+
+/* Open the event device with the given file name, if it is not open yet. */
+static void device_open(const char* name) {
+    char path[64];
+    int num, i, slot = -1;
+    char c;
+
+    if (sscanf(name, "event%d%c", &num, &c) != 1)
+        return;
+
+    for (i = 0; i < MAXDEVICES; i++) {
+        if (devices[i] == num)
+            return;
+        if (devices[i] < 0 && slot < 0)
+            slot = i;
+    }
+    if (slot < 0) {
+        fprintf(stderr, "Too many input devices.\n");
+        return;
+    }
+
+    snprintf(path, sizeof(path), INPUTDIR "/%s", name);
+    fds[1+slot].fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    /* Permissions may not be set yet: retried on IN_ATTRIB. */
+    if (fds[1+slot].fd < 0)
+        return;
+    devices[slot] = num;
+}
+
+static void device_close(int slot) {
+    close(fds[1+slot].fd);
+    fds[1+slot].fd = -1;
+    devices[slot] = -1;
+}
+
+/* Read the events of a device. */
+static void device_read(int slot) {
+    struct input_event events[64];
+    int len, i;
+
+    while ((len = read(fds[1+slot].fd, events, sizeof(events))) > 0) {
+        for (i = 0; i < len / (int)sizeof(events[0]); i++)
+            handle_event(&events[i]);
+    }
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+        device_close(slot);
+}
+
+/* Handle inotify events on the input directory. */
+static void inotify_read() {
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    int len;
+
+    while ((len = read(fds[0].fd, buffer, sizeof(buffer))) > 0) {
+        char* ptr = buffer;
+        while (ptr < buffer + len) {
+            struct inotify_event* ev = (struct inotify_event*)ptr;
+            /* Removed devices are closed when read fails. */
+            if (ev->len > 0 && (ev->mask & (IN_CREATE | IN_ATTRIB)))
+                device_open(ev->name);
+            ptr += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    DIR* dir;
+    struct dirent* ent;
+    int i;
+
+    /* Do not wait for croutoncycle. */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (i = 0; i < MAXDEVICES; i++) {
+        devices[i] = -1;
+        fds[1+i].fd = -1;
+    }
+    for (i = 0; i < 1+MAXDEVICES; i++)
+        fds[i].events = POLLIN;
+
+    fds[0].fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fds[0].fd < 0 ||
+            inotify_add_watch(fds[0].fd, INPUTDIR, IN_CREATE | IN_ATTRIB) < 0) {
+        perror("Cannot watch " INPUTDIR);
+        return 1;
+    }
+
+    dir = opendir(INPUTDIR);
+    if (!dir) {
+        perror("Cannot open " INPUTDIR);
+        return 1;
+    }
+    while ((ent = readdir(dir)))
+        device_open(ent->d_name);
+    closedir(dir);
+
+    while (1) {
+        /* Wait for events */
+        int ret = poll(fds, 1+MAXDEVICES, -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[0].revents)
+            inotify_read();
+        for (i = 0; i < MAXDEVICES; i++) {
+            if (fds[1+i].fd >= 0 && fds[1+i].revents)
+                device_read(i);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,804 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Live inventory of the X11 displays, and of the top-level windows of the
+ * Chromium OS X11 server (:0), used to answer croutoncycle queries (list,
+ * current display, display/window lists) from memory.
+ *
+ * Displays are discovered with inotify on /tmp (X11 lock files). The
+ * inventory is kept up to date with X events: root window property changes
+ * on the chroot displays, and SubstructureNotify (stacking order, map state)
+ * plus window name changes on :0.
+ *
+ * The output follows croutoncycle exactly, quirks included: see the script
+ * for the meaning of each variable.
+ *
+ * Must be included after websocket.h.
+ */
+
+#ifndef INVENTORY_H_
+#define INVENTORY_H_
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+#define INV_MAXDISPLAYS 16
+#define INV_MAXWINDOWS 256
+#define INV_MAXPOLLFDS (1+INV_MAXDISPLAYS)  /* inotify, then displays */
+
+#define INV_HOST_XAUTHORITY "/var/host/Xauthority"  /* See host-x11 */
+#define INV_TTY_ACTIVE "/sys/class/tty/tty0/active"
+#define INV_KIWI_DISPLAY "/tmp/crouton-ext/kiwi-display"
+#define INV_LSB_RELEASE "/var/host/lsb-release"
+#define INV_CLIP_PID "/tmp/crouton-lock/clip"
+#define INV_AURA "aura_root_0"
+
+enum {
+    INV_ATOM_VT, INV_ATOM_XMETHOD, INV_ATOM_NAME, INV_NATOMS
+};
+
+static char* inv_atom_names[INV_NATOMS] = {
+    "XFree86_VT", "CROUTON_XMETHOD", "CROUTON_NAME"
+};
+
+/* Top-level window of :0 */
+struct inv_window {
+    Window id;
+    int mapped;
+    char name[128];
+};
+
+struct inv_display {
+    int num;  /* Display number, -1 if the slot is free */
+    Display* dpy;  /* NULL if not connected (yet) */
+    Atom atoms[INV_NATOMS];
+    int vt;  /* XFree86_VT, 0 if none */
+    int xiwi;  /* CROUTON_XMETHOD is xiwi */
+    char name[128];  /* CROUTON_NAME */
+};
+
+static struct inv_display inv_displays[INV_MAXDISPLAYS];
+
+/* Top-level windows of :0, bottom to top (XQueryTree order) */
+static struct inv_window inv_windows[INV_MAXWINDOWS];
+static int inv_nwindows = 0;
+
+static int inv_ready = 0;
+static int inv_inotify_fd = -1;
+static char inv_release[64] = "Unknown";
+
+/* Entry points jump back to their INV_GUARD when a display connection is
+ * lost (Xlib exits if the I/O error handler returns). */
+static sigjmp_buf inv_jmp;
+static Display* inv_lost_dpy = NULL;
+
+static void inv_display_lost(Display* dpy);
+
+#define INV_GUARD(fail) do { \
+    if (sigsetjmp(inv_jmp, 1)) { \
+        inv_display_lost(inv_lost_dpy); \
+        fail; \
+    } \
+} while (0)
+
+static int inv_io_error_handler(Display* dpy) {
+    inv_lost_dpy = dpy;
+    siglongjmp(inv_jmp, 1);
+}
+
+/* Windows come and go: ignore errors about them. */
+static int inv_error_handler(Display* dpy, XErrorEvent* e) {
+    log(3, "X11 error %d (request %d)", e->error_code, e->request_code);
+    return 0;
+}
+
+static struct inv_display* inv_display_find(int num) {
+    int i;
+
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        if (inv_displays[i].num == num && num >= 0)
+            return &inv_displays[i];
+    }
+    return NULL;
+}
+
+/**/
+/* Windows of :0 */
+/**/
+
+static int inv_window_find(Window id) {
+    int i;
+
+    for (i = 0; i < inv_nwindows; i++) {
+        if (inv_windows[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+static void inv_window_fetch_name(Display* dpy, struct inv_window* w) {
+    char* name = NULL;
+
+    if (XFetchName(dpy, w->id, &name) && name) {
+        snprintf(w->name, sizeof(w->name), "%s", name);
+        XFree(name);
+    } else {
+        strcpy(w->name, "Unknown");
+    }
+}
+
+static void inv_window_remove(int i) {
+    inv_nwindows--;
+    memmove(&inv_windows[i], &inv_windows[i+1],
+            (inv_nwindows-i)*sizeof(inv_windows[0]));
+}
+
+/* Move window i right above window below (-1: to the bottom). */
+static void inv_window_restack(int i, int below) {
+    struct inv_window w = inv_windows[i];
+
+    /* Already in place (the events may be out of sync with the array). */
+    if (below == i || below == i-1)
+        return;
+
+    inv_window_remove(i);
+    if (below > i)
+        below--;
+    memmove(&inv_windows[below+2], &inv_windows[below+1],
+            (inv_nwindows-below-1)*sizeof(inv_windows[0]));
+    inv_windows[below+1] = w;
+    inv_nwindows++;
+}
+
+/* Add a window on top of the stack. */
+static void inv_window_add(Display* dpy, Window id) {
+    XWindowAttributes attr;
+    struct inv_window* w;
+
+    if (inv_window_find(id) >= 0)
+        return;
+    if (inv_nwindows >= INV_MAXWINDOWS) {
+        error("Too many windows.");
+        return;
+    }
+
+    w = &inv_windows[inv_nwindows++];
+    w->id = id;
+    w->mapped = XGetWindowAttributes(dpy, id, &attr) &&
+                attr.map_state == IsViewable;
+    XSelectInput(dpy, id, PropertyChangeMask);
+    inv_window_fetch_name(dpy, w);
+}
+
+/* Update the window list from a :0 event. */
+static void inv_host_event(struct inv_display* d, XEvent* ev) {
+    Window root = DefaultRootWindow(d->dpy);
+    int i;
+
+    switch (ev->type) {
+    case CreateNotify:
+        if (ev->xcreatewindow.parent == root)
+            inv_window_add(d->dpy, ev->xcreatewindow.window);
+        break;
+    case DestroyNotify:
+        if ((i = inv_window_find(ev->xdestroywindow.window)) >= 0)
+            inv_window_remove(i);
+        break;
+    case ReparentNotify:
+        i = inv_window_find(ev->xreparent.window);
+        if (ev->xreparent.parent == root)
+            inv_window_add(d->dpy, ev->xreparent.window);
+        else if (i >= 0)
+            inv_window_remove(i);
+        break;
+    case MapNotify:
+        if ((i = inv_window_find(ev->xmap.window)) >= 0)
+            inv_windows[i].mapped = 1;
+        break;
+    case UnmapNotify:
+        if ((i = inv_window_find(ev->xunmap.window)) >= 0)
+            inv_windows[i].mapped = 0;
+        break;
+    case ConfigureNotify:
+        /* above is the sibling right below the window (None: bottom). */
+        if ((i = inv_window_find(ev->xconfigure.window)) >= 0)
+            inv_window_restack(i, ev->xconfigure.above == None ? -1 :
+                               inv_window_find(ev->xconfigure.above));
+        break;
+    case CirculateNotify:
+        if ((i = inv_window_find(ev->xcirculate.window)) >= 0)
+            inv_window_restack(i, ev->xcirculate.place == PlaceOnTop ?
+                                  inv_nwindows-1 : -1);
+        break;
+    case PropertyNotify:
+        if (ev->xproperty.atom == XA_WM_NAME &&
+                (i = inv_window_find(ev->xproperty.window)) >= 0)
+            inv_window_fetch_name(d->dpy, &inv_windows[i]);
+        break;
+    }
+}
+
+/**/
+/* Displays */
+/**/
+
+/* Refresh the croutoncycle-related root window properties of d. */
+static void inv_display_properties(struct inv_display* d) {
+    Window root = DefaultRootWindow(d->dpy);
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data = NULL;
+
+    d->vt = 0;
+    if (XGetWindowProperty(d->dpy, root, d->atoms[INV_ATOM_VT], 0, 1, False,
+                           XA_INTEGER, &type, &format, &nitems, &after,
+                           &data) == Success &&
+            type == XA_INTEGER && format == 32 && nitems == 1)
+        d->vt = *(long*)data;
+    if (data)
+        XFree(data);
+
+    d->xiwi = 0;
+    data = NULL;
+    if (XGetWindowProperty(d->dpy, root, d->atoms[INV_ATOM_XMETHOD], 0, 16,
+                           False, XA_STRING, &type, &format, &nitems, &after,
+                           &data) == Success &&
+            type == XA_STRING && format == 8)
+        d->xiwi = nitems == 4 && !memcmp(data, "xiwi", 4);
+    if (data)
+        XFree(data);
+
+    /* Like xprop, accept any string type. */
+    strcpy(d->name, "Unknown");
+    data = NULL;
+    if (XGetWindowProperty(d->dpy, root, d->atoms[INV_ATOM_NAME], 0, 32,
+                           False, AnyPropertyType, &type, &format, &nitems,
+                           &after, &data) == Success &&
+            format == 8 && nitems > 0)
+        snprintf(d->name, sizeof(d->name), "%.*s", (int)nitems, data);
+    if (data)
+        XFree(data);
+}
+
+/* Connect to a known display. Returns 0 on success. */
+static int inv_display_connect(struct inv_display* d) {
+    char name[16];
+    char* xauth = NULL;
+
+    snprintf(name, sizeof(name), ":%d", d->num);
+
+    /* :0 is the Chromium OS X11 server, with its own authority file. */
+    if (d->num == 0) {
+        if (getenv("XAUTHORITY"))
+            xauth = strdup(getenv("XAUTHORITY"));
+        setenv("XAUTHORITY", INV_HOST_XAUTHORITY, 1);
+    }
+    d->dpy = XOpenDisplay(name);
+    if (d->num == 0) {
+        if (xauth)
+            setenv("XAUTHORITY", xauth, 1);
+        else
+            unsetenv("XAUTHORITY");
+        free(xauth);
+    }
+
+    if (!d->dpy) {
+        log(2, "Cannot open display %s.", name);
+        return -1;
+    }
+
+    log(1, "Connected to display %s.", name);
+    fcntl(ConnectionNumber(d->dpy), F_SETFD, FD_CLOEXEC);
+    XInternAtoms(d->dpy, inv_atom_names, INV_NATOMS, False, d->atoms);
+
+    Window root = DefaultRootWindow(d->dpy);
+
+    if (d->num == 0) {
+        Window parent, *children;
+        unsigned int nchildren, i;
+
+        /* Select events first, so that no window is missed. */
+        XSelectInput(d->dpy, root, SubstructureNotifyMask);
+        inv_nwindows = 0;
+        if (XQueryTree(d->dpy, root, &root, &parent,
+                       &children, &nchildren)) {
+            for (i = 0; i < nchildren; i++)
+                inv_window_add(d->dpy, children[i]);
+            XFree(children);
+        }
+    } else {
+        XSelectInput(d->dpy, root, PropertyChangeMask);
+    }
+
+    inv_display_properties(d);
+    XFlush(d->dpy);
+    return 0;
+}
+
+/* Forget about the connection to a display. The Display structure is
+ * leaked, as XCloseDisplay would hit the same error. */
+static void inv_display_lost(Display* dpy) {
+    char lock[32];
+    int i;
+
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+        if (d->num >= 0 && d->dpy == dpy) {
+            log(1, "Lost display :%d.", d->num);
+            close(ConnectionNumber(dpy));
+            if (d->num == 0)
+                inv_nwindows = 0;
+            d->dpy = NULL;
+            /* The server is gone for good if it removed its lock file. */
+            snprintf(lock, sizeof(lock), "/tmp/.X%d-lock", d->num);
+            if (access(lock, F_OK) < 0)
+                d->num = -1;
+        }
+    }
+}
+
+/* A lock file appeared (add=1) or disappeared (add=0). */
+static void inv_display_lock(const char* filename, int add) {
+    struct inv_display* d;
+    int num, i;
+    char c;
+
+    if (sscanf(filename, ".X%d-lock%c", &num, &c) != 1 || num < 0)
+        return;
+
+    d = inv_display_find(num);
+    if (add && !d) {
+        for (i = 0; i < INV_MAXDISPLAYS && !d; i++) {
+            if (inv_displays[i].num < 0)
+                d = &inv_displays[i];
+        }
+        if (!d) {
+            error("Too many displays.");
+            return;
+        }
+        d->num = num;
+        d->dpy = NULL;
+    } else if (!add && d) {
+        /* A live connection hangs up by itself. */
+        if (!d->dpy)
+            d->num = -1;
+    }
+}
+
+/* Connect to the known displays that are not connected yet (the lock file
+ * appears before the server listens). */
+static void inv_connect_all() {
+    int i;
+
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+        if (d->num >= 0 && !d->dpy)
+            inv_display_connect(d);
+    }
+}
+
+/**/
+/* Entry points */
+/**/
+
+/* Start watching /tmp, and list the existing displays. Returns 0 on
+ * success. */
+static int inventory_init() {
+    DIR* dir;
+    struct dirent* ent;
+    FILE* f;
+    char line[128];
+    int i;
+
+    for (i = 0; i < INV_MAXDISPLAYS; i++)
+        inv_displays[i].num = -1;
+
+    XSetErrorHandler(inv_error_handler);
+    XSetIOErrorHandler(inv_io_error_handler);
+
+    inv_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inv_inotify_fd < 0 ||
+            inotify_add_watch(inv_inotify_fd, "/tmp",
+                              IN_CREATE | IN_DELETE |
+                              IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+        syserror("Cannot watch /tmp.");
+        return -1;
+    }
+
+    dir = opendir("/tmp");
+    if (dir) {
+        while ((ent = readdir(dir)))
+            inv_display_lock(ent->d_name, 1);
+        closedir(dir);
+    }
+
+    /* Chromium OS release name, for the list. */
+    f = fopen(INV_LSB_RELEASE, "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            char* value = strstr(line, "_RELEASE_NAME=");
+            if (value) {
+                value += strlen("_RELEASE_NAME=");
+                value[strcspn(value, "\n")] = '\0';
+                snprintf(inv_release, sizeof(inv_release), "%s", value);
+            }
+        }
+        fclose(f);
+    }
+
+    inv_ready = 1;
+    INV_GUARD(return 0);
+    inv_connect_all();
+    return 0;
+}
+
+/* Handle the events of a display, including those that Xlib already read
+ * into its queue. */
+static void inv_display_events(struct inv_display* d) {
+    XEvent ev;
+
+    while (XPending(d->dpy)) {
+        XNextEvent(d->dpy, &ev);
+        if (d->num == 0)
+            inv_host_event(d, &ev);
+        else if (ev.type == PropertyNotify)
+            inv_display_properties(d);
+    }
+}
+
+/* Fills fds with the inotify and display sockets (INV_MAXPOLLFDS entries,
+ * unused ones have fd -1). Returns INV_MAXPOLLFDS. */
+static int inventory_pollfds(struct pollfd* fds) {
+    int i;
+
+    /* Round trips (connecting, answering queries) may have pulled events
+     * into Xlib's queue, which poll does not see: handle them first. A lost
+     * display is dropped, and the others are still drained. */
+    INV_GUARD();
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+        if (d->num >= 0 && d->dpy)
+            inv_display_events(d);
+    }
+
+    fds[0].fd = inv_inotify_fd;
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+        fds[1+i].fd = d->num >= 0 && d->dpy ? ConnectionNumber(d->dpy) : -1;
+    }
+    for (i = 0; i < INV_MAXPOLLFDS; i++) {
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    return INV_MAXPOLLFDS;
+}
+
+/* Handle the events reported in fds (see inventory_pollfds). Returns the
+ * number of fds that had events. */
+static int inventory_handle(struct pollfd* fds) {
+    int i, n = 0;
+
+    for (i = 0; i < INV_MAXPOLLFDS; i++) {
+        if (fds[i].revents)
+            n++;
+    }
+    if (n == 0)
+        return 0;
+
+    INV_GUARD(return n);
+
+    if (fds[0].revents) {
+        char buffer[4096]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        int len;
+
+        while ((len = read(inv_inotify_fd, buffer, sizeof(buffer))) > 0) {
+            char* p = buffer;
+            while (p < buffer + len) {
+                struct inotify_event* ev = (struct inotify_event*)p;
+                if (ev->len > 0)
+                    inv_display_lock(ev->name,
+                                     ev->mask & (IN_CREATE | IN_MOVED_TO));
+                p += sizeof(*ev) + ev->len;
+            }
+        }
+    }
+
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+
+        if (fds[1+i].revents && d->num >= 0 && d->dpy)
+            inv_display_events(d);
+    }
+
+    for (i = 0; i < INV_MAXPOLLFDS; i++)
+        fds[i].revents = 0;
+    return n;
+}
+
+/* croutoncycle variables (see the script) */
+struct inv_vars {
+    char tty[32];
+    int noaurax;
+    int xiwiactive;
+    char aurawin[32];
+    char winlist[INV_MAXWINDOWS*12];
+    char displist[INV_MAXDISPLAYS*8];
+    char curdisp[32];
+    /* Mapped windows of :0, in winlist order, and the starred one */
+    struct inv_window* windows[INV_MAXWINDOWS];
+    int nwindows;
+    Window top;
+};
+
+/* Compare two mapped windows like sort does on "name id[*]" lines. */
+static Window inv_sort_top;
+
+static int inv_window_compare(const void* a, const void* b) {
+    const struct inv_window* wa = *(struct inv_window* const*)a;
+    const struct inv_window* wb = *(struct inv_window* const*)b;
+    char la[160], lb[160];
+
+    snprintf(la, sizeof(la), "%s 0x%x%s", wa->name, (unsigned int)wa->id,
+             wa->id == inv_sort_top ? "*" : "");
+    snprintf(lb, sizeof(lb), "%s 0x%x%s", wb->name, (unsigned int)wb->id,
+             wb->id == inv_sort_top ? "*" : "");
+    return strcmp(la, lb);
+}
+
+/* Compare two display numbers like the /tmp/.X*-lock glob does. */
+static int inv_display_compare(const void* a, const void* b) {
+    char la[16], lb[16];
+
+    snprintf(la, sizeof(la), "%d-lock", *(const int*)a);
+    snprintf(lb, sizeof(lb), "%d-lock", *(const int*)b);
+    return strcmp(la, lb);
+}
+
+/* Read the first line of a small file into buffer. Returns 0 on success. */
+/* Returns 1 if disp is a display name of the form :<number>. The kiwi
+ * display ends up in croutoncycle's eval: nothing else may get through. */
+static int inv_display_valid(const char* disp) {
+    size_t n;
+
+    if (disp[0] != ':')
+        return 0;
+    n = strspn(disp + 1, "0123456789");
+    return n > 0 && disp[1 + n] == '\0';
+}
+
+static int inv_read_line(const char* path, char* buffer, int size) {
+    int fd, n;
+
+    buffer[0] = '\0';
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = read(fd, buffer, size-1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buffer[n] = '\0';
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+/* Compute the croutoncycle variables into v. Returns 0 on success, -1 if
+ * the Chromium OS X11 server exists but is not connected (yet). */
+static int inv_variables(struct inv_vars* v) {
+    int nums[INV_MAXDISPLAYS];
+    int ndisplays = 0;
+    size_t pos;
+    int i;
+
+    memset(v, 0, sizeof(*v));
+
+    /* Only VT-based and xiwi-based chroots (that excludes Xephyr) */
+    for (i = 0; i < INV_MAXDISPLAYS; i++) {
+        struct inv_display* d = &inv_displays[i];
+        if (d->num <= 0 || !d->dpy)
+            continue;
+        if (d->vt > 0) {
+            nums[ndisplays++] = d->num;
+        } else if (d->xiwi) {
+            nums[ndisplays++] = d->num;
+            v->xiwiactive = 1;
+        }
+    }
+    qsort(nums, ndisplays, sizeof(nums[0]), inv_display_compare);
+    for (i = 0, pos = 0; i < ndisplays; i++) {
+        pos += snprintf(v->displist + pos, sizeof(v->displist) - pos,
+                        " :%d", nums[i]);
+    }
+
+    if (inv_read_line(INV_TTY_ACTIVE, v->tty, sizeof(v->tty)) < 0) {
+        /* No X11 server */
+        v->noaurax = 1;
+        strcpy(v->winlist, "aura*");
+        strcpy(v->aurawin, "aura");
+        strcpy(v->tty, "tty1");
+        strcpy(v->curdisp, "aura*");
+    } else {
+        struct inv_display* host = inv_display_find(0);
+        if (!host || !host->dpy)
+            return -1;
+
+        /* croutonwmtools lists the windows top to bottom. */
+        for (i = inv_nwindows-1; i >= 0; i--) {
+            struct inv_window* w = &inv_windows[i];
+            if (!w->mapped)
+                continue;
+            if (v->nwindows == 0)
+                v->top = w->id;
+            if (!v->aurawin[0] && !strcmp(w->name, INV_AURA))
+                snprintf(v->aurawin, sizeof(v->aurawin), "0x%x",
+                         (unsigned int)w->id);
+            v->windows[v->nwindows++] = w;
+        }
+        inv_sort_top = v->top;
+        qsort(v->windows, v->nwindows, sizeof(v->windows[0]),
+              inv_window_compare);
+        for (i = 0, pos = 0; i < v->nwindows; i++) {
+            Window id = v->windows[i]->id;
+            pos += snprintf(v->winlist + pos, sizeof(v->winlist) - pos,
+                            "0x%x%s ", (unsigned int)id,
+                            id == v->top ? "*" : "");
+        }
+        if (v->nwindows > 0 && !strcmp(v->tty, "tty1"))
+            snprintf(v->curdisp, sizeof(v->curdisp), "0x%x*",
+                     (unsigned int)v->top);
+    }
+
+    if (!strcmp(v->tty, "tty1")) {
+        char kiwi[16];
+        int len = strlen(v->aurawin);
+
+        /* The active window is starred: check for a kiwi window. */
+        if (v->xiwiactive && v->curdisp[0] &&
+                !strncmp(v->curdisp, v->aurawin, len) &&
+                !strcmp(v->curdisp + len, "*") &&
+                !inv_read_line(INV_KIWI_DISPLAY, kiwi, sizeof(kiwi)) &&
+                inv_display_valid(kiwi))
+            snprintf(v->curdisp, sizeof(v->curdisp), "%s", kiwi);
+    } else {
+        /* The display that owns this VT */
+        int vt = atoi(v->tty + strlen("tty"));
+        snprintf(v->curdisp, sizeof(v->curdisp), "%s", v->tty);
+        for (i = 0; i < ndisplays; i++) {
+            struct inv_display* d = inv_display_find(nums[i]);
+            if (d->vt == vt) {
+                snprintf(v->curdisp, sizeof(v->curdisp), ":%d", d->num);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Answers a croutoncycle query: cmd is 'l' (list), 'd' (display) or 'i'
+ * (variables, as shell assignments for the script to eval). Writes the
+ * output to out (size bytes). Returns the output length, or -1 if the
+ * inventory cannot answer. */
+static int inventory_query(char cmd, char* out, int size) {
+    struct inv_vars v;
+    int pos = 0;
+    int i;
+
+    if (!inv_ready)
+        return -1;
+
+    INV_GUARD(return -1);
+    inv_connect_all();
+
+    if (inv_variables(&v) < 0)
+        return -1;
+
+    if (cmd == 'i') {
+        pos = snprintf(out, size,
+                       "tty='%s'\nnoaurax='%s'\nxiwiactive='%s'\n"
+                       "aurawin='%s'\nwinlist='%s'\ndisplist='%s'\n"
+                       "curdisp='%s'\n",
+                       v.tty, v.noaurax ? "y" : "", v.xiwiactive ? "y" : "",
+                       v.aurawin, v.winlist, v.displist, v.curdisp);
+        return pos < size ? pos : -1;
+    }
+
+    if (cmd != 'l' && cmd != 'd')
+        return -1;
+
+    /* Windows of :0 (or aura alone without X11 server) */
+    for (i = 0; i < (v.noaurax ? 1 : v.nwindows); i++) {
+        const char* name = v.noaurax ? INV_AURA : v.windows[i]->name;
+        char disp[32];
+        int number = 0;
+        const char* sep;
+
+        if (v.noaurax) {
+            strcpy(disp, "aura*");
+        } else {
+            Window id = v.windows[i]->id;
+            snprintf(disp, sizeof(disp), "0x%x%s", (unsigned int)id,
+                     id == v.top ? "*" : "");
+        }
+
+        if (!strncmp(name, "Xephyr", 6) && (sep = strchr(name, ':')) &&
+                sep[1] >= '0' && sep[1] <= '9') {
+            struct inv_display* d;
+            number = atoi(sep+1);
+            snprintf(disp, sizeof(disp), ":%d", number);
+            d = inv_display_find(number);
+            name = d && d->dpy ? d->name : "Unknown";
+        }
+
+        int active = !strcmp(disp, v.curdisp);
+        if (active && cmd == 'd') {
+            if (!strcmp(name, INV_AURA))
+                return snprintf(out, size, "cros\n");
+            return snprintf(out, size, ":%d\n", number);
+        }
+        if (!strcmp(name, INV_AURA)) {
+            name = inv_release;
+            strcpy(disp, "cros");
+        }
+        if (cmd == 'l' && pos < size) {
+            disp[strcspn(disp, "*")] = '\0';
+            pos += snprintf(out + pos, size - pos, "%s%c %s\n",
+                            disp, active ? '*' : ' ', name);
+        }
+    }
+
+    /* Chroot displays */
+    char* p = v.displist;
+    while (*p == ' ') {
+        struct inv_display* d;
+        char disp[16];
+        int num = atoi(p+2);
+
+        p += 1 + strcspn(p+1, " ");
+        snprintf(disp, sizeof(disp), ":%d", num);
+        int active = !strcmp(disp, v.curdisp);
+        if (active && cmd == 'd')
+            return snprintf(out, size, "%s\n", disp);
+        d = inv_display_find(num);
+        if (cmd == 'l' && pos < size)
+            pos += snprintf(out + pos, size - pos, "%s%c %s\n", disp,
+                            active ? '*' : ' ', d ? d->name : "Unknown");
+    }
+
+    return pos < size ? pos : -1;
+}
+
+/* Record the X11 display of the active kiwi window (croutoncycle s<disp>),
+ * and notify croutonclip. */
+static void inventory_kiwi_display(const char* disp) {
+    char pid[16];
+    int fd;
+
+    if (!inv_display_valid(disp)) {
+        error("Invalid kiwi display.");
+        return;
+    }
+
+    fd = open(INV_KIWI_DISPLAY, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+              0644);
+    if (fd < 0) {
+        syserror("Cannot open %s.", INV_KIWI_DISPLAY);
+        return;
+    }
+    if (write(fd, disp, strlen(disp)) < 0 || write(fd, "\n", 1) < 0)
+        syserror("Cannot write %s.", INV_KIWI_DISPLAY);
+    close(fd);
+
+    if (!inv_read_line(INV_CLIP_PID, pid, sizeof(pid)) && atoi(pid) > 0)
+        kill(atoi(pid), SIGUSR1);
+}
+
+#endif /* INVENTORY_H_ */
@@ -0,0 +1,117 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Protocol of croutonwebsocket's request socket, used by local tools to send
+ * requests to the Chromium OS extension.
+ *
+ * The socket is a sequenced packet socket. Each packet starts with a
+ * request_header, followed by at most REQUEST_MAXDATA bytes of the message.
+ * A message spans several packets if REQUEST_MORE is set in all but the last
+ * one. Several requests may be in flight: replies carry the id of the
+ * request.
+ */
+
+#ifndef REQUEST_H_
+#define REQUEST_H_
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define REQUEST_SOCKET "/tmp/crouton-ext/sock"
+#define REQUEST_TIMEOUT 3000  /* ms, same as websocketcommand */
+#define REQUEST_MAXDATA 4096
+
+struct request_header {
+    uint32_t id;
+    uint32_t flags;
+};
+#define REQUEST_MORE 0x1
+
+/* Send a packet, waiting at most timeout ms for room in the socket buffer
+ * (if fd is non-blocking). Returns 0 on success, -1 on error (errno is EAGAIN
+ * if there was no room in time). */
+static int request_send(int fd, uint32_t id, uint32_t flags,
+                        const char* buffer, int len, int timeout) {
+    struct request_header header = { id, flags };
+    struct iovec iov[2] = {
+        { &header, sizeof(header) }, { (char*)buffer, len }
+    };
+    struct msghdr msg;
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN || timeout == 0)
+            return -1;
+        int n = poll(&pfd, 1, timeout);
+        if (n <= 0) {
+            if (n == 0)
+                errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Receive a packet into header and buffer (REQUEST_MAXDATA bytes).
+ * Returns the payload length, or -1 on error (errno is ECONNRESET on end of
+ * file, EPROTO on invalid packet). */
+static int request_recv(int fd, struct request_header* header,
+                        char* buffer) {
+    struct iovec iov[2] = {
+        { header, sizeof(*header) }, { buffer, REQUEST_MAXDATA }
+    };
+    struct msghdr msg;
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    n = recvmsg(fd, &msg, 0);
+    if (n < (int)sizeof(*header) || (msg.msg_flags & MSG_TRUNC)) {
+        if (n == 0)
+            errno = ECONNRESET;
+        else if (n > 0)
+            errno = EPROTO;
+        return -1;
+    }
+
+    return n - sizeof(*header);
+}
+
+/* Connect to the request socket. Returns the socket, or -1 on error. */
+static int request_connect() {
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, REQUEST_SOCKET, sizeof(addr.sun_path)-1);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+#endif /* REQUEST_H_ */
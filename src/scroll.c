@@ -0,0 +1,199 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Translates scroll valuators of XInput 2 raw motion events into mouse wheel
+ * button clicks on the X11 server specified in DISPLAY (croutonwheel).
+ *
+ * The acceleration model is the one of the original croutonwheel awk script:
+ * on trackpads, each event adds log(|delta|) * scale + constant to an
+ * accumulator, and each whole unit becomes a click. Mouse wheels click once
+ * per event. Translation is disabled while the aura window is visible, as
+ * Chromium OS handles scrolling itself.
+ */
+
+#include "xi2.h"
+#include <X11/extensions/XTest.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAXVALUATORS 16
+/* Valuators 2 and 3 are the scroll axes on mice, 4 and 5 on trackpads (that
+ * have at least 10 valuators). */
+#define TRACKPAD_VALUATORS 10
+
+/* One scroll axis */
+struct axis {
+    double scale, constant;
+    int positive, negative;  /* Buttons */
+    double acc;  /* Accumulated clicks */
+};
+
+/* Returns non-zero if x is a non-zero real number. Deltas are rounded to
+ * 1/100, like the text output of croutonxi2event that the script parsed. */
+static int isnonzero(double x) {
+    return isfinite(x) && round(x * 100) != 0;
+}
+
+static void scroll(Display* display, struct axis* axis, double delta,
+                   int trackpad) {
+    if (!isnonzero(delta))
+        return;
+
+    delta = round(delta * 100) / 100;
+    if (delta > 0) {
+        if (axis->acc < 0)
+            axis->acc = 0;
+        axis->acc += trackpad ? log(delta) * axis->scale + axis->constant : 1;
+    } else {
+        if (axis->acc > 0)
+            axis->acc = 0;
+        axis->acc -= trackpad ? log(-delta) * axis->scale + axis->constant : 1;
+    }
+
+    while (axis->acc >= 1) {
+        XTestFakeButtonEvent(display, axis->positive, True, CurrentTime);
+        XTestFakeButtonEvent(display, axis->positive, False, CurrentTime);
+        axis->acc -= 1;
+    }
+    while (axis->acc <= -1) {
+        XTestFakeButtonEvent(display, axis->negative, True, CurrentTime);
+        XTestFakeButtonEvent(display, axis->negative, False, CurrentTime);
+        axis->acc += 1;
+    }
+}
+
+/* Returns the topmost mapped window whose name contains aura_root, or
+ * None. */
+static Window find_aura(Display* display) {
+    Window parent, root, *children, aura = None;
+    unsigned int nchildren;
+    XWindowAttributes attributes;
+    char* name;
+
+    if (!XQueryTree(display, DefaultRootWindow(display), &root, &parent,
+                    &children, &nchildren) || !children)
+        return None;
+
+    while (nchildren-- && aura == None) {
+        if (!XGetWindowAttributes(display, children[nchildren],
+                                  &attributes) ||
+                attributes.map_state != IsViewable)
+            continue;
+        if (XFetchName(display, children[nchildren], &name) && name) {
+            if (strstr(name, "aura_root"))
+                aura = children[nchildren];
+            XFree(name);
+        }
+    }
+
+    XFree(children);
+    return aura;
+}
+
+static void usage(char* argv0) {
+    fprintf(stderr, "%s [-x] [-r] [-a #.#] [-b #.#] [-c #.#] [-d #.#]\n",
+            argv0);
+    fprintf(stderr, "   Translates scroll events into mouse wheel clicks "
+                    "(see croutonwheel).\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct axis x = { 0.2, 0.01, 7, 6, 0 };
+    struct axis y = { 0.2, 0.05, 4, 5, 0 };
+    int horizontal = 1;
+    int disabled = 0;  /* aura is visible */
+    int xi_opcode, firstev, firsterr, version, minor, c, z;
+    static const int types[] = { XI_RawMotion };
+
+    while ((c = getopt(argc, argv, "a:b:c:d:rx")) != -1) {
+        switch (c) {
+        case 'a': x.scale = atof(optarg); break;
+        case 'b': x.constant = atof(optarg); break;
+        case 'c': y.scale = atof(optarg); break;
+        case 'd': y.constant = atof(optarg); break;
+        case 'r':
+            z = x.positive; x.positive = x.negative; x.negative = z;
+            z = y.positive; y.positive = y.negative; y.negative = z;
+            break;
+        case 'x': horizontal = 0; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    Display* display = XOpenDisplay(NULL);
+
+    if (display == NULL) {
+        fprintf(stderr, "Unable to connect to X server\n");
+        return 1;
+    }
+
+    if (!XTestQueryExtension(display, &firstev, &firsterr,
+                             &version, &minor)) {
+        fprintf(stderr, "XTest extension not available.\n");
+        return 1;
+    }
+
+    xi_opcode = xi2_select(display, XIAllMasterDevices, types, 1);
+    if (xi_opcode < 0)
+        return 1;
+
+    /* Follow the visibility of aura. */
+    Window aura = find_aura(display);
+    if (aura != None)
+        XSelectInput(display, aura, VisibilityChangeMask);
+
+    XEvent event;
+    XGenericEventCookie *cookie = &event.xcookie;
+
+    while (1) {
+        XNextEvent(display, &event);
+
+        if (event.type == VisibilityNotify) {
+            if (event.xvisibility.state == VisibilityUnobscured) {
+                disabled = 1;
+                x.acc = y.acc = 0;
+            } else if (event.xvisibility.state == VisibilityFullyObscured) {
+                disabled = 0;
+            }
+            continue;
+        }
+
+        if (!XGetEventData(display, cookie))
+            continue;
+
+        if (!disabled && xi2_is_raw(cookie, xi_opcode) &&
+                cookie->evtype == XI_RawMotion) {
+            XIRawEvent* raw = cookie->data;
+            double values[MAXVALUATORS];
+            double* val = raw->valuators.values;
+            int i, lasti = -1;
+
+            /* Unset valuators are NAN. */
+            for (i = 0; i < MAXVALUATORS; i++)
+                values[i] = NAN;
+            for (i = 0; i < raw->valuators.mask_len * 8; i++) {
+                if (XIMaskIsSet(raw->valuators.mask, i)) {
+                    if (i < MAXVALUATORS)
+                        values[i] = *val;
+                    val++;
+                    lasti = i;
+                }
+            }
+
+            int trackpad = lasti >= TRACKPAD_VALUATORS-1;
+            if (horizontal)
+                scroll(display, &x, values[trackpad ? 4 : 2], trackpad);
+            scroll(display, &y, values[trackpad ? 5 : 3], trackpad);
+            XFlush(display);
+        }
+
+        XFreeEventData(display, cookie);
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Low-overhead binary tracing, cheap enough to be left on in the field.
+ *
+ * trace(level, fmt, ...) records a fixed-size binary record (timestamp, call
+ * site, up to TRACE_MAXARGS integer arguments) in a per-process lock-free
+ * ring buffer. Formatting is deferred to the decoder (croutontracedump), so
+ * fmt may only contain integer conversions (%d, %u, %x, ...).
+ *
+ * Calls above TRACE_LEVEL are compiled out.
+ *
+ * The ring is dumped to /tmp/crouton-trace-<name>.<pid> on SIGUSR1, or on
+ * abort (e.g. failed trueorabort), once trace_init() has been called.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+/* websocket.h needs _GNU_SOURCE, which must be set before any system
+ * include, even if this header is included first. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 3
+#endif
+
+#define TRACE_MAGIC "CRTRACE1"
+#define TRACE_MAXARGS 4
+#define TRACE_RING_SIZE 4096  /* Must be a power of 2 */
+#define TRACE_MAXSITES 1024
+
+/* Dump file format: header, nsites sites (site header followed by function
+ * name and format string, not NUL-terminated), then ring_size records. */
+struct trace_header {
+    char magic[8];  /* TRACE_MAGIC */
+    uint32_t ring_size;  /* Number of records */
+    uint32_t nsites;  /* Number of sites */
+    uint32_t head;  /* Index of the next record to be written */
+    uint32_t pid;
+};
+
+struct trace_site_header {
+    uint16_t funclen;
+    uint16_t fmtlen;
+};
+
+struct trace_record {
+    uint64_t time_us;  /* CLOCK_MONOTONIC */
+    uint32_t seq;  /* Record index + 1, 0 while the record is written */
+    uint16_t site;  /* Site id (1-based) */
+    uint16_t nargs;
+    int64_t args[TRACE_MAXARGS];
+};
+
+#ifndef TRACE_DECODER
+
+/* Call site: registered (assigned an id) on first use. */
+struct trace_site {
+    const char* func;
+    const char* fmt;
+    uint32_t id;
+};
+
+#define trace(level, fmt, ...) do { \
+    if ((level) <= TRACE_LEVEL) { \
+        static struct trace_site _site = { __func__, fmt, 0 }; \
+        const int64_t _args[] = { 0, ##__VA_ARGS__ }; \
+        trace_write(&_site, _args + 1, \
+                    sizeof(_args)/sizeof(_args[0]) - 1); \
+    } \
+} while (0)
+
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static uint32_t trace_head = 0;
+static struct trace_site* trace_sites[TRACE_MAXSITES];
+static uint32_t trace_nsites = 0;
+static char trace_path[64] = "";
+
+/* Records a trace entry. Safe to call from any thread. */
+static void trace_write(struct trace_site* site,
+                        const int64_t* args, int nargs) {
+    uint32_t id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+
+    if (id == 0) {
+        /* Two threads may register the same site: this only wastes an id. */
+        uint32_t n = __atomic_fetch_add(&trace_nsites, 1, __ATOMIC_RELAXED);
+        if (n >= TRACE_MAXSITES) {
+            id = TRACE_MAXSITES+1;
+        } else {
+            trace_sites[n] = site;
+            id = n+1;
+        }
+        __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    }
+    if (id > TRACE_MAXSITES)
+        return;
+
+    uint32_t idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    struct trace_record* r = &trace_ring[idx % TRACE_RING_SIZE];
+    struct timespec ts;
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->time_us = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+    r->site = id;
+    r->nargs = nargs < TRACE_MAXARGS ? nargs : TRACE_MAXARGS;
+    memcpy(r->args, args, r->nargs*sizeof(int64_t));
+    __atomic_store_n(&r->seq, idx+1, __ATOMIC_RELEASE);
+}
+
+/* Writes exactly size bytes to fd (async-signal-safe). */
+static int trace_write_all(int fd, const void* buffer, size_t size) {
+    size_t tot = 0;
+    while (tot < size) {
+        int n = write(fd, (const char*)buffer + tot, size - tot);
+        if (n <= 0)
+            return -1;
+        tot += n;
+    }
+    return 0;
+}
+
+/* Dumps the ring to trace_path. Only uses async-signal-safe functions. */
+static void trace_dump() {
+    struct trace_header header;
+    uint32_t i;
+
+    if (!trace_path[0])
+        return;
+
+    /* The name is predictable, and croutonfbserver may run as root: never
+     * follow or reuse an existing file (e.g. a symlink planted in /tmp). */
+    unlink(trace_path);
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                              O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    /* Readable by the user who started the server. */
+    if (fchown(fd, getuid(), getgid()) < 0)
+        goto exit;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.ring_size = TRACE_RING_SIZE;
+    header.nsites = __atomic_load_n(&trace_nsites, __ATOMIC_ACQUIRE);
+    if (header.nsites > TRACE_MAXSITES)
+        header.nsites = TRACE_MAXSITES;
+    header.head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    header.pid = getpid();
+    if (trace_write_all(fd, &header, sizeof(header)) < 0)
+        goto exit;
+
+    for (i = 0; i < header.nsites; i++) {
+        /* Site may be in the process of being registered. */
+        struct trace_site* site = trace_sites[i];
+        const char* func = site ? site->func : "";
+        const char* fmt = site ? site->fmt : "";
+        struct trace_site_header sh = { strlen(func), strlen(fmt) };
+        if (trace_write_all(fd, &sh, sizeof(sh)) < 0 ||
+                trace_write_all(fd, func, sh.funclen) < 0 ||
+                trace_write_all(fd, fmt, sh.fmtlen) < 0)
+            goto exit;
+    }
+
+    trace_write_all(fd, trace_ring, sizeof(trace_ring));
+
+exit:
+    close(fd);
+}
+
+static void trace_signal_handler(int sig) {
+    int errno_orig = errno;
+    trace_dump();
+    errno = errno_orig;
+    /* abort() raises SIGABRT again once the handler returns. */
+    if (sig == SIGABRT)
+        signal(SIGABRT, SIG_DFL);
+}
+
+/* Sets the dump file name, and installs SIGUSR1/SIGABRT handlers. */
+static void trace_init(const char* name) {
+    struct sigaction act;
+
+    snprintf(trace_path, sizeof(trace_path), "/tmp/crouton-trace-%s.%d",
+             name, (int)getpid());
+
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = trace_signal_handler;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &act, NULL);
+    sigaction(SIGABRT, &act, NULL);
+}
+
+#endif /* !TRACE_DECODER */
+
+#endif /* TRACE_H_ */
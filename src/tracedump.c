@@ -0,0 +1,192 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Decodes a trace ring dump written by croutonfbserver or croutonwebsocket
+ * (see trace.h), and prints the records in order, one per line:
+ *     <time since first record (ms)> <function>: <message>
+ *
+ * Dumps are written to /tmp/crouton-trace-<name>.<pid> on SIGUSR1, e.g.:
+ *     pkill -USR1 croutonfbserver; croutontracedump /tmp/crouton-trace-*
+ */
+
+#define TRACE_DECODER
+#include "trace.h"
+#include <stdlib.h>
+
+struct site {
+    char* func;
+    char* fmt;
+};
+
+/* Reads exactly size bytes. Returns 0 on success, -1 on error. */
+static int read_all(FILE* file, void* buffer, size_t size) {
+    return fread(buffer, 1, size, file) == size ? 0 : -1;
+}
+
+/* Reads a string of length len from file. Returns NULL on error. */
+static char* read_string(FILE* file, int len) {
+    char* str = malloc(len+1);
+    if (!str || read_all(file, str, len) < 0) {
+        free(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+/* Prints fmt, substituting integer conversions with args. Length modifiers
+ * in fmt are ignored: all arguments are 64-bit. */
+static void print_record(const char* fmt, const int64_t* args, int nargs) {
+    char spec[32];
+    int argi = 0;
+
+    while (*fmt) {
+        if (*fmt != '%') {
+            putchar(*fmt++);
+            continue;
+        }
+        if (fmt[1] == '%') {
+            putchar('%');
+            fmt += 2;
+            continue;
+        }
+
+        /* Copy flags, width and precision, skip length modifiers */
+        int len = 0;
+        spec[len++] = *fmt++;
+        while (*fmt && strchr("#0- +'.123456789", *fmt) && len < 24)
+            spec[len++] = *fmt++;
+        while (*fmt && strchr("hljztL", *fmt))
+            fmt++;
+        if (!*fmt)
+            break;
+
+        char conv = *fmt++;
+        if (!strchr("diouxXc", conv)) {
+            printf("<%%%c?>", conv);
+            continue;
+        }
+        if (argi >= nargs) {
+            printf("<missing>");
+            continue;
+        }
+
+        if (conv == 'c') {
+            /* %lc would expect a wint_t: print a plain char instead. */
+            spec[len++] = conv;
+            spec[len] = '\0';
+            printf(spec, (int)args[argi++]);
+            continue;
+        }
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = conv;
+        spec[len] = '\0';
+        printf(spec, (long long)args[argi++]);
+    }
+    putchar('\n');
+}
+
+static int dump(const char* filename) {
+    struct trace_header header;
+    struct site* sites = NULL;
+    struct trace_record* ring = NULL;
+    int ret = 1;
+    uint32_t i;
+
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return 1;
+    }
+
+    if (read_all(file, &header, sizeof(header)) < 0 ||
+            memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))) {
+        fprintf(stderr, "%s: not a trace dump.\n", filename);
+        goto exit;
+    }
+
+    /* The ring is indexed modulo ring_size, and sites are 1-based indices
+     * into the site table: do not trust either size from the file. */
+    if (!header.ring_size || header.ring_size & (header.ring_size-1) ||
+            header.nsites > TRACE_MAXSITES) {
+        fprintf(stderr, "%s: invalid trace header.\n", filename);
+        goto exit;
+    }
+
+    sites = calloc(header.nsites, sizeof(*sites));
+    if (!sites && header.nsites) {
+        fprintf(stderr, "%s: out of memory.\n", filename);
+        goto exit;
+    }
+    for (i = 0; i < header.nsites; i++) {
+        struct trace_site_header sh;
+        if (read_all(file, &sh, sizeof(sh)) < 0 ||
+                !(sites[i].func = read_string(file, sh.funclen)) ||
+                !(sites[i].fmt = read_string(file, sh.fmtlen))) {
+            fprintf(stderr, "%s: truncated site table.\n", filename);
+            goto exit;
+        }
+    }
+
+    ring = calloc(header.ring_size, sizeof(*ring));
+    if (!ring) {
+        fprintf(stderr, "%s: out of memory.\n", filename);
+        goto exit;
+    }
+    if (read_all(file, ring, header.ring_size*sizeof(*ring)) < 0) {
+        fprintf(stderr, "%s: truncated ring.\n", filename);
+        goto exit;
+    }
+
+    printf("# pid %u, %u records written\n", header.pid, header.head);
+
+    /* Oldest to newest. Skip records that were overwritten, or being
+     * written, when the dump happened. */
+    uint32_t start = header.head > header.ring_size ?
+                         header.head - header.ring_size : 0;
+    uint64_t time0 = 0;
+    for (i = start; i != header.head; i++) {
+        struct trace_record* r = &ring[i % header.ring_size];
+        if (r->seq != i+1 || r->site < 1 || r->site > header.nsites)
+            continue;
+        if (!time0)
+            time0 = r->time_us;
+        printf("%10.3f %s: ", (r->time_us - time0) / 1000.0,
+               sites[r->site-1].func);
+        print_record(sites[r->site-1].fmt, r->args,
+                     r->nargs < TRACE_MAXARGS ? r->nargs : TRACE_MAXARGS);
+    }
+    ret = 0;
+
+exit:
+    if (sites) {
+        for (i = 0; i < header.nsites; i++) {
+            free(sites[i].func);
+            free(sites[i].fmt);
+        }
+        free(sites);
+    }
+    free(ring);
+    fclose(file);
+    return ret;
+}
+
+int main(int argc, char** argv) {
+    int i;
+    int ret = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s dumpfile...\n", argv[0]);
+        return 2;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (argc > 2)
+            printf("# %s\n", argv[i]);
+        ret |= dump(argv[i]);
+    }
+
+    return ret;
+}
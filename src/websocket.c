@@ -5,9 +5,20 @@
  * WebSocket server that provides an interface to an extension running in
  * Chromium OS, used for clipboard synchronization and URL handling.
  *
+ * Local tools send requests through a sequenced packet socket (see
+ * struct request_header), or through the FIFO pipes (legacy interface,
+ * one request at a time).
+ *
+ * croutoncycle queries (list, current display) are answered from a live
+ * inventory of the X11 displays and windows (see inventory.h), both for the
+ * extension and for local requests ("C" followed by the query).
+ *
+ * With -c, sends stdin as a request, and writes the reply to stdout.
  */
 
 #include "websocket.h"
+#include "request.h"
+#include "inventory.h"
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <netinet/tcp.h>
@@ -22,13 +33,86 @@ const char* PIPEIN_FILENAME = "/tmp/crouton-ext/in";
 const char* PIPEOUT_FILENAME = "/tmp/crouton-ext/out";
 const char* PIPE_VERSION_FILE = "/tmp/crouton-ext/version";
 const int PIPEOUT_WRITE_TIMEOUT = 3000;
+const int PIPEOUT_OPEN_RETRY = 10;  /* ms between attempts to open pipe out */
+
+/* Request socket constants (see request.h) */
+#define REQUEST_MAXCLIENTS 16
+#define REQUEST_MAXPENDING 64
+#define REQUEST_FIFO -1  /* Requester slot of the FIFO pipes */
+#define REQUEST_MAXQUEUED (17*1048576)  /* Largest reply, plus headers */
+
+/* Replies waiting for a requester that is slow to read them. */
+struct reply_queue {
+    char* data;
+    size_t size;  /* Allocated bytes */
+    size_t len;
+    size_t pos;  /* Bytes already sent */
+};
+
+/* Local clients of the request socket */
+struct request_client {
+    int fd;  /* -1 if the slot is free */
+    unsigned int gen;  /* Incremented each time the slot is reused */
+    int discard;  /* Drop packets until the end of the current message */
+    /* Reply packets that did not fit in the socket buffer: each is a
+     * request_header and a uint32_t length, followed by the data. */
+    struct reply_queue queue;
+};
+
+/* Requests forwarded to the extension, waiting for a reply. The extension
+ * replies in order, so a reply goes to the oldest request of its client. */
+struct request {
+    struct ws_client* ws;
+    int slot;  /* request_clients slot, or REQUEST_FIFO */
+    unsigned int gen;  /* Generation of the slot */
+    uint32_t id;
+    char cmd;  /* First character of the request */
+    uint64_t deadline_us;
+};
 
 /* File descriptors */
 static int pipein_fd = -1;
 static int pipeout_fd = -1;
+static int request_server_fd = -1;
+
+/* Reply to the FIFO pipes, written out from the main loop (see
+ * pipeout_flush). */
+static struct {
+    struct reply_queue queue;
+    int done;  /* The reply is complete: close the pipe once it is out */
+    uint64_t deadline_us;  /* 0 if there is no reply pending */
+} pipeout = { { NULL, 0, 0, 0 }, 0, 0 };
+
+static struct request_client request_clients[REQUEST_MAXCLIENTS];
+static struct request requests[REQUEST_MAXPENDING];
+static int nrequests = 0;
+
+/* Request being forwarded: other requests must wait, as messages cannot be
+ * interleaved on the WebSocket. */
+static struct {
+    int slot;  /* -1 if none */
+    struct ws_client* ws;
+    char cmd;
+} sending = { -1, NULL, 0 };
+
+/* Counters (see metrics_init) */
+static struct metric metric_commands = { "commands" };
+static struct metric metric_command_errors = { "command_errors" };
+static struct metric metric_unrequested = { "unrequested" };
+static struct metric metric_clipboard_bytes_out = { "clipboard_bytes_out" };
+static struct metric metric_clipboard_bytes_in = { "clipboard_bytes_in" };
+static struct metric metric_request_timeouts = { "request_timeouts" };
+
+static struct metric* metrics[] = {
+    &metric_commands, &metric_command_errors, &metric_unrequested,
+    &metric_clipboard_bytes_out, &metric_clipboard_bytes_in,
+    &metric_request_timeouts,
+    NULL
+};
 
 static void pipeout_close();
-static int socket_client_handle_unrequested(const char* buffer,
+static int socket_client_handle_unrequested(struct ws_client* c,
+                                            const char* buffer,
                                             const int length);
 
 /* Open a pipe in non-blocking mode, then set it back to blocking mode. */
@@ -54,47 +138,51 @@ static int pipe_open_block(const char* path, int oflag) {
     return fd;
 }
 
-/**/
-/* Pipe out functions */
-/**/
-
-/* Open the pipe out. Returns 0 on success, -1 on error. */
-static int pipeout_open() {
-    int i;
+/* Append len bytes to q. Returns 0 on success, -1 if q would hold more than
+ * REQUEST_MAXQUEUED bytes, or if memory cannot be allocated. */
+static int reply_queue_add(struct reply_queue* q, const void* data,
+                           size_t len) {
+    if (q->len - q->pos + len > REQUEST_MAXQUEUED)
+        return -1;
 
-    log(2, "Opening pipe out...");
-
-    /* Unfortunately, in the case where no reader is available (yet), opening
-     * pipes for writing behaves as follows: In blocking mode, "open" blocks.
-     * In non-blocking mode, it fails (returns -1). This means that we cannot
-     * open the pipe, then use functions like poll/select to detect when a
-     * reader becomes available. Waiting forever is also not an option: we do
-     * want to block this server if a client "forgets" to read the answer back.
-     * Therefore, we are forced to poll manually.
-     * Using usleep is simpler, and probably better than measuring time elapsed:
-     * If the system hangs for a while (like during large I/O writes), this will
-     * still wait around PIPEOUT_WRITE_TIMEOUT ms of actual user time, instead
-     * of clock time. */
-    for (i = 0; i < PIPEOUT_WRITE_TIMEOUT/10; i++) {
-        pipeout_fd = pipe_open_block(PIPEOUT_FILENAME, O_WRONLY);
-        if (pipeout_fd >= 0)
-            break;
-        if (pipeout_fd == -2) /* fnctl error: this is fatal. */
-            exit(1);
-        usleep(10000);
+    /* Drop the bytes already sent, once they make up half of the queue. */
+    if (q->pos > 0 && q->pos >= q->len / 2) {
+        memmove(q->data, q->data + q->pos, q->len - q->pos);
+        q->len -= q->pos;
+        q->pos = 0;
     }
 
-    if (pipeout_fd < 0) {
-        error("Timeout while opening.");
-        return -1;
+    if (q->len + len > q->size) {
+        size_t size = q->len + len > 2*q->size ? q->len + len : 2*q->size;
+        char* data = realloc(q->data, size);
+        if (!data)
+            return -1;
+        q->data = data;
+        q->size = size;
     }
 
+    memcpy(q->data + q->len, data, len);
+    q->len += len;
     return 0;
 }
 
+static void reply_queue_free(struct reply_queue* q) {
+    free(q->data);
+    memset(q, 0, sizeof(*q));
+}
+
+/**/
+/* Pipe out functions */
+/**/
+
+/* Drop the reply being written to the pipe out, and close it. */
 static void pipeout_close() {
     log(2, "Closing...");
 
+    reply_queue_free(&pipeout.queue);
+    pipeout.done = 0;
+    pipeout.deadline_us = 0;
+
     if (pipeout_fd < 0)
         return;
 
@@ -102,27 +190,329 @@ static void pipeout_close() {
     pipeout_fd = -1;
 }
 
-static int pipeout_write(char* buffer, int len) {
+/* Returns 1 if a reply is waiting to be written to the pipe out. */
+static int pipeout_pending() {
+    return pipeout.deadline_us != 0;
+}
+
+/* Write as much of the reply as the pipe out takes, without blocking, and
+ * close it once the whole reply is out.
+ * Unfortunately, opening a pipe for writing fails in non-blocking mode (and
+ * blocks in blocking mode) until a reader is available, so poll cannot tell
+ * when the requester opens it: until then, the main loop calls this function
+ * every PIPEOUT_OPEN_RETRY ms (see pipeout_expire). This never blocks the
+ * server if a requester "forgets" to read the reply back.
+ * Returns 0 on success, -1 on error (the reply is then dropped). */
+static int pipeout_flush() {
+    struct reply_queue* q = &pipeout.queue;
     int n;
 
-    log(3, "(fd=%d, len=%d)", pipeout_fd, len);
+    if (pipeout_fd < 0) {
+        pipeout_fd = open(PIPEOUT_FILENAME,
+                          O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (pipeout_fd < 0) {
+            if (errno == ENXIO)  /* No reader yet */
+                return 0;
+            syserror("Cannot open pipe out.");
+            pipeout_close();
+            return -1;
+        }
+        log(2, "Pipe out open.");
+    }
 
-    if (pipeout_fd < 0)
+    while (q->pos < q->len) {
+        n = write(pipeout_fd, q->data + q->pos, q->len - q->pos);
+        trace(3, "n=%d/%zu", n, q->len - q->pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+                return 0;
+            syserror("Error writing to pipe.");
+            pipeout_close();
+            return -1;
+        }
+        q->pos += n;
+        /* The requester is reading: give it time for the rest. */
+        pipeout.deadline_us = gettime_us() + PIPEOUT_WRITE_TIMEOUT*1000ULL;
+    }
+
+    if (pipeout.done)
+        pipeout_close();
+    return 0;
+}
+
+/* Queue part of a reply for the pipe out. more indicates that more data
+ * follows. Returns 0 on success, -1 on error (the reply is then dropped). */
+static int pipeout_write(const char* buffer, int len, int more) {
+    trace(3, "(fd=%d, len=%d, more=%d)", pipeout_fd, len, more);
+
+    if (!pipeout_pending()) {
+        log(2, "Opening pipe out...");
+        pipeout.deadline_us = gettime_us() + PIPEOUT_WRITE_TIMEOUT*1000ULL;
+    }
+
+    if (reply_queue_add(&pipeout.queue, buffer, len) < 0) {
+        error("Reply to the pipe out is too large.");
+        pipeout_close();
+        return -1;
+    }
+    pipeout.done = !more;
+
+    return pipeout_flush();
+}
+
+/* Drop the reply to the pipe out if the requester has not read it in time.
+ * Returns the time until the pipe out must be checked again in ms, or -1 if
+ * there is no reply pending. */
+static int pipeout_expire() {
+    uint64_t now = gettime_us();
+
+    if (!pipeout_pending())
         return -1;
 
-    n = block_write(pipeout_fd, buffer, len);
-    if (n != len) {
-        error("Error writing to pipe.");
+    if (pipeout.deadline_us <= now) {
+        error("Timeout while writing pipe out.");
         pipeout_close();
+        return -1;
     }
-    return n;
+
+    if (pipeout_fd < 0) {
+        pipeout_flush();
+        if (!pipeout_pending())
+            return -1;
+        if (pipeout_fd < 0)
+            return PIPEOUT_OPEN_RETRY;
+    }
+
+    return (pipeout.deadline_us - now + 999) / 1000;
 }
 
-/* Open pipe out, write a string, then close the pipe. */
+/* Write a string to the pipe out, as a whole reply. */
 static void pipeout_error(char* str) {
-    pipeout_open();
-    pipeout_write(str, strlen(str));
-    pipeout_close();
+    metric_inc(metric_command_errors);
+    pipeout_write(str, strlen(str), 0);
+}
+
+/**/
+/* Request functions */
+/**/
+
+/* Close a local client. If its request was being forwarded, finish the
+ * message, so that the extension still gets a valid (truncated) one. */
+static void request_client_close(int slot) {
+    struct request_client* rc = &request_clients[slot];
+
+    log(2, "Closing request client %d.", slot);
+
+    if (rc->fd < 0)
+        return;
+
+    close(rc->fd);
+    rc->fd = -1;
+    rc->discard = 0;
+    reply_queue_free(&rc->queue);
+
+    if (sending.slot == slot) {
+        socket_client_write_frame(sending.ws, NULL, 0, WS_OPCODE_CONT, 1);
+        sending.slot = -1;
+    }
+}
+
+/* Send the queued reply packets of a local client, until its socket buffer
+ * is full. Returns 0 on success, -1 on error (the client is then closed). */
+static int request_client_flush(int slot) {
+    struct request_client* rc = &request_clients[slot];
+    struct reply_queue* q = &rc->queue;
+    struct request_header header;
+    uint32_t len;
+
+    while (q->pos < q->len) {
+        char* p = q->data + q->pos;
+
+        memcpy(&header, p, sizeof(header));
+        memcpy(&len, p + sizeof(header), sizeof(len));
+        if (request_send(rc->fd, header.id, header.flags,
+                         p + sizeof(header) + sizeof(len), len, 0) < 0) {
+            if (errno == EAGAIN)
+                return 0;
+            syserror("Cannot send reply.");
+            request_client_close(slot);
+            return -1;
+        }
+        q->pos += sizeof(header) + sizeof(len) + len;
+    }
+
+    reply_queue_free(q);
+    return 0;
+}
+
+/* Send a reply packet to a local client. If its socket buffer is full, the
+ * packet is queued rather than waited for: a requester that is slow to read
+ * must not stall the server. Returns 0 on success, -1 on error (the client
+ * is then closed). */
+static int request_client_send(int slot, uint32_t id, uint32_t flags,
+                               const char* buffer, int len) {
+    struct request_client* rc = &request_clients[slot];
+    struct reply_queue* q = &rc->queue;
+    struct request_header header = { id, flags };
+    uint32_t len32 = len;
+
+    if (q->pos == q->len) {
+        if (request_send(rc->fd, id, flags, buffer, len, 0) == 0)
+            return 0;
+        if (errno != EAGAIN) {
+            syserror("Cannot send reply.");
+            request_client_close(slot);
+            return -1;
+        }
+    }
+
+    log(3, "Queueing reply packet for request client %d.", slot);
+    if (reply_queue_add(q, &header, sizeof(header)) < 0 ||
+            reply_queue_add(q, &len32, sizeof(len32)) < 0 ||
+            reply_queue_add(q, buffer, len) < 0) {
+        error("Request client %d is not reading its replies.", slot);
+        request_client_close(slot);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns the WebSocket client that requests go to (the one that connected
+ * last), or NULL if there is none. */
+static struct ws_client* request_target() {
+    struct ws_client* c = nclients > 0 ? clients[nclients-1] : NULL;
+
+    return c && c->fd >= 0 ? c : NULL;
+}
+
+/* Add a request forwarded to c. Returns 0 on success, -1 if there are too
+ * many requests in flight. */
+static int request_add(struct ws_client* c, int slot, uint32_t id, char cmd) {
+    struct request* r;
+
+    if (nrequests >= REQUEST_MAXPENDING)
+        return -1;
+
+    r = &requests[nrequests++];
+    r->ws = c;
+    r->slot = slot;
+    r->gen = slot == REQUEST_FIFO ? 0 : request_clients[slot].gen;
+    r->id = id;
+    r->cmd = cmd;
+    r->deadline_us = gettime_us() + REQUEST_TIMEOUT*1000ULL;
+    return 0;
+}
+
+/* Remove request i from the queue, and return it in r. */
+static void request_remove(int i, struct request* r) {
+    *r = requests[i];
+    nrequests--;
+    memmove(&requests[i], &requests[i+1], (nrequests-i)*sizeof(*r));
+}
+
+/* Returns the index of the oldest request forwarded to c, or -1. */
+static int request_find(struct ws_client* c) {
+    int i;
+
+    for (i = 0; i < nrequests; i++) {
+        if (requests[i].ws == c)
+            return i;
+    }
+    return -1;
+}
+
+/* Returns 1 if a request from the FIFO pipes is waiting for its reply. */
+static int request_fifo_pending() {
+    int i;
+
+    for (i = 0; i < nrequests; i++) {
+        if (requests[i].slot == REQUEST_FIFO)
+            return 1;
+    }
+    return 0;
+}
+
+/* Pass part of a reply on to the requester. more indicates that more data
+ * follows. Returns 0 on success, -1 if the requester is gone (the reply
+ * should then be discarded). */
+static int request_reply(struct request* r, char* buffer, int len, int more) {
+    if (r->slot == REQUEST_FIFO)
+        return pipeout_write(buffer, len, more);
+
+    struct request_client* rc = &request_clients[r->slot];
+
+    if (rc->fd < 0 || rc->gen != r->gen) {
+        log(2, "Requester is gone (%d).", r->slot);
+        return -1;
+    }
+
+    return request_client_send(r->slot, r->id, more ? REQUEST_MORE : 0,
+                               buffer, len);
+}
+
+/* The reply to r was cut short: let the requester know. */
+static void request_abort(struct request* r) {
+    if (r->slot == REQUEST_FIFO)
+        pipeout_close();
+    else if (request_clients[r->slot].gen == r->gen)
+        request_client_close(r->slot);
+}
+
+/* Reply to r with an error string. */
+static void request_fail(struct request* r, char* str) {
+    metric_inc(metric_command_errors);
+    request_reply(r, str, strlen(str), 0);
+}
+
+/* Fail the requests forwarded to c, which is about to be freed (see
+ * client_cleanup). */
+static void request_cleanup(struct ws_client* c) {
+    int i;
+    struct request r;
+
+    while ((i = request_find(c)) >= 0) {
+        request_remove(i, &r);
+        request_fail(&r, "EError: connection closed.");
+    }
+
+    if (sending.slot >= 0 && sending.ws == c) {
+        request_clients[sending.slot].discard = 1;
+        sending.slot = -1;
+    }
+}
+
+/* Close the connections that have not replied to a request in time: the
+ * extension replies in order, so a missing reply would leave all the
+ * following requests hanging (or get them the wrong replies). The requests
+ * fail when the client is freed.
+ * Returns the time until the next deadline in ms, or -1 if there is none. */
+static int request_expire() {
+    uint64_t now = gettime_us();
+    int i;
+    int next = -1;
+
+    for (i = 0; i < nrequests; i++) {
+        struct request* r = &requests[i];
+
+        if (r->ws->fd < 0)
+            return 0;
+
+        if (r->deadline_us <= now) {
+            error("Request timed out (%c).", r->cmd);
+            metric_inc(metric_request_timeouts);
+            socket_client_close(r->ws, 1);
+            return 0;
+        }
+
+        int left = (r->deadline_us - now + 999) / 1000;
+        if (next < 0 || left < next)
+            next = left;
+    }
+
+    return next;
 }
 
 /**/
@@ -148,23 +538,38 @@ static void pipein_reopen() {
     }
 }
 
-/* Read data from the pipe, and forward it to the socket client. */
+/* Read a request from the pipe, and forward it to the socket client. The
+ * reply is written to the pipe out when it comes in (see
+ * socket_client_read). */
 static void pipein_read() {
     int n;
-    char buffer[FRAMEMAXHEADERSIZE+BUFFERSIZE];
+    char buffer[BUFFERSIZE];
+    struct iovec iov;
     int first = 1;
     char firstchar = '\0';
+    int total = 0;
+
+    metric_inc(metric_commands);
+
+    struct ws_client* c = request_target();
 
-    if (client_fd < 0) {
+    if (!c) {
         log(1, "No client FD.");
         pipein_reopen();
         pipeout_error("EError: not connected.");
         return;
     }
 
+    if (nrequests >= REQUEST_MAXPENDING) {
+        error("Too many requests in flight.");
+        pipein_reopen();
+        pipeout_error("EError: too many requests.");
+        return;
+    }
+
     while (1) {
-        n = read(pipein_fd, buffer+FRAMEMAXHEADERSIZE, BUFFERSIZE);
-        log(3, "n=%d", n);
+        n = read(pipein_fd, buffer, BUFFERSIZE);
+        trace(3, "n=%d", n);
 
         if (n < 0) {
             /* This is very unlikely, and fatal. */
@@ -175,11 +580,15 @@ static void pipein_read() {
         }
 
         if (first)
-            firstchar = buffer[FRAMEMAXHEADERSIZE];
-
-        /* Write a text frame for the first packet, then cont frames. */
-        n = socket_client_write_frame(buffer, n,
-                                  first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 0);
+            firstchar = buffer[0];
+        total += n;
+
+        /* Write a text frame for the first packet, then cont frames. More
+         * frames follow (at least the FIN one): let the kernel coalesce. */
+        iov.iov_base = buffer;
+        iov.iov_len = n;
+        n = socket_client_write_framev(c, &iov, 1,
+                            first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 0, 1);
         if (n < 0) {
             error("Error writing frame.");
             pipein_reopen();
@@ -190,12 +599,16 @@ static void pipein_read() {
         first = 0;
     }
 
-    log(3, "EOF");
+    trace(3, "EOF");
 
     pipein_reopen();
 
+    /* Clipboard content sent to Chromium OS (minus command character) */
+    if (firstchar == 'W')
+        metric_add(metric_clipboard_bytes_out, total-1);
+
     /* Empty FIN frame to finish the message. */
-    n = socket_client_write_frame(buffer, 0,
+    n = socket_client_write_frame(c, NULL, 0,
                                   first ? WS_OPCODE_TEXT : WS_OPCODE_CONT, 1);
     if (n < 0) {
         error("Error writing frame.");
@@ -203,71 +616,7 @@ static void pipein_read() {
         return;
     }
 
-    log(2, "Reading answer from client...");
-
-    int fin = 0;
-    uint32_t maskkey;
-    int retry = 0;
-    first = 1;
-
-    /* Ignore return value, so we still read the frame even if pipeout
-     * cannot be open. */
-    pipeout_open();
-
-    /* Read possibly fragmented message from WebSocket. */
-    while (fin != 1) {
-        int len = socket_client_read_frame_header(&fin, &maskkey, &retry);
-
-        log(3, "len=%d fin=%d retry=%d...", len, fin, retry);
-
-        if (retry)
-            continue;
-
-        if (len < 0)
-            goto exit;
-
-        /* Read the whole frame, and write it to pipeout */
-        while (len > 0) {
-            int rlen = (len > BUFFERSIZE) ? BUFFERSIZE: len;
-            if (socket_client_read_frame_data(buffer, rlen, maskkey) < 0)
-                goto exit;
-
-            /* Check first byte */
-            if (first && buffer[0] != firstchar && buffer[0] != 'E') {
-                /* This is not a response: unrequested packet */
-                if (!fin && len < BUFFERSIZE) {
-                    /* !fin, and buffer not full, finish reading... */
-                    rlen = socket_client_read_frame(buffer+len,
-                                                    sizeof(buffer)-len);
-                    if (rlen < 0)
-                        goto exit;
-
-                    len += rlen;
-                }
-
-                if (len >= BUFFERSIZE) {
-                    error("Unrequested command too long: (>%d bytes).", len);
-                    socket_client_close(1);
-                    goto exit;
-                }
-
-                if (socket_client_handle_unrequested(buffer, len) < 0)
-                    goto exit;
-
-                /* Command was handled, try reading the answer again. */
-                fin = 0;
-                break;
-            }
-
-            /* Ignore return value as well */
-            pipeout_write(buffer, rlen);
-            len -= rlen;
-            first = 0;
-        }
-    }
-
-exit:
-    pipeout_close();
+    request_add(c, REQUEST_FIFO, 0, firstchar);
 }
 
 /* Check if filename is a valid FIFO pipe. If not create it.
@@ -347,17 +696,209 @@ void pipe_init() {
     pipein_reopen();
 }
 
+/**/
+/* Request socket functions */
+/**/
+
+/* Create the request socket (pipe_init must be called first). */
+static void request_init() {
+    struct sockaddr_un addr;
+    int i;
+
+    for (i = 0; i < REQUEST_MAXCLIENTS; i++)
+        request_clients[i].fd = -1;
+
+    request_server_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (request_server_fd < 0) {
+        syserror("Cannot create request socket.");
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, REQUEST_SOCKET, sizeof(addr.sun_path)-1);
+
+    /* Remove the socket left behind by a previous instance. */
+    unlink(REQUEST_SOCKET);
+
+    if (bind(request_server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            chmod(REQUEST_SOCKET, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|
+                                  S_IROTH|S_IWOTH) < 0 ||
+            listen(request_server_fd, REQUEST_MAXCLIENTS) < 0) {
+        syserror("Cannot listen on %s.", REQUEST_SOCKET);
+        exit(1);
+    }
+}
+
+/* Accept a new local client on the request socket. */
+static void request_accept() {
+    int fd;
+    int i;
+
+    fd = accept4(request_server_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (fd < 0) {
+        syserror("Error in accept.");
+        return;
+    }
+
+    for (i = 0; i < REQUEST_MAXCLIENTS; i++) {
+        struct request_client* rc = &request_clients[i];
+        if (rc->fd < 0) {
+            rc->fd = fd;
+            rc->gen++;
+            rc->discard = 0;
+            log(2, "Request client %d.", i);
+            return;
+        }
+    }
+
+    error("Too many request clients.");
+    close(fd);
+}
+
+/* Read a packet from a local client, and forward it to the socket client. */
+static void request_client_read(int slot) {
+    struct request_client* rc = &request_clients[slot];
+    struct request_header header;
+    char buffer[REQUEST_MAXDATA];
+    struct iovec iov;
+    int n;
+
+    n = request_recv(rc->fd, &header, buffer);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return;
+        if (errno != ECONNRESET)  /* Not a mere disconnection */
+            syserror("Error reading from request client.");
+        request_client_close(slot);
+        return;
+    }
+
+    int more = header.flags & REQUEST_MORE;
+
+    trace(3, "slot=%d id=%u n=%d more=%d", slot, header.id, n, more);
+
+    if (rc->discard) {
+        rc->discard = more;
+        return;
+    }
+
+    int opcode = WS_OPCODE_CONT;
+    int first = sending.slot != slot;
+
+    if (first) {
+        struct ws_client* c = request_target();
+        char cmd = n > 0 ? buffer[0] : '\0';
+        char* err = NULL;
+
+        metric_inc(metric_commands);
+
+        /* croutoncycle queries are answered locally. */
+        if (cmd == 'C') {
+            char reply[REQUEST_MAXDATA];
+            int len = n > 1 ? inventory_query(buffer[1], reply,
+                                              sizeof(reply)) : -1;
+            if (len < 0) {
+                metric_inc(metric_command_errors);
+                strcpy(reply, "EError: inventory unavailable.");
+                len = strlen(reply);
+            }
+            if (request_client_send(slot, header.id, 0, reply, len) == 0)
+                rc->discard = more;
+            return;
+        }
+
+        if (!c)
+            err = "EError: not connected.";
+        else if (request_add(c, slot, header.id, cmd) < 0)
+            err = "EError: too many requests.";
+
+        if (err) {
+            log(1, "%s", err);
+            metric_inc(metric_command_errors);
+            if (request_client_send(slot, header.id, 0,
+                                    err, strlen(err)) == 0)
+                rc->discard = more;
+            return;
+        }
+
+        sending.slot = slot;
+        sending.ws = c;
+        sending.cmd = cmd;
+        opcode = WS_OPCODE_TEXT;
+    }
+
+    /* Clipboard content sent to Chromium OS (minus command character) */
+    if (sending.cmd == 'W')
+        metric_add(metric_clipboard_bytes_out, first ? n-1 : n);
+
+    iov.iov_base = buffer;
+    iov.iov_len = n;
+    if (!more)
+        sending.slot = -1;
+
+    /* On error, the client is closed, and the request fails when it is
+     * freed. */
+    if (socket_client_write_framev(sending.ws, &iov, 1,
+                                   opcode, !more, more) < 0)
+        error("Error writing frame.");
+}
+
+/* Client mode: send stdin as a request through the request socket, and
+ * write the reply to stdout. Errors are written as replies ("E..."). */
+static int request_command() {
+    struct request_header header;
+    char buffer[REQUEST_MAXDATA];
+    int fd, n;
+
+    fd = request_connect();
+    if (fd < 0) {
+        printf("EError: cannot connect to %s.\n", REQUEST_SOCKET);
+        return 0;
+    }
+
+    /* Send the request: the last (possibly empty) packet ends it. */
+    do {
+        n = read(STDIN_FILENO, buffer, REQUEST_MAXDATA);
+        if (n < 0) {
+            printf("EError: cannot read the request.\n");
+            return 0;
+        }
+        if (request_send(fd, 0, n > 0 ? REQUEST_MORE : 0, buffer, n,
+                         REQUEST_TIMEOUT) < 0) {
+            printf("EError: cannot send the request.\n");
+            return 0;
+        }
+    } while (n > 0);
+
+    /* Read back the reply. */
+    do {
+        n = request_recv(fd, &header, buffer);
+        if (n < 0) {
+            printf("EError: connection closed.\n");
+            return 0;
+        }
+        if (block_write(STDOUT_FILENO, buffer, n) != n)
+            return 1;
+    } while (header.flags & REQUEST_MORE);
+
+    return 0;
+}
+
 /* Handle unrequested packet from extension.
  * Returns 0 on success. On error, returns -1 and closes websocket connection.
  */
-static int socket_client_handle_unrequested(const char* buffer,
+static int socket_client_handle_unrequested(struct ws_client* c,
+                                            const char* buffer,
                                             const int length) {
+    metric_inc(metric_unrequested);
+
     /* Process the client request. */
     switch (buffer[0]) {
         case 'C': {  /* Send a command to croutoncycle */
             char reply[BUFFERSIZE];
             int replylength = 1;
-            reply[FRAMEMAXHEADERSIZE] = 'C';
+            reply[0] = 'C';
 
             char* cmd = "croutoncycle";
             char param[length];
@@ -369,18 +910,22 @@ static int socket_client_handle_unrequested(const char* buffer,
 
             /* We are only interested in the output for list commands */
             if (param[0] == 'l') {
-                int n = popen2(cmd, args, NULL, 0,
-                               &reply[FRAMEMAXHEADERSIZE+1],
-                               BUFFERSIZE-FRAMEMAXHEADERSIZE-1);
+                int n = inventory_query('l', &reply[1], BUFFERSIZE-1);
+                if (n < 0)
+                    n = popen2(cmd, args, NULL, 0, &reply[1], BUFFERSIZE-1);
                 if (n < 0) {
                     error("Call to croutoncycle failed.");
-                    socket_client_close(0);
+                    socket_client_close(c, 0);
                     return -1;
                 }
                 replylength += n;
             } else if (param[0] == 'O') {
                 /* Extra OK response from a C back-and-forth. Disregard. */
                 break;
+            } else if (param[0] == 's') {
+                /* Chromium OS window change: no need to fork croutoncycle
+                 * (the kiwi display is only read back). */
+                inventory_kiwi_display(param+1);
             } else {
                 /* Launch command in background (this is necessary as
                    croutoncycle may send a websocket command, leaving us
@@ -405,10 +950,10 @@ static int socket_client_handle_unrequested(const char* buffer,
                 /* Wait for first fork to complete. */
                 waitpid(pid, NULL, 0);
             }
-            if (socket_client_write_frame(reply, replylength,
+            if (socket_client_write_frame(c, reply, replylength,
                                           WS_OPCODE_TEXT, 1) < 0) {
                 error("Write error.");
-                socket_client_close(0);
+                socket_client_close(c, 0);
                 return -1;
             }
             break;
@@ -419,7 +964,7 @@ static int socket_client_handle_unrequested(const char* buffer,
             memcpy(dump, buffer, len);
             dump[len] = '\0';
             error("Received an unexpected packet from client (%s).", dump);
-            socket_client_close(0);
+            socket_client_close(c, 0);
             return -1;
         }
     }
@@ -427,25 +972,89 @@ static int socket_client_handle_unrequested(const char* buffer,
     return 0;
 }
 
-/* Unrequested data came in from WebSocket client. */
-static void socket_client_read() {
+/* Data came in from WebSocket client c: either the reply to the oldest
+ * request forwarded to c, which is passed on to the requester, or an
+ * unrequested packet. */
+static void socket_client_read(struct ws_client* c) {
     char buffer[BUFFERSIZE];
-    int length;
+    int len, rlen;
+    int fin = 0;
+    uint32_t maskkey;
+    int retry = 0;
 
-    length = socket_client_read_frame(buffer, sizeof(buffer));
-    if (length < 0) {
-        socket_client_close(1);
+    len = socket_client_read_frame_header(c, &fin, &maskkey, &retry);
+    if (len < 0 || retry)  /* Error, or control frame already handled */
         return;
-    }
 
-    if (length >= BUFFERSIZE) {
-        error("Unrequested command too long: (>%d bytes).", length);
-        socket_client_close(1);
+    rlen = (len > BUFFERSIZE) ? BUFFERSIZE : len;
+    if (socket_client_read_frame_data(c, buffer, rlen, maskkey) < 0)
+        return;
+
+    int i = request_find(c);
+
+    /* Check first byte */
+    if (i < 0 || rlen == 0 ||
+            (buffer[0] != requests[i].cmd && buffer[0] != 'E')) {
+        /* This is not a response: unrequested packet */
+        if (!fin && len < BUFFERSIZE) {
+            /* !fin, and buffer not full, finish reading... */
+            rlen = socket_client_read_frame(c, buffer+len,
+                                            sizeof(buffer)-len);
+            if (rlen < 0)
+                return;
+
+            len += rlen;
+        }
+
+        if (len >= BUFFERSIZE || len == 0) {
+            error("Unrequested command too long or empty (%d bytes).", len);
+            socket_client_close(c, 1);
+            return;
+        }
+
+        /* Ignore return value (connection gets closed on error) */
+        socket_client_handle_unrequested(c, buffer, len);
         return;
     }
 
-    /* Ignore return value (connection gets closed on error) */
-    socket_client_handle_unrequested(buffer, length);
+    struct request r;
+    int ok = 1;
+    int first = 1;
+
+    request_remove(i, &r);
+
+    /* Clipboard content received (minus reply character) */
+    int clipboard = r.cmd == 'R' && buffer[0] == 'R';
+
+    /* Pass the possibly fragmented message on, a buffer at a time. */
+    while (1) {
+        len -= rlen;
+
+        if (clipboard)
+            metric_add(metric_clipboard_bytes_in, first ? rlen-1 : rlen);
+        if (ok)
+            ok = request_reply(&r, buffer, rlen, len > 0 || !fin) == 0;
+        first = 0;
+
+        if (len == 0) {
+            if (fin)
+                return;
+            do {
+                len = socket_client_read_frame_header(c, &fin, &maskkey,
+                                                      &retry);
+            } while (retry);
+            if (len < 0)
+                break;
+        }
+
+        rlen = (len > BUFFERSIZE) ? BUFFERSIZE : len;
+        if (socket_client_read_frame_data(c, buffer, rlen, maskkey) < 0)
+            break;
+    }
+
+    /* The connection was closed in the middle of the reply. */
+    if (ok)
+        request_abort(&r);
 }
 
 static int terminate = 0;
@@ -455,30 +1064,44 @@ static void signal_handler(int sig) {
 }
 
 int main(int argc, char **argv) {
-    int n;
+    int n, i;
     /* Poll array:
-     * 0 - server_fd
+     * 0 - server socket
      * 1 - pipein_fd
-     * 2 - client_fd (if any)
+     * 2 - request_server_fd
+     * 3 - pipeout_fd (while a reply is being written)
+     * 4... - request clients (REQUEST_MAXCLIENTS entries)
+     * 4+REQUEST_MAXCLIENTS... - inventory (INV_MAXPOLLFDS entries)
+     * INVENTORY+INV_MAXPOLLFDS... - client sockets (if any)
      */
-    struct pollfd fds[3];
-    int nfds = 3;
+    const int INVENTORY = 4+REQUEST_MAXCLIENTS;
+    const int CLIENTS = INVENTORY+INV_MAXPOLLFDS;
+    struct pollfd fds[4+REQUEST_MAXCLIENTS+INV_MAXPOLLFDS+WS_MAXCLIENTS];
+    int nfds;
+    struct timespec timeout;
     sigset_t sigmask;
     sigset_t sigmask_orig;
     struct sigaction act;
     int c;
+    struct ws_server* server;
 
-    while ((c = getopt(argc, argv, "v:")) != -1) {
+    popen2_helper_main();
+
+    while ((c = getopt(argc, argv, "cv:")) != -1) {
         switch (c) {
+        case 'c':
+            return request_command();
         case 'v':
             verbose = atoi(optarg);
             break;
         default:
-            fprintf(stderr, "%s [-v 0-3]\n", argv[0]);
+            fprintf(stderr, "%s [-v 0-3] | -c\n", argv[0]);
             return 1;
         }
     }
 
+    popen2_helper_start();
+
     /* Termination signal handler. */
     memset(&act, 0, sizeof(act));
     act.sa_handler = signal_handler;
@@ -514,62 +1137,169 @@ int main(int argc, char **argv) {
 
     /* Prepare pollfd structure. */
     memset(fds, 0, sizeof(fds));
-    fds[0].events = POLLIN;
-    fds[1].events = POLLIN;
-    fds[2].events = POLLIN;
-
-    /* Initialise pipe and WebSocket server */
-    socket_server_init(PORT);
+    for (i = 0; i < CLIENTS; i++)
+        fds[i].events = POLLIN;
+    fds[3].events = POLLOUT;
+
+    /* Initialise pipe, request socket and WebSocket server. A new client
+     * replaces the previous one: requests go to the client that connected
+     * last. */
+    trace_init("websocket");
+    server = socket_server_init(PORT, 1);
+    client_cleanup = request_cleanup;
+    metrics_init(metrics);
     pipe_init();
+    request_init();
+    if (inventory_init() < 0)
+        error("Cannot initialize the inventory, using croutoncycle.");
 
     while (!terminate) {
-        /* Make sure fds is up to date. */
-        fds[0].fd = server_fd;
-        fds[1].fd = pipein_fd;
-        fds[2].fd = client_fd;
+        socket_server_reap();
+        n = request_expire();
+        i = pipeout_expire();
+        if (i >= 0 && (n < 0 || i < n))
+            n = i;
+        timeout.tv_sec = n / 1000;
+        timeout.tv_nsec = (n % 1000) * 1000000;
+
+        /* Handle frames that are already in the readahead buffer first,
+         * coalescing the replies. */
+        int pending = 0;
+        for (i = 0; i < nclients; i++) {
+            struct ws_client* client = clients[i];
+            if (client->fd >= 0 && socket_client_pending(client) > 0) {
+                log(2, "Client data pending.");
+                socket_client_cork(client, 1);
+                socket_client_read(client);
+                pending = 1;
+            }
+        }
+        if (pending)
+            continue;
+        for (i = 0; i < nclients; i++)
+            socket_client_cork(clients[i], 0);
+
+        /* Make sure fds is up to date. While a request is being forwarded,
+         * only its client is read from. The FIFO pipes only have one request
+         * in flight, until its reply is out. Queued replies are sent as
+         * soon as there is room. */
+        fds[0].fd = server->fd;
+        fds[1].fd = sending.slot < 0 && !request_fifo_pending() &&
+                    !pipeout_pending() ? pipein_fd : -1;
+        fds[2].fd = request_server_fd;
+        fds[3].fd = pipeout.queue.pos < pipeout.queue.len ? pipeout_fd : -1;
+        for (i = 0; i < REQUEST_MAXCLIENTS; i++) {
+            struct request_client* rc = &request_clients[i];
+            int queued = rc->queue.pos < rc->queue.len;
+            int readable = sending.slot < 0 || sending.slot == i;
+            fds[4+i].fd = readable || queued ? rc->fd : -1;
+            fds[4+i].events = (readable ? POLLIN : 0) |
+                              (queued ? POLLOUT : 0);
+        }
+        inventory_pollfds(fds + INVENTORY);
+        nfds = CLIENTS + socket_server_pollfds(fds + CLIENTS);
 
         /* Only handle signals in ppoll: this makes sure we complete processing
          * the current request before bailing out. */
-        n = ppoll(fds, nfds, NULL, &sigmask_orig);
+        n = ppoll(fds, nfds, n >= 0 ? &timeout : NULL, &sigmask_orig);
 
-        log(3, "poll ret=%d (%d, %d, %d)\n", n,
-                   fds[0].revents, fds[1].revents, fds[2].revents);
+        trace(3, "poll ret=%d (%d, %d, %d)", n,
+              fds[0].revents, fds[1].revents, fds[2].revents);
+
+        /* Timeout: expire requests */
+        if (n == 0)
+            continue;
+
+        /* Signal: SIGUSR1 (trace dump), or termination (loop exits). */
+        if (n < 0 && errno == EINTR)
+            continue;
 
         if (n < 0) {
-            /* Do not print error when ppoll is interupted by a signal. */
-            if (errno != EINTR || verbose >= 1)
-                syserror("ppoll error.");
+            syserror("ppoll error.");
             break;
         }
 
-        if (fds[0].revents & POLLIN) {
-            log(1, "WebSocket accept.");
-            socket_server_accept(VERSION);
+        /* Clients first: accepting a new client may free closed ones. */
+        for (i = 0; i < nfds-CLIENTS; i++) {
+            struct ws_client* client = clients[i];
+            short revents = fds[CLIENTS+i].revents;
+            if (!revents)
+                continue;
+            if (revents & POLLOUT) {
+                log(3, "Client fd writable.");
+                socket_client_flush(client);
+            }
+            /* Errors and hang ups are reported by the read. */
+            if ((revents & ~POLLOUT) && client->fd >= 0) {
+                log(2, "Client fd ready.");
+                socket_client_read(client);
+            }
+            fds[CLIENTS+i].revents = 0;
+            n--;
+        }
+        /* Errors and hang ups make the flush fail, or are reported by the
+         * read. A client that started forwarding a request gets polled alone
+         * next time. */
+        for (i = 0; i < REQUEST_MAXCLIENTS; i++) {
+            struct request_client* rc = &request_clients[i];
+            short revents = fds[4+i].revents;
+            if (!revents)
+                continue;
+            if ((revents & ~POLLIN) && rc->queue.pos < rc->queue.len) {
+                log(3, "Request client %d writable.", i);
+                request_client_flush(i);
+            }
+            if ((revents & ~POLLOUT) && rc->fd >= 0 &&
+                    (sending.slot < 0 || sending.slot == i)) {
+                log(2, "Request client %d ready.", i);
+                request_client_read(i);
+            }
+            fds[4+i].revents = 0;
+            n--;
+        }
+        /* Errors are reported by the write. */
+        if (fds[3].revents) {
+            log(3, "Pipe out writable.");
+            pipeout_flush();
+            fds[3].revents = 0;
+            n--;
+        }
+        n -= inventory_handle(fds + INVENTORY);
+        if (fds[2].revents & POLLIN) {
+            log(2, "Request accept.");
+            request_accept();
+            fds[2].revents = 0;
             n--;
         }
         if (fds[1].revents & POLLIN) {
             log(2, "Pipe fd ready.");
-            pipein_read();
+            if (sending.slot < 0)
+                pipein_read();
+            fds[1].revents = 0;
             n--;
         }
-        if (fds[2].revents & POLLIN) {
-            log(2, "Client fd ready.");
-            socket_client_read();
+        if (fds[0].revents & POLLIN) {
+            log(1, "WebSocket accept.");
+            socket_server_accept(server, VERSION);
+            fds[0].revents = 0;
             n--;
         }
 
         if (n > 0) { /* Some events were not handled, this is a problem */
-            error("Some poll events could not be handled: "
-                    "ret=%d (%d, %d, %d).",
-                    n, fds[0].revents, fds[1].revents, fds[2].revents);
+            for (i = 0; i < nfds; i++) {
+                if (fds[i].revents)
+                    error("Unhandled poll event: fd %d (%d).",
+                          fds[i].fd, fds[i].revents);
+            }
+            error("Some poll events could not be handled: ret=%d.", n);
             break;
         }
     }
 
     log(1, "Terminating...");
 
-    if (client_fd)
-        socket_client_close(1);
+    for (i = 0; i < nclients; i++)
+        socket_client_close(clients[i], 1);
 
     return 0;
 }
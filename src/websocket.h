@@ -10,23 +10,62 @@
  * Things that are supported, but not tested:
  *  - Fragmented packets from client
  *  - Ping packets
+ *
+ * Hot paths use trace() (see trace.h) instead of log(), so that tracing can
+ * be left on without affecting throughput.
+ *
+ * Writes to the client never block: whatever the socket cannot take right
+ * away is kept in a bounded output queue, flushed when the socket becomes
+ * writable (callers polling a client socket must add POLLOUT when
+ * socket_client_queued() is non-zero). Once the queue policy has merged or
+ * dropped what it could, a client that still overflows the queue is
+ * disconnected right away: a lagging client never stalls the others.
+ * Reads are bounded the same way: the handshake, and the rest of a frame once
+ * it has started, must come in within WS_IO_TIMEOUT, or the client is
+ * disconnected.
+ *
+ * Supports the permessage-deflate extension (RFC 7692), if the server enables
+ * it (see struct ws_server): messages whose first frame is at least
+ * deflate_threshold bytes long are compressed, compressed messages from the
+ * client are inflated one frame at a time, transparently for the callers.
+ *
+ * Also provides a metrics endpoint: counters are served in text format, one
+ * "<name> <value>" line per counter, on the abstract Unix socket
+ * @crouton-metrics-<port>. e.g.:
+ *     socat - ABSTRACT-CONNECT:crouton-metrics-30001
  */
 
 #define _GNU_SOURCE /* for ppoll */
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <zlib.h>
+#include "trace.h"
 
 const int BUFFERSIZE = 4096;
 
 /* WebSocket constants */
-const int FRAMEMAXHEADERSIZE = 16; // Actually 2+8, but align on 8-byte boundary
+const int FRAMEMAXHEADERSIZE = 10; /* 2 + 8 bytes extended length */
+/* Maximum number of payload buffers in socket_client_write_framev */
+#define WS_MAXIOV 8
 const int MAXFRAMESIZE = 16*1048576; // 16MiB
 const char* GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 /* Key from client must be 24 bytes long (16 bytes, base64 encoded) */
@@ -47,6 +86,7 @@ const int WS_OPCODE_PONG = 0xA;
 /* WebSocket bitmasks */
 const char WS_HEADER0_FIN = 0x80;  /* fin */
 const char WS_HEADER0_RSV = 0x70;  /* reserved */
+const char WS_HEADER0_RSV1 = 0x40;  /* compressed (permessage-deflate) */
 const char WS_HEADER0_OPCODE_MASK = 0x0F;  /* opcode */
 const char WS_HEADER1_MASK = 0x80;  /* mask */
 const char WS_HEADER1_LEN_MASK = 0x7F;  /* payload length */
@@ -76,21 +116,162 @@ static int verbose = 0;
 #define syserror(str, ...) printf("%s: " str " (%s)\n", \
                     __func__, ##__VA_ARGS__, strerror(errno))
 
-/* Port number, assigned in socket_server_init() */
+/* Port number of the first server, assigned in socket_server_init(), and
+ * used to name the metrics socket. */
 static int port = -1;
 
-/* File descriptors */
-static int server_fd = -1;
-static int client_fd = -1;
+/* Readahead buffer size: frame headers and small payloads are parsed from a
+ * single read. */
+#define READAHEAD_SIZE 4096
+
+/* Output queue: frames (or the end of a frame) that could not be written to
+ * a client socket yet. */
+#define OUTQ_MAXFRAMES 64
+#define OUTQ_MAXBYTES (1024*1024)
+
+/* Time given to a client to complete the handshake, or to send the rest of a
+ * frame once its first byte has arrived, in ms. The event loop waits in the
+ * meantime: a client that takes longer is disconnected. */
+const int WS_IO_TIMEOUT = 500;
+
+/* Default permessage-deflate threshold: smaller messages are not worth the
+ * compression overhead. */
+#define WS_DEFLATE_THRESHOLD 512
+
+struct outq_frame {
+    char* data;  /* Frame header, followed by the payload */
+    size_t len;
+    size_t hdrlen;
+    size_t pos;  /* Bytes already sent */
+    int compressed;  /* Part of a compressed message: cannot be dropped */
+};
+
+/* Queue policy: when a frame is queued behind others (the client is lagging
+ * behind), outq_policy is called for each queued frame that has not started
+ * going out, oldest first. queued and frame point to the payloads of the
+ * queued and of the new frame. The policy may modify the queued payload in
+ * place (without changing its length), e.g. to merge the new frame into it.
+ * Compressed frames are never passed to the policy. NULL keeps all frames. */
+#define OUTQ_KEEP 0  /* Keep both frames */
+#define OUTQ_DROP_QUEUED 1  /* The queued frame is stale: drop it */
+#define OUTQ_DROP_NEW 2  /* The new frame is not needed (e.g. merged) */
+static int (*outq_policy)(char* queued, size_t queuedlen,
+                          const char* frame, size_t framelen) = NULL;
+
+/* Client connection state */
+struct ws_client {
+    int fd;  /* -1 once the connection is closed */
+    /* Readahead buffer: valid data is readahead_buf[readahead_pos] to
+     * readahead_buf[readahead_len-1]. */
+    char readahead_buf[READAHEAD_SIZE];
+    int readahead_pos;
+    int readahead_len;
+    int corked;  /* TCP_CORK is set (see socket_client_cork) */
+    uint64_t read_deadline;  /* End of the current frame read (gettime_us) */
+    /* Output queue, oldest first */
+    struct outq_frame outq[OUTQ_MAXFRAMES];
+    int outq_head;  /* Index of the oldest frame */
+    int outq_count;
+    size_t outq_bytes;  /* Bytes left to send */
+    /* permessage-deflate state (if deflate is set) */
+    int deflate;  /* Extension negotiated */
+    int deflate_takeover;  /* Compression context kept across messages */
+    z_stream zout;  /* Compressor */
+    int zout_msg;  /* Message being written is compressed */
+    char* zout_buf;  /* Compressed payload of the frame being written */
+    size_t zout_size;
+    z_stream zin;  /* Decompressor */
+    int zin_msg;  /* Message being read is compressed */
+    /* Inflated payload of the frame being read: zin_buf[zin_pos] to
+     * zin_buf[zin_len-1] is left to read. */
+    char* zin_buf;
+    size_t zin_size;
+    size_t zin_pos;
+    size_t zin_len;
+    struct ws_server* server;  /* Server that accepted the connection */
+    void* data;  /* Server-specific state */
+};
+
+/* Listening socket. A process may listen on several ports (e.g. one per
+ * display), all served from the same event loop. */
+struct ws_server {
+    int fd;
+    int port;
+    /* When a new client connects, the oldest client of the same server is
+     * disconnected if there are already maxclients. */
+    int maxclients;
+    /* permessage-deflate settings, defaults set by socket_server_init */
+    int deflate;  /* Accept the extension when the client offers it */
+    int deflate_takeover;  /* Keep the compression context across messages */
+    size_t deflate_threshold;  /* Compress messages at least that long */
+    void* data;  /* Server-specific state */
+};
+
+/* Connected clients of all servers, oldest first. Closed clients stay in
+ * the array (with fd < 0) until socket_server_reap() is called, so that the
+ * main loop can keep using them until it is done with the current events. */
+#define WS_MAXCLIENTS 32
+static struct ws_client* clients[WS_MAXCLIENTS];
+static int nclients = 0;
+
+/* Called before a closed client is freed, to release server-specific state
+ * (e.g. c->data). */
+static void (*client_cleanup)(struct ws_client* c) = NULL;
 
 /* Prototypes */
-static int socket_client_write_frame(char* buffer, unsigned int size,
+static int socket_client_write_frame(struct ws_client* c,
+                                     char* buffer, unsigned int size,
                                      unsigned int opcode, int fin);
-static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
+static int socket_client_write_framev(struct ws_client* c,
+                                      const struct iovec* iov, int iovcnt,
+                                      unsigned int opcode, int fin, int more);
+static int socket_client_read_frame_header(struct ws_client* c,
+                                           int* fin, uint32_t* maskkey,
                                            int* length);
-static int socket_client_read_frame_data(char* buffer, unsigned int size,
+static int socket_client_read_frame_data(struct ws_client* c,
+                                         char* buffer, unsigned int size,
                                          uint32_t maskkey);
-static void socket_client_close(int close_reason);
+static void socket_client_close(struct ws_client* c, int close_reason);
+
+/**/
+/* Metrics */
+/**/
+
+/* A counter, exposed on the metrics socket. Counters may be updated from
+ * any thread, with metric_inc/metric_add. */
+struct metric {
+    const char* name;
+    uint64_t value;
+};
+
+#define metric_add(m, n) __atomic_add_fetch(&(m).value, (n), __ATOMIC_RELAXED)
+#define metric_inc(m) metric_add(m, 1)
+
+/* Counters common to all servers */
+static struct metric metric_connections = { "connections" };
+static struct metric metric_frames_in = { "frames_in" };
+static struct metric metric_frames_out = { "frames_out" };
+static struct metric metric_bytes_in = { "bytes_in" };
+static struct metric metric_bytes_out = { "bytes_out" };
+static struct metric metric_frames_queued = { "frames_queued" };
+static struct metric metric_frames_dropped = { "frames_dropped" };
+static struct metric metric_client_stalls = { "client_stalls" };
+static struct metric metric_popen2_spawns = { "popen2_spawns" };
+static struct metric metric_popen2_errors = { "popen2_errors" };
+static struct metric metric_popen2_us = { "popen2_us" };
+static struct metric metric_popen2_helper = { "popen2_helper" };
+
+static struct metric* metrics_common[] = {
+    &metric_connections, &metric_frames_in, &metric_frames_out,
+    &metric_bytes_in, &metric_bytes_out,
+    &metric_frames_queued, &metric_frames_dropped, &metric_client_stalls,
+    &metric_popen2_spawns, &metric_popen2_errors, &metric_popen2_us,
+    &metric_popen2_helper,
+    NULL
+};
+
+/* Server-specific counters (NULL-terminated), set in metrics_init() */
+static struct metric** metrics_server = NULL;
 
 /**/
 /* Helper functions */
@@ -104,7 +285,7 @@ static int block_read(int fd, char* buffer, size_t size) {
 
     while (tot < size) {
         n = read(fd, buffer + tot, size - tot);
-        log(3, "n=%d+%d/%zd", n, tot, size);
+        trace(3, "n=%d+%d/%zd", n, tot, size);
         if (n < 0)
             return n;
         if (n == 0)
@@ -123,7 +304,7 @@ static int block_write(int fd, char* buffer, size_t size) {
 
     while (tot < size) {
         n = write(fd, buffer + tot, size - tot);
-        log(3, "n=%d+%d/%zd", n, tot, size);
+        trace(3, "n=%d+%d/%zd", n, tot, size);
         if (n < 0)
             return n;
         if (n == 0)
@@ -134,64 +315,186 @@ static int block_write(int fd, char* buffer, size_t size) {
     return tot;
 }
 
-/* Run external command, piping some data on its stdin, and reading back
- * the output. Returns the number of bytes read from the process (at most
- * outlen), or a negative number on error (-exit status). */
-static int popen2(char* cmd, char *const argv[],
-                  char* input, int inlen, char* output, int outlen) {
-    pid_t pid = 0;
+/* Returns a monotonic time, in microseconds */
+static uint64_t gettime_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* popen2 timeout, in ms: the command is killed if it takes longer. */
+const int POPEN2_TIMEOUT = 10000;
+
+/* Maximum size of a coprocess request or reply */
+#define COPROCESS_MAXMSG 65536
+
+/* Environment variable set in the popen2 helper (see popen2_helper_start),
+ * to the pid of the server and the verbosity level. */
+#define POPEN2_HELPER_ENV "CROUTON_POPEN2_HELPER"
+
+/* Start cmd with argv, connecting its stdin/stdout to pipes, returned in
+ * in_fd (write end) and out_fd (read end, both non-blocking). envp is the
+ * environment of the command (NULL: same as ours).
+ * posix_spawn does not copy the page tables of the server, which may be
+ * large (XShm mappings). Returns the pid, or -1 on error. */
+static pid_t spawn_piped(char* cmd, char *const argv[], char *const envp[],
+                         int* in_fd, int* out_fd) {
     int stdin_fd[2];
     int stdout_fd[2];
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigmask;
+    pid_t pid;
+    int err;
 
-    if (pipe(stdin_fd) < 0 || pipe(stdout_fd) < 0) {
+    if (pipe2(stdin_fd, O_CLOEXEC) < 0) {
         syserror("Failed to create pipe.");
         return -1;
     }
+    if (pipe2(stdout_fd, O_CLOEXEC) < 0) {
+        syserror("Failed to create pipe.");
+        close(stdin_fd[0]);
+        close(stdin_fd[1]);
+        return -1;
+    }
 
-    log(3, "pipes: in %d/%d; out %d/%d",
-           stdin_fd[0], stdin_fd[1], stdout_fd[0], stdout_fd[1]);
+    trace(3, "pipes: in %d/%d; out %d/%d",
+          stdin_fd[0], stdin_fd[1], stdout_fd[0], stdout_fd[1]);
 
-    pid = fork();
+    /* All the pipes are close-on-exec: the child only gets the duplicates on
+     * stdin/stdout. */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdin_fd[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_fd[1], STDOUT_FILENO);
 
-    if (pid < 0) {
-        syserror("Fork error.");
-        return -1;
-    } else if (pid == 0) {
-        /* Child: connect stdin/out to the pipes, close the unneeded halves */
+    /* Do not pass on the signals that the servers block or ignore. */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigmask);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    sigaddset(&sigmask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigmask);
+    posix_spawnattr_setflags(&attr,
+                             POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    err = posix_spawnp(&pid, cmd, &actions, &attr, argv,
+                       envp ? envp : environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    /* Close uneeded halves (those are used by the child) */
+    close(stdin_fd[0]);
+    close(stdout_fd[1]);
+
+    if (err != 0) {
+        errno = err;
+        syserror("Error running '%s'.", cmd);
         close(stdin_fd[1]);
-        dup2(stdin_fd[0], STDIN_FILENO);
         close(stdout_fd[0]);
-        dup2(stdout_fd[1], STDOUT_FILENO);
+        return -1;
+    }
 
-        if (argv) {
-            execvp(cmd, argv);
-        } else {
-            execlp(cmd, cmd, NULL);
+    fcntl(stdin_fd[1], F_SETFL, O_NONBLOCK);
+    fcntl(stdout_fd[0], F_SETFL, O_NONBLOCK);
+    *in_fd = stdin_fd[1];
+    *out_fd = stdout_fd[0];
+    return pid;
+}
+
+/* Returns the poll timeout (ms) left before deadline (in gettime_us()
+ * time). */
+static int deadline_timeout(uint64_t deadline) {
+    uint64_t now = gettime_us();
+    return now < deadline ? (deadline - now + 999) / 1000 : 0;
+}
+
+/* Wait for process pid to exit, killing it if it is still running at
+ * deadline. Returns the status from waitpid, or -1 on error. */
+static int wait_deadline(pid_t pid, uint64_t deadline) {
+    int status = 0;
+    pid_t wait_pid;
+
+    while ((wait_pid = waitpid(pid, &status, WNOHANG)) == 0) {
+        if (deadline_timeout(deadline) == 0) {
+            error("Process %d timed out, killing it.", (int)pid);
+            kill(pid, SIGKILL);
+            wait_pid = waitpid(pid, &status, 0);
+            break;
         }
+        usleep(1000);
+    }
 
-        syserror("Error running '%s'.", cmd);
-        exit(127);
+    if (wait_pid != pid) {
+        syserror("waitpid error.");
+        return -1;
     }
+    return status;
+}
 
-    /* Parent */
+static int popen2_run(char* cmd, char *const argv[],
+                      char* input, int inlen, char* output, int outlen);
+static int popen2_helper_run(char* cmd, char *const argv[],
+                             char* output, int outlen, int* ret);
 
-    /* Close uneeded halves (those are used by the child) */
-    close(stdin_fd[0]);
-    close(stdout_fd[1]);
+/* Run external command, piping some data on its stdin, and reading back
+ * the output. Returns the number of bytes read from the process (at most
+ * outlen), or a negative number on error (-exit status). Commands that do
+ * not take any input go through the popen2 helper, if it is running. */
+static int popen2(char* cmd, char *const argv[],
+                  char* input, int inlen, char* output, int outlen) {
+    uint64_t start = gettime_us();
+    int ret;
+
+    if (inlen == 0 &&
+            popen2_helper_run(cmd, argv, output, outlen, &ret) == 0) {
+        metric_inc(metric_popen2_helper);
+    } else {
+        ret = popen2_run(cmd, argv, input, inlen, output, outlen);
+        metric_inc(metric_popen2_spawns);
+    }
 
-    /* Write input, and read output. We rely on POLLHUP getting set on stdout
-     * when the process exits (this assumes the process does not do anything
-     * strange like closing stdout and staying alive). */
+    metric_add(metric_popen2_us, gettime_us() - start);
+    if (ret < 0)
+        metric_inc(metric_popen2_errors);
+
+    return ret;
+}
+
+/* Implementation of popen2 */
+static int popen2_run(char* cmd, char *const argv[],
+                      char* input, int inlen, char* output, int outlen) {
+    char *const default_argv[] = { cmd, NULL };
+    uint64_t deadline = gettime_us() + POPEN2_TIMEOUT * 1000ULL;
+    int stdin_fd, stdout_fd;
+    pid_t pid;
+
+    pid = spawn_piped(cmd, argv ? argv : default_argv, NULL,
+                      &stdin_fd, &stdout_fd);
+    if (pid < 0)
+        return -1;
+
+    /* Write input, and read output, until the process closes stdout
+     * (normally when it exits). */
     struct pollfd fds[2];
     fds[0].events = POLLIN;
-    fds[0].fd = stdout_fd[0];
+    fds[0].fd = stdout_fd;
     fds[1].events = POLLOUT;
-    fds[1].fd = stdin_fd[1];
+    fds[1].fd = stdin_fd;
+
+    /* Nothing to write: the child may exit before we poll stdin. */
+    if (inlen == 0) {
+        close(stdin_fd);
+        stdin_fd = -1;
+        fds[1].fd = -1;
+    }
 
     int readlen = 0; /* Also acts as return value */
     int writelen = 0;
     while (1) {
-        int polln = poll(fds, 2, -1);
+        int polln = poll(fds, 2, deadline_timeout(deadline));
+
+        if (polln < 0 && errno == EINTR)
+            continue;
 
         if (polln < 0) {
             syserror("poll error.");
@@ -199,46 +502,68 @@ static int popen2(char* cmd, char *const argv[],
             break;
         }
 
-        log(3, "poll=%d", polln);
+        if (polln == 0) {
+            error("'%s' timed out.", cmd);
+            readlen = -1;
+            break;
+        }
+
+        trace(3, "poll=%d", polln);
 
         /* We can write something to stdin */
         if (fds[1].revents & POLLOUT) {
             if (inlen > writelen) {
-                int n = write(stdin_fd[1], input + writelen, inlen - writelen);
-                if (n < 0) {
+                int n = write(stdin_fd, input + writelen, inlen - writelen);
+                if (n < 0 && errno != EAGAIN && errno != EINTR) {
                     error("write error.");
                     readlen = -1;
                     break;
                 }
-                log(3, "write n=%d/%d", n, inlen);
-                writelen += n;
+                trace(3, "write n=%d/%d", n, inlen);
+                if (n > 0)
+                    writelen += n;
             }
 
             if (writelen == inlen) {
                 /* Done writing: Only poll stdout from now on. */
-                close(stdin_fd[1]);
-                stdin_fd[1] = -1;
+                close(stdin_fd);
+                stdin_fd = -1;
                 fds[1].fd = -1;
             }
             fds[1].revents &= ~POLLOUT;
         }
 
+        /* The child closed stdin: the write is incomplete (see below). */
+        if (fds[1].revents & POLLERR) {
+            close(stdin_fd);
+            stdin_fd = -1;
+            fds[1].fd = -1;
+            fds[1].revents &= ~POLLERR;
+        }
+
         if (fds[1].revents != 0) {
-            error("Unknown poll event on stdout (%d).", fds[1].revents);
+            error("Unknown poll event on stdin (%d).", fds[1].revents);
             readlen = -1;
             break;
         }
 
         /* We can read something from stdout */
-        if (fds[0].revents & POLLIN) {
-            int n = read(stdout_fd[0], output + readlen, outlen - readlen);
-            if (n < 0) {
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            int n = read(stdout_fd, output + readlen, outlen - readlen);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
                 error("read error.");
                 readlen = -1;
                 break;
             }
-            log(3, "read n=%d", n);
-            readlen += n;
+            trace(3, "read n=%d", n);
+
+            /* stdout has hung up (process terminated) */
+            if (n == 0) {
+                trace(3, "eof");
+                break;
+            }
+            if (n > 0)
+                readlen += n;
 
             if (verbose >= 3) {
                 fwrite(output, 1, readlen, stdout);
@@ -248,36 +573,30 @@ static int popen2(char* cmd, char *const argv[],
                 error("Output too long.");
                 break;
             }
-            fds[0].revents &= ~POLLIN;
+            fds[0].revents &= ~(POLLIN | POLLHUP);
         }
 
-        /* stdout has hung up (process terminated) */
-        if (fds[0].revents == POLLHUP) {
-            log(3, "pollhup");
-            break;
-        } else if (fds[0].revents != 0) {
-            error("Unknown poll event on stdin (%d).", fds[0].revents);
+        if (fds[0].revents != 0) {
+            error("Unknown poll event on stdout (%d).", fds[0].revents);
             readlen = -1;
             break;
         }
     }
 
-    if (stdin_fd[1] >= 0)
-        close(stdin_fd[1]);
+    if (stdin_fd >= 0)
+        close(stdin_fd);
     /* Closing the stdout pipe forces the child process to exit */
-    close(stdout_fd[0]);
+    close(stdout_fd);
 
-    /* Get child status (no timeout: we assume the child behaves well) */
-    int status = 0;
-    pid_t wait_pid = waitpid(pid, &status, 0);
+    /* Get child status: the process is killed if it is still running after
+     * the timeout. */
+    int status = wait_deadline(pid, readlen < 0 ? 0 : deadline);
 
-    if (wait_pid != pid) {
-        syserror("waitpid error.");
+    if (status < 0)
         return -1;
-    }
 
     if (WIFEXITED(status)) {
-        log(3, "child exited!");
+        trace(3, "child exited!");
         if (WEXITSTATUS(status) != 0) {
             error("child exited with status %d", WEXITSTATUS(status));
             return -WEXITSTATUS(status);
@@ -287,7 +606,7 @@ static int popen2(char* cmd, char *const argv[],
         return -1;
     }
 
-    if (writelen != inlen) {
+    if (readlen >= 0 && writelen != inlen) {
         error("Incomplete write.");
         return -1;
     }
@@ -295,74 +614,1039 @@ static int popen2(char* cmd, char *const argv[],
     return readlen;
 }
 
+/**/
+/* Coprocesses */
+/**/
+
+/* A coprocess is a long-lived helper that reads requests on its stdin, and
+ * writes one reply to each of them on its stdout, so that repeated calls do
+ * not pay for process creation. Requests and replies are framed the same
+ * way: a 32-bit length (host byte order), followed by the payload. */
+struct coprocess {
+    char* cmd;  /* Command, looked up in PATH */
+    char *const* argv;
+    char *const* envp;  /* Environment (NULL: same as ours) */
+    pid_t pid;  /* 0 if not running */
+    int in_fd;  /* Write end of the helper's stdin */
+    int out_fd;  /* Read end of the helper's stdout */
+};
+
+/* Stop the coprocess (it may be restarted by coprocess_request). */
+static void coprocess_stop(struct coprocess* cp) {
+    if (cp->pid <= 0)
+        return;
+
+    close(cp->in_fd);
+    close(cp->out_fd);
+    /* The helper exits on EOF: only kill it if it does not. */
+    wait_deadline(cp->pid, gettime_us() + 100000);
+    cp->pid = 0;
+}
+
+/* Start the coprocess. Returns 0 on success, -1 on error. */
+static int coprocess_start(struct coprocess* cp) {
+    pid_t pid;
+
+    coprocess_stop(cp);
+    pid = spawn_piped(cp->cmd, cp->argv, cp->envp,
+                      &cp->in_fd, &cp->out_fd);
+    if (pid < 0)
+        return -1;
+
+    log(2, "Started coprocess '%s' (%d).", cp->cmd, (int)pid);
+    cp->pid = pid;
+    return 0;
+}
+
+/* Read (or write, if out is non-zero) exactly len bytes on a non-blocking
+ * fd, before deadline. Returns 0 on success, -1 on error (errno is
+ * ETIMEDOUT on timeout). */
+static int deadline_io(int fd, char* buffer, int len, int out,
+                       uint64_t deadline) {
+    struct pollfd pfd = { fd, out ? POLLOUT : POLLIN, 0 };
+
+    while (len > 0) {
+        int n = out ? write(fd, buffer, len) : read(fd, buffer, len);
+        if (n > 0) {
+            buffer += n;
+            len -= n;
+            continue;
+        }
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            return -1;
+        if (poll(&pfd, 1, deadline_timeout(deadline)) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Send a request to the coprocess, and read back the reply, waiting at most
+ * timeout ms. The coprocess is (re)started as needed. A request is only
+ * retried (once) if the helper had died before getting any of it, so that
+ * it is never handled twice. Returns the length of the reply (at most
+ * outlen), or -1 on error. */
+static int coprocess_request(struct coprocess* cp, char* input, int inlen,
+                             char* output, int outlen, int timeout) {
+    uint64_t deadline = gettime_us() + timeout * 1000ULL;
+    uint32_t len = inlen;
+    int try;
+
+    /* Pipe writes of less than PIPE_BUF bytes are atomic: if the length
+     * cannot be written, none of it was. */
+    for (try = 0; ; try++) {
+        if (cp->pid <= 0 && coprocess_start(cp) < 0)
+            return -1;
+        if (deadline_io(cp->in_fd, (char*)&len, sizeof(len), 1,
+                        deadline) == 0)
+            break;
+        syserror("Coprocess '%s' failed.", cp->cmd);
+        coprocess_stop(cp);
+        if (errno != EPIPE || try > 0)
+            return -1;
+    }
+
+    if (deadline_io(cp->in_fd, input, inlen, 1, deadline) == 0 &&
+            deadline_io(cp->out_fd, (char*)&len, sizeof(len), 0,
+                        deadline) == 0) {
+        if (len > outlen) {
+            error("Reply too long (%u).", len);
+            coprocess_stop(cp);
+            return -1;
+        }
+        if (deadline_io(cp->out_fd, output, len, 0, deadline) == 0)
+            return len;
+    }
+
+    syserror("Coprocess '%s' failed.", cp->cmd);
+    coprocess_stop(cp);
+    return -1;
+}
+
+/* Coprocess side: serve requests from in_fd, writing the replies to out_fd,
+ * until in_fd is closed. handler is called with each request, and returns
+ * the length of the reply in output (at most outlen), or -1 to stop. */
+static void coprocess_serve(int in_fd, int out_fd,
+                            int (*handler)(char* input, int inlen,
+                                           char* output, int outlen)) {
+    static char request[COPROCESS_MAXMSG];
+    static char reply[COPROCESS_MAXMSG];
+    uint32_t len;
+    int n;
+
+    while (block_read(in_fd, (char*)&len, sizeof(len)) == sizeof(len)) {
+        if (len > sizeof(request)) {
+            error("Request too long (%u).", len);
+            return;
+        }
+        if (block_read(in_fd, request, len) != len)
+            return;
+        n = handler(request, len, reply, sizeof(reply));
+        if (n < 0)
+            return;
+        len = n;
+        if (block_write(out_fd, (char*)&len, sizeof(len)) != sizeof(len) ||
+                block_write(out_fd, reply, len) != len)
+            return;
+    }
+}
+
+/* popen2 helper: a copy of the server, started as a coprocess when the
+ * server starts, runs the commands on its behalf.
+ * Requests are the maximum output length (32-bit), followed by NUL-terminated
+ * strings: the value of DISPLAY (which the servers change at runtime), then
+ * argv. Replies are the return value of popen2_run (32-bit), followed by the
+ * output. */
+static struct coprocess popen2_helper = { NULL, NULL, NULL, 0, -1, -1 };
+
+/* Handle a request in the popen2 helper. */
+static int popen2_helper_handle(char* input, int inlen,
+                                char* output, int outlen) {
+    char* argv[64];
+    int argc = 0;
+    int pos = sizeof(int32_t);
+    int32_t ret, maxlen;
+
+    if (inlen <= pos || input[inlen-1] != '\0')
+        return -1;
+
+    memcpy(&maxlen, input, sizeof(maxlen));
+    if (maxlen < outlen - (int)sizeof(ret))
+        outlen = maxlen + sizeof(ret);
+
+    if (input[pos])
+        setenv("DISPLAY", input + pos, 1);
+    else
+        unsetenv("DISPLAY");
+
+    pos += strlen(input + pos) + 1;
+    while (pos < inlen && argc < 63) {
+        argv[argc++] = input + pos;
+        pos += strlen(input + pos) + 1;
+    }
+    argv[argc] = NULL;
+    if (argc == 0)
+        return -1;
+
+    ret = popen2_run(argv[0], argv, NULL, 0, output + sizeof(ret),
+                     outlen - sizeof(ret));
+    memcpy(output, &ret, sizeof(ret));
+    return sizeof(ret) + (ret > 0 ? ret : 0);
+}
+
+/* Run a command through the popen2 helper. Returns 0 and sets ret to the
+ * popen2 return value, or -1 if the helper cannot be used (it is disabled,
+ * or the command is too long). A helper that fails is restarted rather
+ * than bypassed, so that commands never run twice. */
+static int popen2_helper_run(char* cmd, char *const argv[],
+                             char* output, int outlen, int* ret) {
+    char *const default_argv[] = { cmd, NULL };
+    char request[BUFFERSIZE];
+    char reply[sizeof(int32_t) + outlen];
+    char* display = getenv("DISPLAY");
+    int32_t status = outlen;
+    int len = sizeof(status), i, n;
+
+    if (!popen2_helper.cmd)
+        return -1;
+
+    memcpy(request, &status, sizeof(status));
+    n = snprintf(request + len, sizeof(request) - len, "%s",
+                 display ? display : "");
+    len += n + 1;
+    if (!argv)
+        argv = default_argv;
+    for (i = 0; argv[i] && len < sizeof(request); i++) {
+        n = snprintf(request + len, sizeof(request) - len, "%s", argv[i]);
+        len += n + 1;
+    }
+    if (len > sizeof(request)) {
+        error("Command too long for the helper.");
+        return -1;
+    }
+
+    n = coprocess_request(&popen2_helper, request, len, reply, sizeof(reply),
+                          POPEN2_TIMEOUT + 1000);
+    if (n < (int)sizeof(status)) {
+        *ret = -1;
+        return 0;
+    }
+
+    memcpy(&status, reply, sizeof(status));
+    memcpy(output, reply + sizeof(status), n - sizeof(status));
+    *ret = status;
+    return 0;
+}
+
+/* Returns 1 if fd is a pipe. */
+static int is_pipe(int fd) {
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* Returns 1 if process pid runs the same executable as this process. */
+static int same_executable(pid_t pid) {
+    char path[32];
+    struct stat self, other;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", (int)pid);
+    return stat("/proc/self/exe", &self) == 0 && stat(path, &other) == 0 &&
+           self.st_dev == other.st_dev && self.st_ino == other.st_ino;
+}
+
+/* Call first thing in main(): if this process is the popen2 helper, serve
+ * requests on stdin/stdout, then exit.
+ * The server may be setuid root (croutonfbserver), while its environment is
+ * up to the user: POPEN2_HELPER_ENV is only trusted if it names our parent,
+ * and the parent runs the server's executable. */
+static void popen2_helper_main() {
+    char* helper = getenv(POPEN2_HELPER_ENV);
+    int ppid;
+
+    if (!helper)
+        return;
+
+    if (sscanf(helper, "%d:%d", &ppid, &verbose) != 2 ||
+            ppid != getppid() || !same_executable(ppid) ||
+            !is_pipe(STDIN_FILENO) || !is_pipe(STDOUT_FILENO)) {
+        error("Not started by the server, ignoring " POPEN2_HELPER_ENV ".");
+        verbose = 0;
+        unsetenv(POPEN2_HELPER_ENV);
+        return;
+    }
+
+    /* Keep the requests on other fds: logs go to stderr. */
+    int in_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    int out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    unsetenv(POPEN2_HELPER_ENV);
+    /* The server may go away while a command is running. */
+    signal(SIGPIPE, SIG_IGN);
+
+    coprocess_serve(in_fd, out_fd, popen2_helper_handle);
+    exit(0);
+}
+
+/* Start the popen2 helper. Should be called once options are parsed, before
+ * the server grows (mappings, X connections). On failure, popen2 spawns
+ * the commands itself. */
+static void popen2_helper_start() {
+    static char* argv[] = { NULL, NULL };
+    static char helper_env[64];
+    static char** envp;
+    int n = 0, i;
+
+    while (environ[n])
+        n++;
+    envp = malloc((n + 2) * sizeof(*envp));
+    trueorabort(envp, "malloc");
+    for (i = 0; i < n; i++)
+        envp[i] = environ[i];
+    snprintf(helper_env, sizeof(helper_env), POPEN2_HELPER_ENV "=%d:%d",
+             (int)getpid(), verbose);
+    envp[n] = helper_env;
+    envp[n+1] = NULL;
+
+    /* Writing to a helper that died must not kill the server. */
+    signal(SIGPIPE, SIG_IGN);
+
+    argv[0] = program_invocation_name;
+    popen2_helper.cmd = "/proc/self/exe";
+    popen2_helper.argv = argv;
+    popen2_helper.envp = envp;
+    if (coprocess_start(&popen2_helper) < 0) {
+        error("Cannot start popen2 helper, running commands directly.");
+        popen2_helper.cmd = NULL;
+    }
+}
+
+/* Rotates x left by n bits */
+#define SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32-(n))))
+
+/* Computes the SHA-1 digest (FIPS 180-4) of len bytes of data. */
+static void sha1(const char* data, size_t len, uint8_t digest[SHA1_LEN]) {
+    uint32_t h[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    uint8_t block[64];
+    uint32_t w[80];
+    size_t off = 0;
+    int i, last = 0;
+
+    while (!last) {
+        /* Fill block, adding padding (0x80, zeros, 64-bit bit length) after
+         * the data. The padding may spill over to an extra block. */
+        size_t n = len > off ? len - off : 0;
+        if (n >= 64) {
+            memcpy(block, data + off, 64);
+        } else {
+            memset(block, 0, 64);
+            memcpy(block, data + off, n);
+            if (off <= len)
+                block[n] = 0x80;
+            if (n < 56) {
+                uint64_t bits = (uint64_t)len * 8;
+                for (i = 0; i < 8; i++)
+                    block[63-i] = bits >> (8*i);
+                last = 1;
+            }
+        }
+        off += 64;
+
+        for (i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4*i] << 24 | block[4*i+1] << 16 |
+                   block[4*i+2] << 8 | block[4*i+3];
+        for (i = 16; i < 80; i++)
+            w[i] = SHA1_ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t tmp = SHA1_ROL(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = SHA1_ROL(b, 30);
+            b = a;
+            a = tmp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (i = 0; i < SHA1_LEN; i++)
+        digest[i] = h[i/4] >> (24 - 8*(i%4));
+}
+
+/* base64-encodes (RFC 4648, with padding) len bytes of data into out, which
+ * must be at least 4*ceil(len/3)+1 bytes long. Returns the output length. */
+static int base64_encode(const uint8_t* data, int len, char* out) {
+    const char* table =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, n = 0;
+
+    for (i = 0; i < len; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i+1 < len) v |= data[i+1] << 8;
+        if (i+2 < len) v |= data[i+2];
+        out[n++] = table[(v >> 18) & 0x3F];
+        out[n++] = table[(v >> 12) & 0x3F];
+        out[n++] = (i+1 < len) ? table[(v >> 6) & 0x3F] : '=';
+        out[n++] = (i+2 < len) ? table[v & 0x3F] : '=';
+    }
+    out[n] = '\0';
+
+    return n;
+}
+
+/* Unmasking: payloads from the client are XOR-ed with the 4-byte mask key,
+ * repeated (RFC section 5.3). ws_unmask works on buffers of any length and
+ * alignment. The default version uses 16-byte vectors (SSE2 on x86-64, NEON
+ * on ARM64, or whatever the compiler can do elsewhere); AVX2 (x86) and NEON
+ * (32-bit ARM builds without NEON) versions are selected at runtime. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#  if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)
+#    define WS_UNMASK_AVX2
+#  endif
+#elif defined(__arm__) && !defined(__ARM_NEON__) && __GNUC__ >= 6
+#  define WS_UNMASK_NEON
+#  include <sys/auxv.h>
+#  ifndef HWCAP_NEON
+#    define HWCAP_NEON (1 << 12)
+#  endif
+#endif
+
+typedef uint32_t ws_v16 __attribute__((vector_size(16)));
+typedef uint32_t ws_v32 __attribute__((vector_size(32)));
+
+/* Unmasks size bytes, 4 bytes at a time, then byte per byte. */
+static void ws_unmask_scalar(char* buffer, size_t size, uint32_t maskkey) {
+    const uint8_t* mask = (const uint8_t*)&maskkey;
+    size_t i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        uint32_t v;
+        memcpy(&v, buffer + i, 4);
+        v ^= maskkey;
+        memcpy(buffer + i, &v, 4);
+    }
+    for (; i < size; i++)
+        buffer[i] ^= mask[i % 4];
+}
+
+/* Unmasks as much of buffer as possible using vtype vectors, and the rest
+ * with ws_unmask_scalar. Vector sizes are multiples of 4, so the mask stays
+ * in phase. */
+#define WS_UNMASK_VECTOR(vtype, buffer, size, maskkey) do { \
+    vtype vmask; \
+    size_t i; \
+    for (i = 0; i < sizeof(vtype)/4; i++) \
+        vmask[i] = (maskkey); \
+    for (i = 0; i + sizeof(vtype) <= (size); i += sizeof(vtype)) { \
+        vtype v; \
+        memcpy(&v, (buffer) + i, sizeof(v)); \
+        v ^= vmask; \
+        memcpy((buffer) + i, &v, sizeof(v)); \
+    } \
+    ws_unmask_scalar((buffer) + i, (size) - i, (maskkey)); \
+} while (0)
+
+static void ws_unmask_vector(char* buffer, size_t size, uint32_t maskkey) {
+    WS_UNMASK_VECTOR(ws_v16, buffer, size, maskkey);
+}
+
+#ifdef WS_UNMASK_AVX2
+__attribute__((target("avx2")))
+static void ws_unmask_avx2(char* buffer, size_t size, uint32_t maskkey) {
+    WS_UNMASK_VECTOR(ws_v32, buffer, size, maskkey);
+}
+#endif
+
+#ifdef WS_UNMASK_NEON
+__attribute__((target("fpu=neon")))
+static void ws_unmask_neon(char* buffer, size_t size, uint32_t maskkey) {
+    WS_UNMASK_VECTOR(ws_v16, buffer, size, maskkey);
+}
+#endif
+
+/* Selected unmasking function, set on first use. */
+static void (*ws_unmask_impl)(char* buffer, size_t size, uint32_t maskkey);
+
+/* Unmasks size bytes of buffer, that start at the beginning of a frame
+ * payload, or at a multiple of 4 bytes from it. */
+static void ws_unmask(char* buffer, size_t size, uint32_t maskkey) {
+    if (!ws_unmask_impl) {
+        ws_unmask_impl = ws_unmask_vector;
+#ifdef WS_UNMASK_AVX2
+        if (__builtin_cpu_supports("avx2"))
+            ws_unmask_impl = ws_unmask_avx2;
+#endif
+#ifdef WS_UNMASK_NEON
+        if (getauxval(AT_HWCAP) & HWCAP_NEON)
+            ws_unmask_impl = ws_unmask_neon;
+#endif
+    }
+
+    ws_unmask_impl(buffer, size, maskkey);
+}
+
 /**/
 /* Websocket functions. */
 /**/
 
+/* Returns the number of bytes that were read from the client socket, but
+ * not consumed yet. Callers must check this before polling c->fd. */
+static int socket_client_pending(struct ws_client* c) {
+    return c->readahead_len - c->readahead_pos;
+}
+
+/* Returns the number of bytes waiting in the output queue. */
+static int socket_client_queued(struct ws_client* c) {
+    return c->outq_bytes;
+}
+
+/* Frees the oldest frame in the output queue. */
+static void outq_pop(struct ws_client* c) {
+    struct outq_frame* f = &c->outq[c->outq_head];
+
+    c->outq_bytes -= f->len - f->pos;
+    free(f->data);
+    f->data = NULL;
+    c->outq_head = (c->outq_head + 1) % OUTQ_MAXFRAMES;
+    c->outq_count--;
+}
+
+/* Sends as much of the output queue as the client socket takes without
+ * blocking, gathering up to WS_MAXIOV frames per call.
+ * Returns 0 if the queue is empty, 1 if data is left in the queue. On error,
+ * closes the socket, and returns -1. */
+static int socket_client_flush(struct ws_client* c) {
+    while (c->outq_count > 0) {
+        struct iovec vec[WS_MAXIOV];
+        struct msghdr msg;
+        int i;
+
+        memset(&msg, 0, sizeof(msg));
+        for (i = 0; i < c->outq_count && i < WS_MAXIOV; i++) {
+            struct outq_frame* f =
+                &c->outq[(c->outq_head + i) % OUTQ_MAXFRAMES];
+            vec[i].iov_base = f->data + f->pos;
+            vec[i].iov_len = f->len - f->pos;
+        }
+        msg.msg_iov = vec;
+        msg.msg_iovlen = i;
+
+        int n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        trace(3, "n=%d/%d (%d frames)", n, c->outq_bytes, c->outq_count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (n <= 0) {
+            syserror("Write error.");
+            socket_client_close(c, 0);
+            return -1;
+        }
+
+        while (n > 0) {
+            struct outq_frame* f = &c->outq[c->outq_head];
+            int w = (n < f->len - f->pos) ? n : f->len - f->pos;
+            f->pos += w;
+            c->outq_bytes -= w;
+            n -= w;
+            if (f->pos == f->len)
+                outq_pop(c);
+        }
+    }
+
+    return 0;
+}
+
+/* Waits until events (e.g. POLLIN) are set on the client socket. The output
+ * queue is flushed in the meantime. timeout is in ms (-1: no timeout).
+ * Returns 0 on success, -1 on timeout or error. */
+static int socket_client_wait(struct ws_client* c, int events, int timeout) {
+    uint64_t deadline = gettime_us() + (uint64_t)timeout*1000;
+    struct pollfd fds[1];
+
+    while (c->fd >= 0) {
+        fds[0].fd = c->fd;
+        fds[0].events = events | (c->outq_count > 0 ? POLLOUT : 0);
+
+        int wait = -1;
+        if (timeout >= 0) {
+            uint64_t now = gettime_us();
+            if (now >= deadline)
+                return -1;
+            wait = (deadline - now + 999) / 1000;
+        }
+
+        int n = poll(fds, 1, wait);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            syserror("poll error.");
+            return -1;
+        }
+
+        if (fds[0].revents & POLLOUT) {
+            if (socket_client_flush(c) < 0)
+                return -1;
+        }
+        /* Errors and hang ups are reported by the next read or write. */
+        if (fds[0].revents & (events | POLLERR | POLLHUP))
+            return 0;
+    }
+
+    return -1;
+}
+
+/* Read exactly size bytes from the client socket, through the readahead
+ * buffer. Large reads go directly to buffer, once the readahead buffer is
+ * empty. The output queue is flushed while waiting for data, until
+ * c->read_deadline.
+ * Returns size if successful, < 0 in case of error or timeout. */
+static int socket_client_read_block(struct ws_client* c,
+                                    char* buffer, size_t size) {
+    size_t tot = 0;
+
+    while (tot < size) {
+        int avail = c->readahead_len - c->readahead_pos;
+        if (avail > 0) {
+            int n = (avail < size - tot) ? avail : size - tot;
+            memcpy(buffer + tot, c->readahead_buf + c->readahead_pos, n);
+            c->readahead_pos += n;
+            tot += n;
+            continue;
+        }
+
+        int n;
+        if (size - tot >= READAHEAD_SIZE) {
+            n = recv(c->fd, buffer + tot, size - tot, MSG_DONTWAIT);
+            if (n > 0)
+                tot += n;
+        } else {
+            n = recv(c->fd, c->readahead_buf, READAHEAD_SIZE, MSG_DONTWAIT);
+            c->readahead_pos = 0;
+            c->readahead_len = n > 0 ? n : 0;
+        }
+        trace(3, "readahead n=%d", n);
+        if (n > 0)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                       errno != EINTR))
+            return -1;
+
+        /* Never wait for long: the other clients are waiting too. The client
+         * may also wait for queued replies before sending more. */
+        int timeout = deadline_timeout(c->read_deadline);
+        if (timeout == 0 || socket_client_wait(c, POLLIN, timeout) < 0) {
+            if (c->fd >= 0)
+                error("Client timed out.");
+            return -1;
+        }
+        if (c->fd < 0)
+            return -1;
+    }
+
+    return tot;
+}
+
 /* Close the client socket, sending a close packet if sendclose is true. */
-static void socket_client_close(int sendclose) {
-    if (client_fd < 0)
+static void socket_client_close(struct ws_client* c, int sendclose) {
+    if (c->fd < 0)
         return;
 
-    if (sendclose) {
-        char buffer[FRAMEMAXHEADERSIZE];
-        socket_client_write_frame(buffer, 0, WS_OPCODE_CLOSE, 1);
+    /* Best effort: a client that lags behind does not get a close frame. */
+    if (sendclose && socket_client_flush(c) == 0) {
+        socket_client_write_frame(c, NULL, 0, WS_OPCODE_CLOSE, 1);
         /* FIXME: We are supposed to read back the answer (if we are not
          * replying to a close frame sent by the client), but we probably do not
          * want to block, waiting for the answer, so we just close the socket.
          */
     }
 
-    close(client_fd);
-    client_fd = -1;
+    if (c->fd < 0)  /* Closed by a write error */
+        return;
+
+    close(c->fd);
+    c->fd = -1;
+    c->readahead_pos = c->readahead_len = 0;
+    c->corked = 0;
+    while (c->outq_count > 0)
+        outq_pop(c);
+
+    if (c->deflate) {
+        deflateEnd(&c->zout);
+        inflateEnd(&c->zin);
+        free(c->zout_buf);
+        free(c->zin_buf);
+        c->zout_buf = c->zin_buf = NULL;
+        c->zout_size = c->zin_size = 0;
+        c->zin_pos = c->zin_len = 0;
+        c->zout_msg = c->zin_msg = 0;
+        c->deflate = 0;
+    }
+}
+
+/* Corks (cork=1) or uncorks (cork=0) the client socket. While the socket is
+ * corked, frames are coalesced into full TCP packets; uncorking sends
+ * whatever is left. Use this when several replies are about to be sent in a
+ * row. */
+static void socket_client_cork(struct ws_client* c, int cork) {
+    if (c->fd < 0 || cork == c->corked)
+        return;
+
+    trace(3, "cork=%d", cork);
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK,
+                   &cork, sizeof(cork)) < 0) {
+        syserror("Cannot set TCP_CORK.");
+        return;
+    }
+    c->corked = cork;
+}
+
+/* Returns non-zero if the output queue can take len more bytes. */
+static int outq_room(struct ws_client* c, size_t len) {
+    return c->outq_count == 0 ||
+           (c->outq_count < OUTQ_MAXFRAMES &&
+            c->outq_bytes + len <= OUTQ_MAXBYTES);
+}
+
+/* Queues the part of a frame that could not be sent (from offset sent),
+ * applying outq_policy. Never waits: if the queue is still full once the
+ * socket has taken what it can, the client is disconnected.
+ * Returns 0 on success. On error, closes the socket, and returns -1. */
+static int outq_push(struct ws_client* c,
+                     const struct iovec* vec, int iovcnt, size_t sent) {
+    struct outq_frame f;
+    int i;
+
+    f.len = 0;
+    for (i = 0; i < iovcnt; i++)
+        f.len += vec[i].iov_len;
+    f.hdrlen = vec[0].iov_len;
+    f.pos = sent;
+    f.compressed = c->zout_msg;
+    f.data = malloc(f.len);
+    trueorabort(f.data, "Cannot allocate queued frame");
+
+    size_t off = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(f.data + off, vec[i].iov_base, vec[i].iov_len);
+        off += vec[i].iov_len;
+    }
+
+    /* Only frames that have not started going out can be dropped. */
+    for (i = 0; outq_policy && sent == 0 && !f.compressed &&
+                i < c->outq_count; i++) {
+        struct outq_frame* q = &c->outq[(c->outq_head + i) % OUTQ_MAXFRAMES];
+        if (q->pos > 0 || q->compressed)
+            continue;
+
+        int action = outq_policy(q->data + q->hdrlen, q->len - q->hdrlen,
+                                 f.data + f.hdrlen, f.len - f.hdrlen);
+        if (action == OUTQ_DROP_NEW) {
+            trace(2, "dropped new frame (%d bytes)", f.len);
+            metric_inc(metric_frames_dropped);
+            free(f.data);
+            return 0;
+        } else if (action == OUTQ_DROP_QUEUED) {
+            trace(2, "dropped queued frame %d (%d bytes)", i, q->len);
+            metric_inc(metric_frames_dropped);
+            /* Shift newer frames down. */
+            int j;
+            c->outq_bytes -= q->len;
+            free(q->data);
+            for (j = i; j < c->outq_count-1; j++)
+                c->outq[(c->outq_head + j) % OUTQ_MAXFRAMES] =
+                    c->outq[(c->outq_head + j + 1) % OUTQ_MAXFRAMES];
+            c->outq_count--;
+            i--;
+        }
+    }
+
+    if (!outq_room(c, f.len - f.pos))
+        socket_client_flush(c);
+    if (c->fd < 0 || !outq_room(c, f.len - f.pos)) {
+        free(f.data);
+        if (c->fd >= 0) {
+            error("Client is lagging behind, closing connection.");
+            metric_inc(metric_client_stalls);
+            socket_client_close(c, 0);
+        }
+        return -1;
+    }
+
+    c->outq[(c->outq_head + c->outq_count) % OUTQ_MAXFRAMES] = f;
+    c->outq_count++;
+    c->outq_bytes += f.len - f.pos;
+    metric_inc(metric_frames_queued);
+    trace(3, "queued %d bytes (%d frames)", f.len - f.pos, c->outq_count);
+
+    return 0;
 }
 
-/* Send a frame to the WebSocket client.
- *  - buffer needs to be FRAMEMAXHEADERSIZE+size long, and data must start at
- *    buffer[FRAMEMAXHEADERSIZE] only.
+/* Compresses a frame payload (permessage-deflate) into c->zout_buf. If fin is
+ * set, the message is flushed, and the trailing 00 00 ff ff is removed (RFC
+ * 7692 section 7.2.1). Returns the compressed length. */
+static size_t socket_client_deflate(struct ws_client* c,
+                                    const struct iovec* iov, int iovcnt,
+                                    int fin) {
+    size_t len = 0;
+    int i;
+
+    /* One extra pass, without input, to flush the message. */
+    for (i = 0; i < iovcnt || (fin && i == iovcnt); i++) {
+        c->zout.next_in = i < iovcnt ? (Bytef*)iov[i].iov_base : Z_NULL;
+        c->zout.avail_in = i < iovcnt ? iov[i].iov_len : 0;
+        int flush = i < iovcnt ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+
+        do {
+            if (len == c->zout_size) {
+                c->zout_size = c->zout_size ? 2*c->zout_size : BUFFERSIZE;
+                c->zout_buf = realloc(c->zout_buf, c->zout_size);
+                trueorabort(c->zout_buf, "Cannot allocate deflate buffer");
+            }
+            c->zout.next_out = (Bytef*)c->zout_buf + len;
+            c->zout.avail_out = c->zout_size - len;
+            /* Z_BUF_ERROR only means that no progress was possible. */
+            int ret = deflate(&c->zout, flush);
+            trueorabort(ret == Z_OK || ret == Z_BUF_ERROR,
+                        "deflate error (%d)", ret);
+            len = c->zout_size - c->zout.avail_out;
+        } while (c->zout.avail_out == 0);
+    }
+
+    if (fin) {
+        trueorabort(len >= 4 && !memcmp(c->zout_buf + len - 4,
+                                        "\x00\x00\xff\xff", 4),
+                    "Invalid deflate flush");
+        len -= 4;
+        if (!c->deflate_takeover)
+            deflateReset(&c->zout);
+    }
+
+    return len;
+}
+
+/* Send a frame to the WebSocket client, gathering the payload from iovcnt
+ * (at most WS_MAXIOV) buffers. The payload is not copied, unless the frame
+ * needs to be queued.
  *  - opcode should generally be WS_OPCODE_TEXT or WS_OPCODE_CONT (continuation)
  *  - fin indicates if the this is the last frame in the message
- * Returns size on success. On error, closes the socket, and returns -1.
+ *  - more indicates that more frames follow right away: the kernel may hold
+ *    this one back to coalesce them (MSG_MORE).
+ * If permessage-deflate is in use, the first frame of a message decides if
+ * the whole message is compressed (see deflate_threshold).
+ * Returns payload size (before compression) on success (the frame may still
+ * be queued). On error, closes the socket, and returns -1.
  */
-static int socket_client_write_frame(char* buffer, unsigned int size,
-                                     unsigned int opcode, int fin) {
-    /* Start of frame, with header: at least 2 bytes before the actual data */
-    char* pbuffer = buffer + FRAMEMAXHEADERSIZE - 2;
-    int payloadlen = size;
+static int socket_client_write_framev(struct ws_client* c,
+                                      const struct iovec* iov, int iovcnt,
+                                      unsigned int opcode, int fin, int more) {
+    char header[FRAMEMAXHEADERSIZE];
+    struct iovec vec[WS_MAXIOV+1];
+    uint64_t msgsize = 0;  /* Payload size, before compression */
     int extlensize = 0;
+    int i;
+
+    trueorabort(iovcnt <= WS_MAXIOV, "Too many buffers (%d)", iovcnt);
+    if (c->fd < 0)
+        return -1;
+
+    for (i = 0; i < iovcnt; i++) {
+        vec[i+1] = iov[i];
+        msgsize += iov[i].iov_len;
+    }
+
+    header[0] = opcode & WS_HEADER0_OPCODE_MASK;
+    if (fin) header[0] |= WS_HEADER0_FIN;
+
+    /* Control frames (which may come in the middle of a message) are never
+     * compressed. */
+    int data = opcode < WS_OPCODE_CLOSE;
+    if (c->deflate && data && opcode != WS_OPCODE_CONT) {
+        c->zout_msg = msgsize >= c->server->deflate_threshold;
+        if (c->zout_msg)
+            header[0] |= WS_HEADER0_RSV1;
+    }
+    if (c->zout_msg && data) {
+        vec[1].iov_len = socket_client_deflate(c, iov, iovcnt, fin);
+        vec[1].iov_base = c->zout_buf;
+        iovcnt = 1;
+    }
+
+    uint64_t size = 0;
+    for (i = 0; i < iovcnt; i++)
+        size += vec[i+1].iov_len;
+
+    /* No mask (0x80) in server->client direction */
+    header[1] = size;
 
     /* Test if we need an extended length field. */
-    if (payloadlen > 125) {
-        if (payloadlen < 65536) {
-            payloadlen = 126;
+    if (size > 125) {
+        if (size < 65536) {
+            header[1] = 126;
             extlensize = 2;
         } else {
-            payloadlen = 127;
+            header[1] = 127;
             extlensize = 8;
         }
-        pbuffer -= extlensize;
 
         /* Network-order (big-endian) */
-        unsigned int tmpsize = size;
-        int i;
+        uint64_t tmpsize = size;
         for (i = extlensize-1; i >= 0; i--) {
-            pbuffer[2+i] = tmpsize & 0xff;
+            header[2+i] = tmpsize & 0xff;
             tmpsize >>= 8;
         }
     }
 
-    pbuffer[0] = opcode & WS_HEADER0_OPCODE_MASK;
-    if (fin) pbuffer[0] |= WS_HEADER0_FIN;
-    pbuffer[1] = payloadlen;  /* No mask (0x80) in server->client direction */
+    vec[0].iov_base = header;
+    vec[0].iov_len = 2 + extlensize;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iovcnt+1;
+
+    uint64_t wlen = 2 + extlensize + size;
+    int n = 0;
 
-    int wlen = 2 + extlensize + size;
-    if (block_write(client_fd, pbuffer, wlen) != wlen) {
-        syserror("Write error.");
-        socket_client_close(0);
+    /* Frames must go out in order: only write directly if the queue is
+     * empty (or can be emptied right away). */
+    if (socket_client_flush(c) < 0)
         return -1;
+
+    while (c->outq_count == 0) {
+        n = sendmsg(c->fd, &msg,
+                    MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+        trace(3, "n=%d/%d", n, wlen);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            n = 0;
+        if (n < 0) {
+            syserror("Write error.");
+            socket_client_close(c, 0);
+            return -1;
+        }
+        break;
     }
 
-    return size;
+    int ret = 0;
+    if (n < wlen)
+        ret = outq_push(c, vec, iovcnt+1, n);
+
+    if (fin && data)
+        c->zout_msg = 0;
+    if (ret < 0)
+        return -1;
+
+    metric_inc(metric_frames_out);
+    metric_add(metric_bytes_out, wlen);
+
+    return msgsize;
+}
+
+/* Send a frame to the WebSocket client, with size bytes of payload from
+ * buffer (see socket_client_write_framev).
+ * Returns size on success. On error, closes the socket, and returns -1.
+ */
+static int socket_client_write_frame(struct ws_client* c,
+                                     char* buffer, unsigned int size,
+                                     unsigned int opcode, int fin) {
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    return socket_client_write_framev(c, &iov, 1, opcode, fin, 0);
+}
+
+/* Reads the payload of a compressed frame (length bytes, masked with
+ * maskkey), and inflates it into c->zin_buf. fin indicates that this is the
+ * last frame of the message.
+ * Returns the inflated length on success, -1 on error. */
+static int socket_client_inflate(struct ws_client* c, uint64_t length,
+                                 uint32_t maskkey, int fin) {
+    char* raw = malloc(length + 4);
+    int ret = Z_OK;
+
+    trueorabort(raw, "Cannot allocate compressed frame");
+    if (socket_client_read_block(c, raw, length) != length) {
+        error("Read error.");
+        free(raw);
+        return -1;
+    }
+    ws_unmask(raw, length, maskkey);
+
+    /* Add back the end of the flush (RFC 7692 section 7.2.2) */
+    if (fin) {
+        memcpy(raw + length, "\x00\x00\xff\xff", 4);
+        length += 4;
+    }
+
+    c->zin.next_in = (Bytef*)raw;
+    c->zin.avail_in = length;
+    c->zin_pos = c->zin_len = 0;
+
+    while (c->zin.avail_in > 0 || c->zin_len == c->zin_size) {
+        if (c->zin_len == c->zin_size) {
+            /* Inflated frames are subject to the same limit as others. */
+            if (c->zin_size >= MAXFRAMESIZE) {
+                error("Inflated frame too big (>%d).", MAXFRAMESIZE);
+                ret = Z_BUF_ERROR;
+                break;
+            }
+            c->zin_size = c->zin_size ? 2*c->zin_size : BUFFERSIZE;
+            c->zin_buf = realloc(c->zin_buf, c->zin_size);
+            trueorabort(c->zin_buf, "Cannot allocate inflate buffer");
+        }
+        c->zin.next_out = (Bytef*)c->zin_buf + c->zin_len;
+        c->zin.avail_out = c->zin_size - c->zin_len;
+        ret = inflate(&c->zin, Z_SYNC_FLUSH);
+        c->zin_len = c->zin_size - c->zin.avail_out;
+        if (ret == Z_STREAM_END) {
+            /* The client ended the deflate stream (BFINAL): the next
+             * message starts a new one. */
+            inflateReset(&c->zin);
+            ret = Z_OK;
+        } else if (ret == Z_BUF_ERROR && c->zin.avail_in == 0) {
+            /* No more output. */
+            ret = Z_OK;
+            break;
+        } else if (ret != Z_OK) {
+            error("inflate error (%d).", ret);
+            break;
+        }
+    }
+
+    free(raw);
+    if (ret != Z_OK) {
+        c->zin_len = 0;
+        return -1;
+    }
+    trace(3, "inflated %d bytes to %d", (int)length, (int)c->zin_len);
+    return c->zin_len;
 }
 
 /* Read a WebSocket frame header:
@@ -372,34 +1656,46 @@ static int socket_client_write_frame(char* buffer, unsigned int size,
  *    again if it expects more data.
  *
  * Returns the frame length on success. On error, closes the socket,
- * and returns -1.
+ * and returns -1. Compressed frames (permessage-deflate) are read and
+ * inflated right away: the inflated length is returned.
  *
  * Data is then read with socket_client_read_frame_data()
  */
-static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
+static int socket_client_read_frame_header(struct ws_client* c,
+                                           int* fin, uint32_t* maskkey,
                                            int* retry) {
     char header[2]; /* Minimum header length */
     char extlen[8]; /* Extended length */
     int n;
 
     *retry = 0;
+    c->read_deadline = gettime_us() + WS_IO_TIMEOUT * 1000ULL;
 
-    n = block_read(client_fd, header, 2);
+    n = socket_client_read_block(c, header, 2);
     if (n != 2) {
         error("Read error.");
-        socket_client_close(0);
+        socket_client_close(c, 0);
         return -1;
     }
 
     int opcode, mask;
     uint64_t length;
     *fin = (header[0] & WS_HEADER0_FIN) != 0;
-    if (header[0] & WS_HEADER0_RSV) {
+    opcode = header[0] & WS_HEADER0_OPCODE_MASK;
+    /* RSV1 marks the first frame of a compressed message. */
+    int rsv = header[0] & WS_HEADER0_RSV;
+    if (c->deflate &&
+            (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_BINARY)) {
+        c->zin_msg = (rsv & WS_HEADER0_RSV1) != 0;
+        rsv &= ~WS_HEADER0_RSV1;
+    }
+    if (rsv) {
         error("Reserved bits are on.");
-        socket_client_close(1);
+        socket_client_close(c, 1);
         return -1;
     }
-    opcode = header[0] & WS_HEADER0_OPCODE_MASK;
+    /* Inflated data of the previous frame, if any, was not wanted. */
+    c->zin_pos = c->zin_len = 0;
     mask = (header[1] & WS_HEADER1_MASK) != 0;
     length = header[1] & WS_HEADER1_LEN_MASK;
 
@@ -414,10 +1710,10 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
         extlensize = 8;
 
     if (extlensize > 0) {
-        n = block_read(client_fd, extlen, extlensize);
+        n = socket_client_read_block(c, extlen, extlensize);
         if (n != extlensize) {
             error("Read error.");
-            socket_client_close(0);
+            socket_client_close(c, 0);
             return -1;
         }
 
@@ -428,31 +1724,34 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
             length = length << 8 | (uint8_t)extlen[i];
         }
 
-        log(3, "extended length=%llu", (long long unsigned int)length);
+        trace(3, "extended length=%llu", length);
     }
 
     /* Read masking key if necessary */
     if (mask) {
-        n = block_read(client_fd, (char*)maskkey, 4);
+        n = socket_client_read_block(c, (char*)maskkey, 4);
         if (n != 4) {
             error("Read error.");
-            socket_client_close(0);
+            socket_client_close(c, 0);
             return -1;
         }
     } else {
         /* RFC section 5.1 says we must close the connection if we receive a
          * frame that is not masked. */
         error("No mask set.");
-        socket_client_close(1);
+        socket_client_close(c, 1);
         return -1;
     }
 
-    log(3, "maskkey=%04x", *maskkey);
+    trace(3, "maskkey=%04x", *maskkey);
+
+    metric_inc(metric_frames_in);
+    metric_add(metric_bytes_in, length);
 
     if (length > MAXFRAMESIZE) {
         error("Frame too big! (%llu>%d)\n",
                 (long long unsigned int)length, MAXFRAMESIZE);
-        socket_client_close(1);
+        socket_client_close(c, 1);
         return -1;
     }
 
@@ -467,30 +1766,30 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
          * Unknown data (opcodes 3-7) will result in error anyway. */
         if (*fin == 0) {
             error("Fragmented unknown packet (%x).", opcode);
-            socket_client_close(1);
+            socket_client_close(c, 1);
             return -1;
         }
 
         /* Read the rest of the packet */
-        char* buffer = malloc(length+3); /* +3 for unmasking safety */
-        if (socket_client_read_frame_data(buffer, length, *maskkey) < 0) {
-            socket_client_close(0);
+        char* buffer = malloc(length);
+        if (socket_client_read_frame_data(c, buffer, length, *maskkey) < 0) {
+            socket_client_close(c, 0);
             free(buffer);
             return -1;
         }
 
         if (opcode == WS_OPCODE_CLOSE) {  /* Connection close. */
             error("Connection close from WebSocket client.");
-            socket_client_close(1);
+            socket_client_close(c, 1);
             free(buffer);
             return -1;
         } else if (opcode == WS_OPCODE_PING) {  /* Ping */
-            socket_client_write_frame(buffer, length, WS_OPCODE_PONG, 1);
+            socket_client_write_frame(c, buffer, length, WS_OPCODE_PONG, 1);
         } else if (opcode == WS_OPCODE_PONG) {  /* Pong */
             /* Do nothing */
         } else {  /* Unknown opcode */
             error("Unknown packet (%x).", opcode);
-            socket_client_close(1);
+            socket_client_close(c, 1);
             free(buffer);
             return -1;
         }
@@ -503,43 +1802,60 @@ static int socket_client_read_frame_header(int* fin, uint32_t* maskkey,
         return 0;
     }
 
+    if (c->zin_msg) {
+        int n = socket_client_inflate(c, length, *maskkey, *fin);
+        if (*fin)
+            c->zin_msg = 0;
+        if (n < 0) {
+            socket_client_close(c, 1);
+            return -1;
+        }
+        return n;
+    }
+
     return length;
 }
 
 /* Read frame data from the WebSocket client:
- * - Make sure that buffer is at least 4*ceil(size/4) long, as unmasking works
- *   on blocks of 4 bytes.
+ * - If a frame is read in several parts, all but the last must be a multiple
+ *   of 4 bytes long, so that the mask stays in phase.
  * Returns size on success (the buffer has been completely filled).
  * On error, closes the socket, and returns -1.
  */
-static int socket_client_read_frame_data(char* buffer, unsigned int size,
+static int socket_client_read_frame_data(struct ws_client* c,
+                                         char* buffer, unsigned int size,
                                          uint32_t maskkey) {
-    int n = block_read(client_fd, buffer, size);
+    /* Inflated frame */
+    if (c->zin_len > 0) {
+        trueorabort(size <= c->zin_len - c->zin_pos,
+                    "Read past the end of the frame");
+        memcpy(buffer, c->zin_buf + c->zin_pos, size);
+        c->zin_pos += size;
+        if (c->zin_pos == c->zin_len)
+            c->zin_pos = c->zin_len = 0;
+        return size;
+    }
+
+    int n = socket_client_read_block(c, buffer, size);
     if (n != size) {
         error("Read error.");
-        socket_client_close(0);
+        socket_client_close(c, 0);
         return -1;
     }
 
-    if (maskkey != 0) {
-        int i;
-        int len32 = (size+3)/4;
-        uint32_t* buffer32 = (uint32_t*)buffer;
-        for (i = 0; i < len32; i++) {
-            buffer32[i] ^= maskkey;
-        }
-    }
+    if (maskkey != 0)
+        ws_unmask(buffer, size, maskkey);
 
     return n;
 }
 
-/* Read a complete frame from the WebSocket client:
- * - Make sure that buffer size is a multiple of 4 (for unmasking).
+/* Read a complete frame from the WebSocket client.
  * Returns packet size on success.
  * On error (e.g. packet too large for buffer), closes the socket, and
  * returns -1.
  */
-static int socket_client_read_frame(char* buffer, int size) {
+static int socket_client_read_frame(struct ws_client* c,
+                                    char* buffer, int size) {
     int buflen = 0;
     int fin = 0;
     uint32_t maskkey;
@@ -547,7 +1863,7 @@ static int socket_client_read_frame(char* buffer, int size) {
 
     /* Read possibly fragmented message from WebSocket. */
     while (fin != 1) {
-        int len = socket_client_read_frame_header(&fin, &maskkey, &retry);
+        int len = socket_client_read_frame_header(c, &fin, &maskkey, &retry);
 
         if (retry)
             continue;
@@ -557,12 +1873,13 @@ static int socket_client_read_frame(char* buffer, int size) {
 
         if (len+buflen > size) {
             error("Response too long: (>%d bytes).", size);
-            socket_client_close(1);
+            socket_client_close(c, 1);
             return -1;
         }
 
-        if (socket_client_read_frame_data(buffer + buflen, len, maskkey) < 0) {
-            socket_client_close(0);
+        if (socket_client_read_frame_data(c, buffer + buflen,
+                                          len, maskkey) < 0) {
+            socket_client_close(c, 0);
             return -1;
         }
         buflen += len;
@@ -572,24 +1889,19 @@ static int socket_client_read_frame(char* buffer, int size) {
 }
 
 /* Send a version packet to the extension, and read VOK reply. */
-static int socket_client_sendversion(char* version) {
-    int versionlen = strlen(version);
-    char* outbuf = malloc(FRAMEMAXHEADERSIZE + versionlen);
-    memcpy(outbuf + FRAMEMAXHEADERSIZE, version, versionlen);
-
+static int socket_client_sendversion(struct ws_client* c, char* version) {
     log(2, "Sending version packet (%s).", version);
 
-    if (socket_client_write_frame(outbuf, versionlen, WS_OPCODE_TEXT, 1) < 0) {
+    if (socket_client_write_frame(c, version, strlen(version),
+                                  WS_OPCODE_TEXT, 1) < 0) {
         error("Write error.");
-        socket_client_close(0);
-        free(outbuf);
+        socket_client_close(c, 0);
         return -1;
     }
-    free(outbuf);
 
     /* Read response back */
     char buffer[256];
-    int buflen = socket_client_read_frame(buffer, sizeof(buffer));
+    int buflen = socket_client_read_frame(c, buffer, sizeof(buffer));
 
     buffer[buflen == 256 ? 255 : buflen] = 0;
     if (buflen != 3 || strcmp(buffer, "VOK")) {
@@ -599,7 +1911,7 @@ static int socket_client_sendversion(char* version) {
                 buffer[i] = '?';
         }
         error("Invalid response: %s.", buffer);
-        socket_client_close(1);
+        socket_client_close(c, 1);
         return -1;
     }
 
@@ -618,8 +1930,35 @@ const int OK_SEC_KEY = 0x40;     /* Sec-WebSocket-Key: 24 bytes */
 const int OK_HOST = 0x80;        /* Host: localhost:PORT */
 const int OK_ALL = 0xFF;         /* Final correct value is 0xFF */
 
-/* Send an error on a new client socket, then close the socket. */
-static void socket_server_error(int newclient_fd, int ok) {
+/* Reads at most size bytes from the (non-blocking) socket of a new client,
+ * waiting until deadline for data to come in. Returns the number of bytes
+ * read, or -1 on error, end of file or timeout. */
+static int socket_server_read(int fd, char* buffer, int size,
+                              uint64_t deadline) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while (1) {
+        int n = read(fd, buffer, size);
+        if (n > 0)
+            return n;
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        if (poll(&pfd, 1, deadline_timeout(deadline)) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/* Send an error on a new client socket (before deadline), then close the
+ * socket. */
+static void socket_server_error(int newclient_fd, int ok, uint64_t deadline) {
     /* Values found only in WebSocket header */
     const int OK_WEBSOCKET = OK_UPGRADE|OK_CONNECTION|OK_SEC_VERSION|
                              OK_VERSION|OK_SEC_KEY;
@@ -654,23 +1993,96 @@ static void socket_server_error(int newclient_fd, int ok) {
     log(3, "answer:\n%s===", buffer);
 
     /* Ignore errors */
-    block_write(newclient_fd, buffer, strlen(buffer));
+    deadline_io(newclient_fd, buffer, strlen(buffer), 1, deadline);
 
     close(newclient_fd);
 }
 
-/* Read and parse HTTP header.
+/* Removes leading and trailing blanks (and quotes) from str, in place. */
+static char* socket_server_trim(char* str) {
+    char* end;
+
+    while (*str == ' ' || *str == '\t' || *str == '"')
+        str++;
+    end = str + strlen(str);
+    while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '"'))
+        end--;
+    *end = '\0';
+    return str;
+}
+
+/* Looks for a permessage-deflate offer (RFC 7692) that server s can accept,
+ * in the value of a Sec-WebSocket-Extensions header (value is modified).
+ * Returns 1, and sets the compressor window size (window_bits) and context
+ * takeover mode, if one is found. Returns 0 otherwise. */
+static int socket_server_parse_deflate(struct ws_server* s, char* value,
+                                       int* window_bits, int* takeover) {
+    char* offer_ptr;
+    char* offer;
+
+    for (offer = strtok_r(value, ",", &offer_ptr); offer;
+            offer = strtok_r(NULL, ",", &offer_ptr)) {
+        char* param_ptr;
+        char* param = strtok_r(offer, ";", &param_ptr);
+        int ok = 1;
+        int bits = 15;
+        int keep = s->deflate_takeover;
+
+        if (!param || strcmp(socket_server_trim(param), "permessage-deflate"))
+            continue;
+
+        while (ok && (param = strtok_r(NULL, ";", &param_ptr))) {
+            char* arg = strchr(param, '=');
+            if (arg)
+                *arg++ = '\0';
+            param = socket_server_trim(param);
+
+            if (!strcmp(param, "server_no_context_takeover") && !arg) {
+                keep = 0;
+            } else if (!strcmp(param, "client_no_context_takeover") && !arg) {
+                /* Only matters to the client's compressor. */
+            } else if (!strcmp(param, "server_max_window_bits") && arg) {
+                /* zlib cannot compress with a 256-byte window (8 bits). */
+                bits = atoi(socket_server_trim(arg));
+                ok = bits >= 9 && bits <= 15;
+            } else if (!strcmp(param, "client_max_window_bits")) {
+                /* Our decompressor accepts any window size. */
+            } else {
+                log(1, "Unsupported permessage-deflate parameter: %s.",
+                    param);
+                ok = 0;
+            }
+        }
+
+        if (ok) {
+            *window_bits = bits;
+            *takeover = keep;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Read and parse HTTP header, sent to server s.
  * Returns 0 if the header is valid. websocket_key must be at least SECKEY_LEN
  * bytes long, and contains the value of Sec-WebSocket-Key on success.
+ * deflate_bits is set to the compressor window size if permessage-deflate
+ * is negotiated (0 otherwise), and takeover to its context takeover mode.
+ * The whole header must come in before deadline.
  * Returns < 0 in case of error: in that case newclient_fd is closed.
  */
-static int socket_server_read_header(int newclient_fd, char* websocket_key) {
+static int socket_server_read_header(struct ws_server* s, int newclient_fd,
+                                     char* websocket_key,
+                                     int* deflate_bits, int* takeover,
+                                     uint64_t deadline) {
     int first = 1;
     char buffer[BUFFERSIZE];
     int ok = 0x00;
 
+    *deflate_bits = 0;
     char* pbuffer = buffer;
-    int n = read(newclient_fd, buffer, BUFFERSIZE);
+    int n = socket_server_read(newclient_fd, buffer, BUFFERSIZE, deadline);
     if (n <= 0) {
         syserror("Cannot read from client.");
         close(newclient_fd);
@@ -694,7 +2106,8 @@ static int socket_server_read_header(int newclient_fd, char* websocket_key) {
                 pbuffer -= (key-buffer);
                 key = buffer;
 
-                n = read(newclient_fd, pbuffer, BUFFERSIZE-(pbuffer-buffer));
+                n = socket_server_read(newclient_fd, pbuffer,
+                                       BUFFERSIZE-(pbuffer-buffer), deadline);
                 if (n <= 0) {
                     syserror("Cannot read from client.");
                     close(newclient_fd);
@@ -754,7 +2167,7 @@ static int socket_server_read_header(int newclient_fd, char* websocket_key) {
         } else {
             if (!value) {
                 error("Invalid HTTP header (%s).", key);
-                socket_server_error(newclient_fd, 0x00);
+                socket_server_error(newclient_fd, 0x00, deadline);
                 return -1;
             }
 
@@ -779,100 +2192,146 @@ static int socket_server_read_header(int newclient_fd, char* websocket_key) {
                 ok |= OK_SEC_KEY;
             } else if (!strcmp(key, "Host")) {
                 char strbuf[32];
-                snprintf(strbuf, 32, "localhost:%d", port);
+                snprintf(strbuf, 32, "localhost:%d", s->port);
 
                 if (strcmp(value, strbuf)) {
                     error("Invalid Host field: '%s'.", value);
                     continue;
                 }
                 ok |= OK_HOST;
+            } else if (!strcmp(key, "Sec-WebSocket-Extensions")) {
+                if (s->deflate && !*deflate_bits &&
+                        socket_server_parse_deflate(s, value,
+                                                    deflate_bits, takeover)) {
+                    log(1, "permessage-deflate: %d bits, takeover %d.",
+                        *deflate_bits, *takeover);
+                }
             }
         }
     }
 
     if (ok != OK_ALL) {
         error("Some WebSocket headers missing (%x).", ~ok & OK_ALL);
-        socket_server_error(newclient_fd, ok);
+        socket_server_error(newclient_fd, ok, deadline);
         return -1;
     }
 
     return 0;
 }
 
-/* Accept a new client connection on the server socket. */
-static int socket_server_accept(char* version) {
+/* Frees the clients that have been closed. Pointers to these clients must
+ * not be used anymore. */
+static void socket_server_reap() {
+    int i = 0;
+
+    while (i < nclients) {
+        struct ws_client* c = clients[i];
+        if (c->fd >= 0) {
+            i++;
+            continue;
+        }
+        /* Remove c first: client_cleanup may not return (e.g. fbserver jumps
+         * back to its main loop when an X server goes away). */
+        nclients--;
+        memmove(&clients[i], &clients[i+1], (nclients-i)*sizeof(*clients));
+        if (client_cleanup)
+            client_cleanup(c);
+        free(c);
+    }
+}
+
+/* Returns the number of clients of server s that are still connected. */
+static int socket_server_nclients(struct ws_server* s) {
+    int i, n = 0;
+
+    for (i = 0; i < nclients; i++) {
+        if (clients[i]->fd >= 0 && clients[i]->server == s)
+            n++;
+    }
+    return n;
+}
+
+/* Fills fds with the client sockets, in the same order as clients (closed
+ * clients get fd -1). POLLOUT is requested if the client has data queued.
+ * fds must have room for WS_MAXCLIENTS entries. Returns nclients. */
+static int socket_server_pollfds(struct pollfd* fds) {
+    int i;
+
+    for (i = 0; i < nclients; i++) {
+        fds[i].fd = clients[i]->fd;
+        fds[i].events = POLLIN |
+                        (socket_client_queued(clients[i]) > 0 ? POLLOUT : 0);
+        fds[i].revents = 0;
+    }
+    return nclients;
+}
+
+/* Accept a new client connection on server socket s. If s already has
+ * maxclients clients, the oldest one is disconnected.
+ * Returns the new client, or NULL on error. Closed clients are freed. */
+static struct ws_client* socket_server_accept(struct ws_server* s,
+                                              char* version) {
     int newclient_fd;
     struct sockaddr_in client_addr;
     unsigned int client_addr_len = sizeof(client_addr);
     char buffer[BUFFERSIZE];
 
-    newclient_fd = accept(server_fd,
+    newclient_fd = accept(s->fd,
                           (struct sockaddr*)&client_addr, &client_addr_len);
 
     if (newclient_fd < 0) {
         syserror("Error accepting new connection.");
-        return -1;
+        return NULL;
     }
 
+    /* The event loop waits for the handshake: never for long. The socket
+     * is non-blocking until then. */
+    uint64_t deadline = gettime_us() + WS_IO_TIMEOUT * 1000ULL;
+    int flags = fcntl(newclient_fd, F_GETFL);
+    fcntl(newclient_fd, F_SETFL, flags | O_NONBLOCK);
+
     /* key from client + GUID */
     int websocket_keylen = SECKEY_LEN + strlen(GUID);
     char websocket_key[websocket_keylen];
+    int deflate_bits, takeover = 0;
 
     /* Read and parse HTTP header */
-    if (socket_server_read_header(newclient_fd, websocket_key) < 0) {
-        return -1;
+    if (socket_server_read_header(s, newclient_fd, websocket_key,
+                                  &deflate_bits, &takeover, deadline) < 0) {
+        return NULL;
     }
 
     log(1, "Header read successfully.");
 
-    /* Compute sha1+base64 response (RFC section 4.2.2, paragraph 5.4) */
-
-    char sha1[SHA1_LEN];
-
-    /* Some margin so we can read the full output of base64 */
-    int b64_len = SHA1_BASE64_LEN + 4;
-    char b64[b64_len];
-    int i;
+    /* Compute sha1+base64 response (RFC section 4.2.2, paragraph 5.4).
+     * e.g. (RFC section 1.3): dGhlIHNhbXBsZSBub25jZQ== gives
+     * s3pPLMBiTxaQ9kYGzzhZRbK+xOo= */
+    uint8_t digest[SHA1_LEN];
+    char b64[32];  /* At least SHA1_BASE64_LEN + 1 */
 
     memcpy(websocket_key + SECKEY_LEN, GUID, strlen(GUID));
-
-    /* SHA-1 is 20 bytes long (40 characters in hex form) */
-    if (popen2("sha1sum", NULL, websocket_key, websocket_keylen,
-               buffer, BUFFERSIZE) < 2*SHA1_LEN) {
-        error("sha1sum response too short.");
-        exit(1);
-    }
-
-    /* Make sure sscanf does not read too much data */
-    buffer[2*SHA1_LEN + 1] = '\0';
-    for (i = 0; i < SHA1_LEN; i++) {
-        unsigned int value;
-        if (sscanf(&buffer[i*2], "%02x", &value) != 1) {
-            buffer[2*SHA1_LEN] = 0;
-            error("Cannot read SHA-1 sum (%s).", buffer);
-            exit(1);
-        }
-        sha1[i] = (char)value;
-    }
-
-    /* base64 encoding of SHA1_LEN bytes must be SHA1_BASE64_LEN bytes long.
-     * Either the output is exactly SHA1_BASE64_LEN long, or the last character
-     * is a line feed (RFC 3548 forbids other characters in output) */
-    int n = popen2("base64", NULL, sha1, SHA1_LEN, b64, b64_len);
-    if (n < SHA1_BASE64_LEN ||
-            (n != SHA1_BASE64_LEN && b64[SHA1_BASE64_LEN] != '\r' &&
-             b64[SHA1_BASE64_LEN] != '\n')) {
-        error("Invalid base64 response.");
-        exit(1);
+    sha1(websocket_key, websocket_keylen, digest);
+    base64_encode(digest, SHA1_LEN, b64);
+
+    /* Accepted permessage-deflate parameters */
+    char extension[128] = "";
+    if (deflate_bits) {
+        char bits[48] = "";
+        if (deflate_bits < 15)
+            snprintf(bits, sizeof(bits), "; server_max_window_bits=%d",
+                     deflate_bits);
+        snprintf(extension, sizeof(extension),
+                 "Sec-WebSocket-Extensions: permessage-deflate%s%s\r\n",
+                 takeover ? "" : "; server_no_context_takeover", bits);
     }
-    b64[SHA1_BASE64_LEN] = '\0';
 
     int len = snprintf(buffer, BUFFERSIZE,
                        "HTTP/1.1 101 Switching Protocols\r\n"
                        "Upgrade: websocket\r\n"
                        "Connection: Upgrade\r\n"
                        "Sec-WebSocket-Accept: %s\r\n"
-                       "\r\n", b64);
+                       "%s"
+                       "\r\n", b64, extension);
 
     if (len == BUFFERSIZE) {
         error("Response length > %d.", BUFFERSIZE);
@@ -881,31 +2340,73 @@ static int socket_server_accept(char* version) {
 
     log(3, "HTTP response:\n%s===", buffer);
 
-    if (block_write(newclient_fd, buffer, len) != len) {
+    if (deadline_io(newclient_fd, buffer, len, 1, deadline) < 0) {
         syserror("Cannot write response.");
         close(newclient_fd);
-        return -1;
+        return NULL;
     }
+    fcntl(newclient_fd, F_SETFL, flags);
 
     log(2, "Response sent.");
 
-    /* Close existing connection, if any. */
-    if (client_fd >= 0)
-        socket_client_close(1);
+    /* Close the oldest connections, if needed. */
+    int i;
+    for (i = 0; i < nclients &&
+                socket_server_nclients(s) >= s->maxclients; i++) {
+        if (clients[i]->fd < 0 || clients[i]->server != s)
+            continue;
+        log(1, "Too many clients, closing the oldest one.");
+        socket_client_close(clients[i], 1);
+    }
+    socket_server_reap();
+
+    if (nclients >= WS_MAXCLIENTS) {
+        error("Too many clients in total, rejecting the new one.");
+        close(newclient_fd);
+        return NULL;
+    }
+
+    struct ws_client* c = calloc(1, sizeof(*c));
+    trueorabort(c, "Cannot allocate client");
+    c->fd = newclient_fd;
+    c->server = s;
+    if (deflate_bits) {
+        /* Favor speed: the data only goes through the loopback interface. */
+        int ret = deflateInit2(&c->zout, Z_BEST_SPEED, Z_DEFLATED,
+                               -deflate_bits, 8, Z_DEFAULT_STRATEGY);
+        trueorabort(ret == Z_OK, "deflateInit2 (%d)", ret);
+        ret = inflateInit2(&c->zin, -15);
+        trueorabort(ret == Z_OK, "inflateInit2 (%d)", ret);
+        c->deflate = 1;
+        c->deflate_takeover = takeover;
+    }
+    clients[nclients++] = c;
+    metric_inc(metric_connections);
 
-    client_fd = newclient_fd;
+    if (socket_client_sendversion(c, version) < 0)
+        return NULL;
 
-    return socket_client_sendversion(version);
+    return c;
 }
 
-/* Initialise WebSocket server */
-static void socket_server_init(int port_) {
+/* Initialise a WebSocket server on port port_, accepting up to maxclients
+ * (at most WS_MAXCLIENTS) simultaneous clients. May be called several times
+ * to listen on several ports. Never returns NULL.
+ * permessage-deflate is enabled, with context takeover, for messages of at
+ * least WS_DEFLATE_THRESHOLD bytes: callers may change that in the returned
+ * server before accepting clients. */
+static struct ws_server* socket_server_init(int port_, int maxclients) {
     struct sockaddr_in server_addr;
     int optval;
+    int server_fd;
 
-    port = port_;
+    trueorabort(maxclients > 0 && maxclients <= WS_MAXCLIENTS,
+                "Invalid number of clients (%d)", maxclients);
 
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (port < 0)
+        port = port_;
+
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd < 0) {
         syserror("Cannot create server socket.");
         exit(1);
@@ -919,7 +2420,7 @@ static void socket_server_init(int port_) {
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    server_addr.sin_port = htons(port);
+    server_addr.sin_port = htons(port_);
 
     if (bind(server_fd,
              (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
@@ -931,4 +2432,109 @@ static void socket_server_init(int port_) {
         syserror("Cannot listen on server socket.");
         exit(1);
     }
+
+    struct ws_server* s = calloc(1, sizeof(*s));
+    trueorabort(s, "Cannot allocate server");
+    s->fd = server_fd;
+    s->port = port_;
+    s->maxclients = maxclients;
+    s->deflate = 1;
+    s->deflate_takeover = 1;
+    s->deflate_threshold = WS_DEFLATE_THRESHOLD;
+    return s;
+}
+
+/* Writes all counters to fd, in text format. */
+static void metrics_write(int fd) {
+    char buffer[BUFFERSIZE];
+    int len = 0;
+    struct metric** lists[] = { metrics_common, metrics_server };
+    int i, j;
+
+    for (i = 0; i < sizeof(lists)/sizeof(lists[0]); i++) {
+        for (j = 0; lists[i] && lists[i][j]; j++) {
+            uint64_t value = __atomic_load_n(&lists[i][j]->value,
+                                             __ATOMIC_RELAXED);
+            len += snprintf(buffer + len, BUFFERSIZE - len, "%s %llu\n",
+                            lists[i][j]->name, (unsigned long long)value);
+            if (len >= BUFFERSIZE) {
+                error("Metrics too long.");
+                return;
+            }
+        }
+    }
+
+    /* MSG_NOSIGNAL: the reader may be gone already. */
+    int n = 0;
+    while (n < len) {
+        int w = send(fd, buffer + n, len - n, MSG_NOSIGNAL);
+        if (w <= 0)
+            return;
+        n += w;
+    }
+}
+
+/* Serves metrics requests, forever. */
+static void* metrics_thread(void* arg) {
+    int fd = (intptr_t)arg;
+
+    while (1) {
+        int newfd = accept(fd, NULL, NULL);
+        if (newfd < 0) {
+            if (errno == EINTR)
+                continue;
+            syserror("Cannot accept metrics connection.");
+            close(fd);
+            return NULL;
+        }
+        metrics_write(newfd);
+        close(newfd);
+    }
+}
+
+/* Starts serving metrics on @crouton-metrics-<port>, in a separate thread,
+ * where port is the port of the first server.
+ * server is a NULL-terminated array of server-specific counters.
+ * Must be called after socket_server_init(). Failure is not fatal. */
+static void metrics_init(struct metric** server) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    sigset_t sigmask, sigmask_orig;
+
+    metrics_server = server;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        syserror("Cannot create metrics socket.");
+        return;
+    }
+
+    /* Abstract socket: first byte of sun_path is '\0' */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                       "crouton-metrics-%d", port);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+
+    if (bind(fd, (struct sockaddr*)&addr, addrlen) < 0 || listen(fd, 5) < 0) {
+        syserror("Cannot bind metrics socket.");
+        close(fd);
+        return;
+    }
+
+    /* Signals must be handled by the main thread only. */
+    sigfillset(&sigmask);
+    pthread_sigmask(SIG_SETMASK, &sigmask, &sigmask_orig);
+    int ret = pthread_create(&thread, NULL, metrics_thread,
+                             (void*)(intptr_t)fd);
+    pthread_sigmask(SIG_SETMASK, &sigmask_orig, NULL);
+
+    if (ret != 0) {
+        error("Cannot create metrics thread (%d).", ret);
+        close(fd);
+        return;
+    }
+    pthread_detach(thread);
+
+    log(1, "Serving metrics on @crouton-metrics-%d.", port);
 }
@@ -19,55 +19,121 @@ static const char* USAGE =
 ;
 
 #include <X11/Xlib.h>
+#include <xcb/xcb.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
-int listMapped(Display *display, const char *arg) {
+/* Lists the mapped top-level windows, top-most first. All the attribute and
+ * name requests are sent before the first reply is read, so that listing
+ * takes two round-trips regardless of the number of windows. */
+int listMapped(xcb_connection_t *connection, xcb_window_t root,
+               const char *arg) {
     int one = strchr(arg, '1') != NULL;
     int asints = strchr(arg, 'i') != NULL;
     int names = strchr(arg, 'n') != NULL;
     int mark = strchr(arg, 'm') != NULL;
 
-    Window parent, root, *children;
-    unsigned int nchildren;
-    XWindowAttributes attributes;
-    char *name;
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    int nchildren, i;
+    xcb_get_window_attributes_cookie_t *attrcookies;
+    xcb_get_property_cookie_t *namecookies;
 
-    if (!XQueryTree(display, DefaultRootWindow(display), &root, &parent,
-                   &children, &nchildren))
+    tree = xcb_query_tree_reply(connection,
+                                xcb_query_tree(connection, root), NULL);
+    if (!tree)
         return 1;
-    if (!children)
-        return 0;
-
-    while (nchildren--) {
-        if (XGetWindowAttributes(display, children[nchildren],
-                    &attributes) && attributes.map_state == IsViewable) {
-            if (names) {
-                if (XFetchName(display, children[nchildren], &name) && name) {
-                    printf("%s ", name);
-                    XFree(name);
-                } else {
-                    printf("Unknown ");
-                }
-            }
-            printf(asints ? "%u" : "0x%x", (unsigned int)children[nchildren]);
-            printf(mark ? "*\n" : "\n");
-            mark = 0;
-            if (one) {
-                break;
+    children = xcb_query_tree_children(tree);
+    nchildren = xcb_query_tree_children_length(tree);
+
+    attrcookies = malloc(nchildren * sizeof(*attrcookies));
+    namecookies = malloc(nchildren * sizeof(*namecookies));
+    if (nchildren > 0 && (!attrcookies || !namecookies)) {
+        free(attrcookies);
+        free(namecookies);
+        free(tree);
+        return 1;
+    }
+
+    for (i = 0; i < nchildren; ++i) {
+        attrcookies[i] = xcb_get_window_attributes(connection, children[i]);
+        /* Same as XFetchName: only STRING names are accepted. */
+        if (names)
+            namecookies[i] = xcb_get_property(connection, 0, children[i],
+                                              XCB_ATOM_WM_NAME,
+                                              XCB_ATOM_STRING, 0, 1000000);
+    }
+
+    /* Replies must all be collected (or discarded), even after the topmost
+     * window has been found. */
+    for (i = nchildren-1; i >= 0; --i) {
+        xcb_get_window_attributes_reply_t *attributes;
+        xcb_get_property_reply_t *name = NULL;
+        int viewable;
+
+        if (one && mark < 0) {
+            xcb_discard_reply(connection, attrcookies[i].sequence);
+            viewable = 0;
+        } else {
+            attributes = xcb_get_window_attributes_reply(connection,
+                                                         attrcookies[i],
+                                                         NULL);
+            viewable = attributes &&
+                       attributes->map_state == XCB_MAP_STATE_VIEWABLE;
+            free(attributes);
+        }
+
+        if (!viewable) {
+            if (names)
+                xcb_discard_reply(connection, namecookies[i].sequence);
+            continue;
+        }
+
+        if (names) {
+            name = xcb_get_property_reply(connection, namecookies[i], NULL);
+            if (name && name->type == XCB_ATOM_STRING && name->format == 8 &&
+                    xcb_get_property_value_length(name) > 0) {
+                printf("%.*s ", xcb_get_property_value_length(name),
+                       (char*)xcb_get_property_value(name));
+            } else {
+                printf("Unknown ");
             }
+            free(name);
         }
+        printf(asints ? "%u" : "0x%x", (unsigned int)children[i]);
+        printf(mark > 0 ? "*\n" : "\n");
+        /* Negative once the topmost window has been listed. */
+        mark = -1;
     }
 
-    XFree(children);
+    free(attrcookies);
+    free(namecookies);
+    free(tree);
     return 0;
 }
 
+/* Returns non-zero if another client grabs the pointer or the keyboard. */
+int isGrabbed(Display *display) {
+    Window root = DefaultRootWindow(display);
+    int pointer, keyboard;
+
+    pointer = XGrabPointer(display, root, False, 0, GrabModeAsync,
+                           GrabModeAsync, None, None, CurrentTime);
+    if (pointer == GrabSuccess)
+        XUngrabPointer(display, CurrentTime);
+    keyboard = XGrabKeyboard(display, root, False, GrabModeAsync,
+                             GrabModeAsync, CurrentTime);
+    if (keyboard == GrabSuccess)
+        XUngrabKeyboard(display, CurrentTime);
+    return pointer == AlreadyGrabbed || keyboard == AlreadyGrabbed;
+}
+
 int raiseWindow(Display *display, Window window) {
-    Window parent, root, *children, *neworder;
+    Window parent, root, *children;
     unsigned int nchildren, i, rotate;
-    XWindowAttributes attr;
+    XWindowAttributes attr, rootattr;
+    int grabbed = 0;
 
     if (!XQueryTree(display, DefaultRootWindow(display), &root, &parent,
                    &children, &nchildren))
@@ -85,35 +151,41 @@ int raiseWindow(Display *display, Window window) {
     }
 
     if (rotate > 0) {
-        /* Unmap and remap the old top-level window to kill off any mouse and
-         * keyboard hooks */
-        XUnmapWindow(display, children[nchildren-1]);
-
-        neworder = (Window*)malloc(nchildren * sizeof(*neworder));
-        /* XQueryTree returns children in back-to-front order, while
-         * XRestackWindows takes a front-to-back list. Reverse the order and
-         * rotate the position of the children -n positions to put the requested
-         * window into the first position in the list.
-         */
-        for (i = 0; i < nchildren; ++i) {
-            neworder[nchildren-1 - ((i+rotate) % nchildren)] = children[i];
-        }
-        XRestackWindows(display, neworder, nchildren);
-        free(neworder);
+        /* Unmapping the old top-level window kills off its mouse and
+         * keyboard grabs, but makes it repaint entirely: only do it if
+         * something actually grabs. */
+        grabbed = isGrabbed(display);
+        if (grabbed)
+            XUnmapWindow(display, children[nchildren-1]);
+
+        /* Raise the window first: the windows above it are then covered
+         * while they are moved to the bottom, keeping their relative order
+         * (XQueryTree returns children in back-to-front order), so that
+         * only the raised window needs to be exposed. */
+        XRaiseWindow(display, window);
+        for (i = 0; i < rotate; ++i)
+            XLowerWindow(display, children[nchildren-1 - i]);
 
         /* Split the map from the unmap to reduce the number of events */
-        XMapWindow(display, children[nchildren-1]);
+        if (grabbed)
+            XMapWindow(display, children[nchildren-1]);
     }
     XFree(children);
 
-    if (!XGetWindowAttributes(display, DefaultRootWindow(display), &attr)) {
+    if (!XGetWindowAttributes(display, DefaultRootWindow(display),
+                              &rootattr) ||
+            !XGetWindowAttributes(display, window, &attr))
         return 1;
-    }
-    /* Twiddle the width of the window to force a full refresh */
-    XMoveResizeWindow(display, window,
-                      attr.x, attr.y, attr.width-1, attr.height);
-    XMoveResizeWindow(display, window,
-                      attr.x, attr.y, attr.width,   attr.height);
+    /* Raised windows cover the whole screen: fix up the geometry of a window
+     * that does not (e.g. after a resolution change). */
+    if (attr.x != rootattr.x || attr.y != rootattr.y ||
+            attr.width != rootattr.width || attr.height != rootattr.height)
+        XMoveResizeWindow(display, window, rootattr.x, rootattr.y,
+                          rootattr.width, rootattr.height);
+    /* Expose the whole window to force a full refresh of it (but only of
+     * it), in case its client missed the exposures. */
+    if (attr.class == InputOutput)
+        XClearArea(display, window, 0, 0, 0, 0, True);
 
     return 0;
 }
@@ -122,25 +194,39 @@ void usage(char** argv) {
     fprintf(stderr, USAGE, argv[0], argv[0]);
 }
 
+/* Listing only needs XCB: no need to wait for each reply. */
+int list(const char *arg) {
+    int ret, screen;
+    xcb_connection_t *connection = xcb_connect(NULL, &screen);
+    xcb_screen_iterator_t it;
+
+    if (xcb_connection_has_error(connection)) {
+        fputs("Unable to open display\n", stderr);
+        xcb_disconnect(connection);
+        return 1;
+    }
+    it = xcb_setup_roots_iterator(xcb_get_setup(connection));
+    for (; it.rem > 0 && screen > 0; --screen)
+        xcb_screen_next(&it);
+    ret = listMapped(connection, it.data->root, arg);
+    xcb_disconnect(connection);
+    return ret;
+}
+
 int main(int argc, char** argv) {
     int ret = 2;
     if (argc < 2 || argc > 3) {
         usage(argv);
         return 2;
     }
+    if (argv[1][0] == 'l')
+        return list(argc >= 3 ? argv[2] : "");
     Display *display = XOpenDisplay(NULL);
     if (!display) {
         fputs("Unable to open display\n", stderr);
         return 1;
     }
     switch (argv[1][0]) {
-        case 'l':
-            if (argc > 3) {
-                usage(argv);
-                break;
-            }
-            ret = listMapped(display, argc >= 3 ? argv[2] : "");
-            break;
         case 'r':
             if (argc != 3) {
                 usage(argv);
@@ -0,0 +1,93 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * XInput 2 raw event selection, shared by the tools that monitor input
+ * events on the root window.
+ */
+
+#ifndef XI2_H_
+#define XI2_H_
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Binary record written by croutonxi2event -b, in host byte order. Unset
+ * valuators, and valuators beyond XI2_RECORD_VALUATORS, are NAN. */
+#define XI2_RECORD_VALUATORS 16
+
+struct xi2_record {
+    int32_t evtype;
+    int32_t deviceid, sourceid;
+    int32_t detail;
+    int32_t nvaluators;  /* Index of the last set valuator, plus one */
+    uint32_t mask;  /* Bit i is set if valuator i is set */
+    double valuators[XI2_RECORD_VALUATORS];
+};
+
+/* Select the given XInput 2 event types of a device (e.g.
+ * XIAllMasterDevices) on the root window. With no types, all raw input
+ * events (keys, buttons, motion, touch) are selected. Returns the XInput
+ * opcode, or -1 if the extension is not available. */
+static int xi2_select(Display* display, int deviceid,
+                      const int* types, int ntypes) {
+    static const int raw[] = {
+        XI_RawKeyPress, XI_RawKeyRelease,
+        XI_RawButtonPress, XI_RawButtonRelease,
+        XI_RawMotion,
+        XI_RawTouchBegin, XI_RawTouchUpdate, XI_RawTouchEnd
+    };
+    int xi_opcode, firstev, firsterr, i;
+    XIEventMask eventmask;
+    unsigned char mask[XIMaskLen(XI_LASTEVENT)];
+
+    if (!XQueryExtension(display, "XInputExtension",
+                         &xi_opcode, &firstev, &firsterr)) {
+        fprintf(stderr, "X Input extension not available.\n");
+        return -1;
+    }
+
+    if (!types) {
+        types = raw;
+        ntypes = sizeof(raw) / sizeof(raw[0]);
+    }
+
+    eventmask.deviceid = deviceid;
+    memset(mask, 0, sizeof(mask));
+    for (i = 0; i < ntypes; i++)
+        XISetMask(mask, types[i]);
+    eventmask.mask = mask;
+    eventmask.mask_len = sizeof(mask);
+
+    /* Listen on root window so that we do not need to create our own. */
+    XISelectEvents(display, DefaultRootWindow(display), &eventmask, 1);
+    return xi_opcode;
+}
+
+/* Returns non-zero if evtype is a raw input event type. */
+static int xi2_raw_type(int evtype) {
+    switch (evtype) {
+    case XI_RawKeyPress:
+    case XI_RawKeyRelease:
+    case XI_RawButtonPress:
+    case XI_RawButtonRelease:
+    case XI_RawMotion:
+    case XI_RawTouchBegin:
+    case XI_RawTouchUpdate:
+    case XI_RawTouchEnd:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Returns non-zero if the cookie is one of the raw events. */
+static int xi2_is_raw(XGenericEventCookie* cookie, int xi_opcode) {
+    return cookie->extension == xi_opcode && cookie->type == GenericEvent &&
+           xi2_raw_type(cookie->evtype);
+}
+
+#endif /* XI2_H_ */
@@ -6,13 +6,14 @@
  * motion/clicks, etc.
  */
 
-#include <X11/Xlib.h>
+#include "xi2.h"
 #include <X11/extensions/XInput.h>
-#include <X11/extensions/XInput2.h>
 #include <X11/Xutil.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /* Print a XIRawEvent, including the list of valuators, all on one line. */
 static void print_rawevent(XIRawEvent *event) {
@@ -44,32 +45,86 @@ static void print_rawevent(XIRawEvent *event) {
     printf("\n");
 }
 
+/* Write a XIRawEvent as a binary record (struct xi2_record). */
+static void write_rawevent(XIRawEvent *event) {
+    struct xi2_record record;
+    double *val = event->valuators.values;
+    int i;
+
+    record.evtype = event->evtype;
+    record.deviceid = event->deviceid;
+    record.sourceid = event->sourceid;
+    record.detail = event->detail;
+    record.nvaluators = 0;
+    record.mask = 0;
+    for (i = 0; i < XI2_RECORD_VALUATORS; i++)
+        record.valuators[i] = NAN;
+
+    for (i = 0; i < event->valuators.mask_len * 8; i++) {
+        if (XIMaskIsSet(event->valuators.mask, i)) {
+            if (i < XI2_RECORD_VALUATORS) {
+                record.valuators[i] = *val;
+                record.mask |= 1 << i;
+            }
+            val++;
+            record.nvaluators = i+1;
+        }
+    }
+
+    fwrite(&record, sizeof(record), 1, stdout);
+}
+
 void usage(char* argv0) {
-    fprintf(stderr, "%s [-1]\n", argv0);
+    fprintf(stderr, "%s [-1] [-b] [-t type]... [-d device]...\n", argv0);
     fprintf(stderr, "   Monitors and displays XInput 2 raw events.\n");
     fprintf(stderr, "   -1: only wait for one event, then exit.\n");
+    fprintf(stderr, "   -b: write binary records (struct xi2_record in "
+                    "src/xi2.h) instead of text.\n");
+    fprintf(stderr, "   -t: only report raw events of this XI2 type "
+                    "(e.g. 17 for XI_RawMotion).\n");
+    fprintf(stderr, "   -d: only report events of this device id.\n");
     exit(1);
 }
 
 int main(int argc, char *argv[]) {
-    int firstev, firsterr;
     int xi_opcode = -1;
     int one_event = 0;
+    int binary = 0;
     int terminate = 0;
+    int types[XI_LASTEVENT+1], ntypes = 0;
+    int devices[64], ndevices = 0;
+    int c, i;
 
-    /* stdout: line buffering */
-    setvbuf(stdout, NULL, _IOLBF, 0);
-
-    /* Parse arguments */
-    if (argc == 2) {
-        printf("%s", argv[1]);
-        if (strcmp(argv[1], "-1") == 0)
+    while ((c = getopt(argc, argv, "1bt:d:")) != -1) {
+        switch (c) {
+        case '1':
             one_event = 1;
-        else
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 't':
+            if (ntypes > XI_LASTEVENT || !xi2_raw_type(atoi(optarg)))
+                usage(argv[0]);
+            types[ntypes++] = atoi(optarg);
+            break;
+        case 'd':
+            if (ndevices >= (int)(sizeof(devices)/sizeof(devices[0])) ||
+                    atoi(optarg) <= 0)
+                usage(argv[0]);
+            devices[ndevices++] = atoi(optarg);
+            break;
+        default:
             usage(argv[0]);
-    } else if (argc > 2) {
-        usage(argv[0]);
+        }
     }
+    if (optind != argc)
+        usage(argv[0]);
+
+    /* Text: line buffering. Binary: records are flushed once the pending
+     * events have been handled. */
+    if (!binary)
+        setvbuf(stdout, NULL, _IOLBF, 0);
 
     Display* display = XOpenDisplay(NULL);
 
@@ -78,62 +133,38 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    if (!XQueryExtension(display, "XInputExtension",
-                         &xi_opcode, &firstev, &firsterr)) {
-        fprintf(stderr, "X Input extension not available.\n");
-        exit(1);
+    /* Filtering is done by the server, through the event masks. */
+    if (ndevices == 0)
+        devices[ndevices++] = XIAllMasterDevices;
+    for (i = 0; i < ndevices; i++) {
+        xi_opcode = xi2_select(display, devices[i],
+                               ntypes > 0 ? types : NULL, ntypes);
+        if (xi_opcode < 0)
+            exit(1);
     }
 
-    /* Listen on root window so that we do not need to create our own. */
-    Window win = DefaultRootWindow(display);
-
-    XIEventMask eventmask;
-
-    eventmask.deviceid = XIAllMasterDevices;
-    unsigned char mask[XIMaskLen(XI_LASTEVENT)];
-    memset(mask, 0, sizeof(mask));
-    XISetMask(mask, XI_RawKeyPress);
-    XISetMask(mask, XI_RawKeyRelease);
-    XISetMask(mask, XI_RawButtonPress);
-    XISetMask(mask, XI_RawButtonRelease);
-    XISetMask(mask, XI_RawMotion);
-    XISetMask(mask, XI_RawTouchBegin);
-    XISetMask(mask, XI_RawTouchUpdate);
-    XISetMask(mask, XI_RawTouchEnd);
-    eventmask.mask = mask;
-    eventmask.mask_len = sizeof(mask);
-
-    /* select on the window */
-    XISelectEvents(display, win, &eventmask, 1);
-
     XEvent event;
     XGenericEventCookie *cookie = &event.xcookie;
 
     while (!terminate) {
+        if (binary && XPending(display) == 0 && fflush(stdout) != 0)
+            break;
+
         XNextEvent(display, &event);
 
         if (XGetEventData(display, cookie)) {
-            if (cookie->extension == xi_opcode && cookie->type == GenericEvent) {
-                switch(cookie->evtype) {
-                case XI_RawKeyPress:
-                case XI_RawKeyRelease:
-                case XI_RawButtonPress:
-                case XI_RawButtonRelease:
-                case XI_RawMotion:
-                case XI_RawTouchBegin:
-                case XI_RawTouchUpdate:
-                case XI_RawTouchEnd:
+            if (xi2_is_raw(cookie, xi_opcode)) {
+                if (binary)
+                    write_rawevent(cookie->data);
+                else
                     print_rawevent(cookie->data);
-                    if (one_event)
-                        terminate = 1;
-                    break;
-                default:
-                    break;
-                }
+                if (one_event)
+                    terminate = 1;
             }
             XFreeEventData(display, cookie);
         }
     }
 
+    fflush(stdout);
     return 0;
 }
@@ -0,0 +1,64 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Microbenchmark of the WebSocket unmasking variants of src/websocket.h,
+ * over typical payload sizes (input events, clipboard, large pastes).
+ * Run with: make bench
+ */
+
+#include "websocket.h"
+
+#define BENCH_BYTES (256*1048576)  /* Unmasked per variant and size */
+
+struct unmask_variant {
+    const char* name;
+    void (*unmask)(char* buffer, size_t size, uint32_t maskkey);
+    int supported;
+};
+
+int main(int argc, char** argv) {
+    struct unmask_variant variants[] = {
+        { "scalar", ws_unmask_scalar, 1 },
+        { "vector", ws_unmask_vector, 1 },
+#ifdef WS_UNMASK_AVX2
+        { "avx2", ws_unmask_avx2, __builtin_cpu_supports("avx2") },
+#endif
+#ifdef WS_UNMASK_NEON
+        { "neon", ws_unmask_neon, !!(getauxval(AT_HWCAP) & HWCAP_NEON) },
+#endif
+    };
+    const int nvariants = sizeof(variants) / sizeof(variants[0]);
+    const size_t sizes[] = { 16, 128, 4096, 65536, 1048576 };
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    static char buffer[1048576 + 1];
+    int i, j;
+
+    memset(buffer, 0xA5, sizeof(buffer));
+
+    printf("%-8s", "MB/s");
+    for (j = 0; j < nsizes; j++)
+        printf(" %10zu", sizes[j]);
+    printf("\n");
+
+    for (i = 0; i < nvariants; i++) {
+        if (!variants[i].supported)
+            continue;
+        printf("%-8s", variants[i].name);
+        for (j = 0; j < nsizes; j++) {
+            size_t n, iters = BENCH_BYTES / sizes[j];
+            /* Unaligned buffer, like a payload after a frame header. */
+            char* payload = buffer + 1;
+            uint64_t start = gettime_us();
+
+            for (n = 0; n < iters; n++)
+                variants[i].unmask(payload, sizes[j], 0x3d21fa37 + n);
+            uint64_t elapsed = gettime_us() - start;
+            printf(" %10.0f", elapsed ? (double)BENCH_BYTES / elapsed : 0);
+        }
+        printf("\n");
+    }
+
+    /* Keep the compiler from dropping the unmasking. */
+    return buffer[1] == 0x42;
+}
@@ -0,0 +1,160 @@
+/* Copyright (c) 2015 The crouton Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Unit tests for the self-contained helpers of src/websocket.h.
+ * Run with: make check
+ */
+
+#include "websocket.h"
+
+static int failures = 0;
+
+#define check(expr, str, ...) do { \
+    if (!(expr)) { \
+        printf("%s: FAILED " #expr " (" str ")\n", __func__, ##__VA_ARGS__); \
+        failures++; \
+    } \
+} while (0)
+
+/* Returns the hex representation of a SHA-1 digest (in a static buffer). */
+static char* sha1_hex(const char* data, size_t len) {
+    static char hex[41];  /* 2*SHA1_LEN + 1 */
+    uint8_t digest[SHA1_LEN];
+    int i;
+
+    sha1(data, len, digest);
+    for (i = 0; i < SHA1_LEN; i++)
+        sprintf(hex + 2*i, "%02x", digest[i]);
+    return hex;
+}
+
+/* FIPS 180-2 test vectors (appendix A), and block boundaries. */
+static void test_sha1() {
+    static char million[1000000];
+    char* hex;
+
+    hex = sha1_hex("", 0);
+    check(!strcmp(hex, "da39a3ee5e6b4b0d3255bfef95601890afd80709"),
+          "%s", hex);
+    hex = sha1_hex("abc", 3);
+    check(!strcmp(hex, "a9993e364706816aba3e25717850c26c9cd0d89d"),
+          "%s", hex);
+    hex = sha1_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+                   56);
+    check(!strcmp(hex, "84983e441c3bd26ebaae4aa1f95129e5e54670f1"),
+          "%s", hex);
+    memset(million, 'a', sizeof(million));
+    hex = sha1_hex(million, sizeof(million));
+    check(!strcmp(hex, "34aa973cd4c4daa4f61eeb2bdbad27316534016f"),
+          "%s", hex);
+}
+
+static void test_base64() {
+    const char* expected[] = { "", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==",
+                               "Zm9vYmE=", "Zm9vYmFy" };
+    char out[16];
+    int i, n;
+
+    /* RFC 4648 section 10 */
+    for (i = 0; i < 7; i++) {
+        n = base64_encode((const uint8_t*)"foobar", i, out);
+        check(n == strlen(expected[i]) && !strcmp(out, expected[i]),
+              "%d: %s", i, out);
+    }
+}
+
+/* Sec-WebSocket-Accept example from RFC 6455 section 1.3, computed the way
+ * socket_server_accept() does. */
+static void test_handshake() {
+    const char* key = "dGhlIHNhbXBsZSBub25jZQ==";
+    char websocket_key[SECKEY_LEN + strlen(GUID)];
+    uint8_t digest[SHA1_LEN];
+    char b64[32];
+    int n;
+
+    memcpy(websocket_key, key, SECKEY_LEN);
+    memcpy(websocket_key + SECKEY_LEN, GUID, strlen(GUID));
+    sha1(websocket_key, sizeof(websocket_key), digest);
+    n = base64_encode(digest, SHA1_LEN, b64);
+    check(n == SHA1_BASE64_LEN && !strcmp(b64, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="),
+          "%s", b64);
+}
+
+/* Unmasking variants, checked against ws_unmask_scalar. */
+struct unmask_variant {
+    const char* name;
+    void (*unmask)(char* buffer, size_t size, uint32_t maskkey);
+    int supported;
+};
+
+/* Compare each unmasking variant with ws_unmask_scalar, over random lengths
+ * (including 0 and all the sizes around the vector widths), buffer offsets
+ * (alignments) and mask keys. */
+static void test_unmask() {
+    struct unmask_variant variants[] = {
+        { "vector", ws_unmask_vector, 1 },
+#ifdef WS_UNMASK_AVX2
+        { "avx2", ws_unmask_avx2, __builtin_cpu_supports("avx2") },
+#endif
+#ifdef WS_UNMASK_NEON
+        { "neon", ws_unmask_neon, !!(getauxval(AT_HWCAP) & HWCAP_NEON) },
+#endif
+        { "ws_unmask", ws_unmask, 1 },
+    };
+    const int nvariants = sizeof(variants) / sizeof(variants[0]);
+    /* Largest size + offset + guard */
+    char data[1024+64+16], expected[1024+64+16], buffer[1024+64+16];
+    int i, iter, j;
+
+    srand(42);
+    for (i = 0; i < nvariants; i++) {
+        if (!variants[i].supported) {
+            printf("%s: skipping %s (not supported).\n", __func__,
+                   variants[i].name);
+            continue;
+        }
+        for (iter = 0; iter < 20000; iter++) {
+            size_t size = iter < 100 ? iter : rand() % 1024;
+            size_t offset = rand() % 64;
+            uint32_t maskkey = ((uint32_t)rand() << 16) ^ rand();
+
+            for (j = 0; j < size + offset; j++)
+                data[j] = rand();
+            /* Guard bytes after the buffer must not be touched. */
+            memset(data + size + offset, 0x5A, 16);
+            memcpy(expected, data, sizeof(data));
+            memcpy(buffer, data, sizeof(data));
+
+            ws_unmask_scalar(expected + offset, size, maskkey);
+            variants[i].unmask(buffer + offset, size, maskkey);
+            if (memcmp(expected, buffer, size + offset + 16)) {
+                check(0, "%s: size %zu, offset %zu, mask %08x",
+                      variants[i].name, size, offset, maskkey);
+                break;
+            }
+        }
+    }
+
+    /* The scalar version itself: masked "Hello" example of RFC 6455
+     * section 5.7 (the mask key is in wire order). */
+    uint32_t maskkey;
+    memcpy(&maskkey, "\x37\xfa\x21\x3d", 4);
+    memcpy(buffer, "\x7f\x9f\x4d\x51\x58", 5);
+    ws_unmask_scalar(buffer, 5, maskkey);
+    check(!memcmp(buffer, "Hello", 5), "%.5s", buffer);
+}
+
+int main(int argc, char** argv) {
+    test_sha1();
+    test_base64();
+    test_handshake();
+    test_unmask();
+
+    if (failures) {
+        printf("%d test(s) failed.\n", failures);
+        return 1;
+    }
+    printf("All tests passed.\n");
+    return 0;
+}